@@ -0,0 +1,469 @@
+/** @file 	mandelbrot_buddha.c
+ *	@brief	Open MPI and OpenMP C implementation to compute and plot the
+ *	Buddhabrot of the mandelbrot set
+ *
+ *	Open MPI and OpenMP C implementation of a program that plots the density
+ *  of the escaping orbits of the mandelbrot set (the Buddhabrot) instead of
+ *  their escape time. Random points c are drawn from the sampling square
+ *  [SAMPLE_MIN, SAMPLE_MAX]^2, the orbits of those that escape after at
+ *  least --min-iter iterations are traced again and every point of the orbit
+ *  inside the window adds one to its pixel.
+ *
+ *	Sampling is seeded from an escape time grid of GRID_SIZE x GRID_SIZE
+ *	cells over the sampling square, computed once and shared by all the
+ *	processes: only the cells with a corner escaping after at least
+ *	--min-iter iterations, or with corners both inside and outside the set,
+ *	are sampled, so most random points are traced orbits. This is a biased
+ *	heuristic: judging a cell by its corners misses the thin filaments that
+ *	cross it without touching them, so some long orbits are never drawn and
+ *	the image is slightly darker there than with uniform sampling.
+ *
+ *	Every OpenMP thread draws its own random points into its own density
+ *	buffer, so the threads never share a pixel while sampling. The buffers of
+ *	the threads of a process are then added pairwise in log2(threads) steps
+ *	and the buffers of the processes are added on process zero by MPI_Reduce,
+ *	in chunks of REDUCE_CHUNK pixels since MPI counts are ints.
+ *
+ *	Usage:
+ *    mpirun -np NP ./mandelbrot_buddha c_x_min c_x_max c_y_min c_y_max image_size [options]
+ *		- NP: Number of Open MPI processes (OMP_NUM_THREADS threads each)
+ *		- c_x_min: Lowest x boundary for the figure to be computed
+ *		- c_x_max: Highest x boundary for the figure to be computed
+ *		- c_y_mix: Lowest y boundary for the figure to be computed
+ *		- c_y_max: Highest y boundary for the figure to be computed
+ *		- image_size: The resolution of the resulting image
+ *	Options:
+ *		- --samples=N: Random points drawn by all the threads of all the
+ *		  processes together (default SAMPLES)
+ *		- --min-iter=N: Shortest escaping orbit that is plotted (default
+ *		  MIN_ITER)
+ *		- --seed=S: Seed of the random points, the image only depends on it,
+ *		  on the number of processes and on the number of threads
+ *
+ *	Process zero writes mandelbrot_buddha.ppm, the square root of the density
+ *	scaled to the densest pixel, and reports the samples traced per second.
+ *  Usage examples:
+ *      Full Picture: mpirun -np 4 ./mandelbrot_buddha -2.0 2.0 -2.0 2.0 1024
+ *      Seahorse Valley: mpirun -np 4 ./mandelbrot_buddha -0.8 -0.7 0.05 0.15 1024 --samples=100000000
+ *
+ *	@author		Decio Lauro Soares (deciolauro@gmail.com)
+ *	@date		05 Jul 2017
+ *	@bug		No known bugs
+ * 	@copyright	GNU Public License v3
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <omp.h>
+#include <mpi.h>
+
+#define MAX_ITER 1000
+#define MIN_ITER 20
+#define ESCAPE_RADIUS_SQUARED 4
+#define SAMPLES 10000000L
+#define SAMPLE_MIN -2.0
+#define SAMPLE_MAX 2.0
+#define GRID_SIZE 512
+#define REDUCE_CHUNK (1<<24)
+
+
+/**
+ * @brief Number of iterations until the orbit of c escapes
+ *
+ * @param cr real part of c
+ * @param ci imaginary part of c
+ * @return i integer with the number of iterations until divergerce or MAX_ITER
+ */
+int escape_time(double cr, double ci)
+{
+	int i;
+	double zr, zi, t;
+
+	zr = zi = 0;
+	for(i=1; i<MAX_ITER; i++)
+	{
+		t = zr*zr-zi*zi+cr;
+		zi = 2*zr*zi+ci;
+		zr = t;
+		if(zr*zr+zi*zi>ESCAPE_RADIUS_SQUARED)
+			break;
+	}
+
+	return i;
+}
+
+
+/**
+ * @brief Next random number of a thread (xorshift64*)
+ *
+ * @param state state of the generator of the thread, never 0
+ * @return 64 random bits
+ */
+unsigned long long next_random(unsigned long long *state)
+{
+	*state ^= *state>>12;
+	*state ^= *state<<25;
+	*state ^= *state>>27;
+	return *state*0x2545F4914F6CDD1DULL;
+}
+
+
+/**
+ * @brief Random number uniform in [0, 1)
+ *
+ * @param state state of the generator of the thread
+ * @return the random number
+ */
+double next_uniform(unsigned long long *state)
+{
+	return (next_random(state)>>11)*(1.0/9007199254740992.0);
+}
+
+
+/**
+ * @brief Seed the generator of one thread of one process
+ *
+ * The seed is scrambled by splitmix64 so neighboring threads get unrelated
+ * sequences.
+ *
+ * @param seed seed given on the command line
+ * @param stream index of the thread among all the threads of all processes
+ * @return state of the generator
+ */
+unsigned long long seed_random(unsigned long long seed, unsigned long long stream)
+{
+	unsigned long long z;
+
+	z = seed+(stream+1)*0x9E3779B97F4A7C15ULL;
+	z = (z^(z>>30))*0xBF58476D1CE4E5B9ULL;
+	z = (z^(z>>27))*0x94D049BB133111EBULL;
+	z ^= z>>31;
+	return z ? z : 1;
+}
+
+
+/**
+ * @brief Find the cells of the sampling square worth sampling
+ *
+ * The escape time of the (GRID_SIZE+1)^2 corners is split by rows among the
+ * processes and by the threads of each process, then shared by all of them.
+ *
+ * @param min_iter shortest escaping orbit that is plotted
+ * @param rank rank of the process
+ * @param nproc number of processes
+ * @param cells receives the indices of the cells worth sampling
+ * @return number of cells in cells
+ */
+int build_grid(int min_iter, int rank, int nproc, int *cells)
+{
+	int i, j, k, n, in, out, ncells, *iters;
+	double step;
+
+	step = (SAMPLE_MAX-SAMPLE_MIN)/GRID_SIZE;
+	iters = calloc((GRID_SIZE+1)*(GRID_SIZE+1), sizeof(int));
+	if(!iters)
+	{
+		fprintf(stderr, "Unable to allocate the sampling grid\n");
+		MPI_Abort(MPI_COMM_WORLD, 1);
+	}
+
+	#pragma omp parallel for private(j) schedule(dynamic)
+	for(i=rank; i<=GRID_SIZE; i+=nproc)
+		for(j=0; j<=GRID_SIZE; j++)
+			iters[i*(GRID_SIZE+1)+j] = escape_time(SAMPLE_MIN+j*step, SAMPLE_MAX-i*step);
+
+	MPI_Allreduce(MPI_IN_PLACE, iters, (GRID_SIZE+1)*(GRID_SIZE+1), MPI_INT, MPI_MAX, MPI_COMM_WORLD);
+
+	ncells = 0;
+	for(i=0; i<GRID_SIZE; i++)
+	{
+		for(j=0; j<GRID_SIZE; j++)
+		{
+			in = out = 0;
+			for(n=0; n<4; n++)
+			{
+				k = iters[(i+n/2)*(GRID_SIZE+1)+j+n%2];
+
+				if(k==MAX_ITER)
+					in = 1;
+				else if(k>=min_iter)
+					in = out = 1;
+				else
+					out = 1;
+			}
+			if(in && out)
+				cells[ncells++] = i*GRID_SIZE+j;
+		}
+	}
+
+	free(iters);
+	return ncells;
+}
+
+
+/**
+ * @brief Trace the orbits of the random points of one thread
+ *
+ * @param samples number of random points drawn
+ * @param state state of the generator of the thread
+ * @param cells cells worth sampling found by build_grid
+ * @param ncells number of cells in cells
+ * @param min_iter shortest escaping orbit that is plotted
+ * @param c_x_min lowest x boundary of the image
+ * @param c_y_max highest y boundary of the image
+ * @param pixel_width width of a pixel
+ * @param pixel_height height of a pixel
+ * @param image_size the resolution of the image
+ * @param density image_size*image_size counters of the thread
+ * @return number of orbits plotted
+ */
+long trace_samples(long samples, unsigned long long *state, const int *cells, int ncells, int min_iter,
+	double c_x_min, double c_y_max, double pixel_width, double pixel_height,
+	int image_size, unsigned int *density)
+{
+	long s, kept;
+	int i, j, k, n, cell;
+	double cr, ci, zr, zi, t, step;
+
+	step = (SAMPLE_MAX-SAMPLE_MIN)/GRID_SIZE;
+	kept = 0;
+	for(s=0; s<samples; s++)
+	{
+		cell = cells[next_random(state)%ncells];
+		cr = SAMPLE_MIN+(cell%GRID_SIZE+next_uniform(state))*step;
+		ci = SAMPLE_MAX-(cell/GRID_SIZE+next_uniform(state))*step;
+
+		n = escape_time(cr, ci);
+		if(n<min_iter || n==MAX_ITER)
+			continue;
+
+		// The orbit escapes late enough, plot it
+		zr = zi = 0;
+		for(k=1; k<n; k++)
+		{
+			t = zr*zr-zi*zi+cr;
+			zi = 2*zr*zi+ci;
+			zr = t;
+			j = (int)floor((zr-c_x_min)/pixel_width);
+			i = (int)floor((c_y_max-zi)/pixel_height);
+			if(i>=0 && i<image_size && j>=0 && j<image_size)
+				density[(size_t)i*image_size+j]++;
+		}
+		kept++;
+	}
+
+	return kept;
+}
+
+
+/**
+ * @brief Write the density as a grayscale image
+ *
+ * @param name name of the image
+ * @param density image_size*image_size counters of all the processes
+ * @param image_size the resolution of the image
+ */
+void write_density(const char *name, const unsigned int *density, int image_size)
+{
+	size_t p, npix;
+	unsigned int top;
+	unsigned char v;
+	FILE *img;
+
+	npix = (size_t)image_size*image_size;
+	top = 0;
+	for(p=0; p<npix; p++)
+		if(density[p]>top)
+			top = density[p];
+
+	img = fopen(name, "w");
+	if(!img)
+	{
+		fprintf(stderr, "Unable to create %s\n", name);
+		MPI_Abort(MPI_COMM_WORLD, 1);
+	}
+	fprintf(img, "P6\n%d %d 255\n", image_size, image_size);
+	for(p=0; p<npix; p++)
+	{
+		v = top ? (unsigned char)(255*sqrt((double)density[p]/top)) : 0;
+		fputc(v, img);
+		fputc(v, img);
+		fputc(v, img);
+	}
+	fclose(img);
+}
+
+
+/**
+ * @brief Function responsible for printing usage instructions
+ *
+ * This function is responsible for printing the usage instructions
+ *
+ */
+void print_instructions()
+{
+	printf("usage: mpirun -np NP ./mandelbrot_buddha c_x_min c_x_max c_y_min c_y_max image_size [--samples=N] [--min-iter=N]\n");
+	printf("    [--seed=S]\n");
+	printf("examples with image_size = 1024:\n");
+	printf("    Full Picture:    mpirun -np 4 ./mandelbrot_buddha -2.0 2.0 -2.0 2.0 1024\n");
+	printf("    Seahorse Valley: mpirun -np 4 ./mandelbrot_buddha -0.8 -0.7 0.05 0.15 1024 --samples=100000000\n");
+}
+
+
+int main(int argc, char** argv)
+{
+	double c_x_min, c_x_max, c_y_min, c_y_max, pixel_width, pixel_height, start, elapsed;
+	int i, image_size, rank, nproc, nthreads, min_iter, ncells, provided, *cells;
+	long samples, kept;
+	unsigned long long seed;
+	size_t npix, p, len;
+	unsigned int **density, *total;
+
+	// Only the master thread of each process calls MPI
+	MPI_Init_thread(NULL, NULL, MPI_THREAD_FUNNELED, &provided);
+	MPI_Comm_size(MPI_COMM_WORLD, &nproc);
+	MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+	if(provided<MPI_THREAD_FUNNELED)
+	{
+		if(rank==0)
+			fprintf(stderr, "The MPI library does not support threads\n");
+		MPI_Abort(MPI_COMM_WORLD, 1);
+	}
+
+	if(argc < 6)
+	{
+		if(rank==0)
+			print_instructions();
+		MPI_Finalize();
+		exit(0);
+	}
+
+	sscanf(argv[1], "%lf", &c_x_min);
+	sscanf(argv[2], "%lf", &c_x_max);
+	sscanf(argv[3], "%lf", &c_y_min);
+	sscanf(argv[4], "%lf", &c_y_max);
+	sscanf(argv[5], "%d", &image_size);
+
+	pixel_width = (c_x_max - c_x_min) / image_size;
+	pixel_height = (c_y_max - c_y_min) / image_size;
+
+	samples = SAMPLES;
+	min_iter = MIN_ITER;
+	seed = 1;
+	for(i=6; i<argc; i++)
+	{
+		if(strncmp(argv[i], "--samples=", 10)==0 && sscanf(argv[i]+10, "%ld", &samples)==1 && samples>0)
+			continue;
+		else if(strncmp(argv[i], "--min-iter=", 11)==0 && sscanf(argv[i]+11, "%d", &min_iter)==1
+			&& min_iter>=1 && min_iter<MAX_ITER)
+			continue;
+		else if(strncmp(argv[i], "--seed=", 7)==0 && sscanf(argv[i]+7, "%llu", &seed)==1)
+			continue;
+		else
+		{
+			if(rank==0)
+				print_instructions();
+			MPI_Finalize();
+			exit(1);
+		}
+	}
+
+	cells = malloc(GRID_SIZE*GRID_SIZE*sizeof(int));
+	if(!cells)
+	{
+		fprintf(stderr, "Unable to allocate the sampling grid\n");
+		MPI_Abort(MPI_COMM_WORLD, 1);
+	}
+	ncells = build_grid(min_iter, rank, nproc, cells);
+	if(ncells==0)
+	{
+		if(rank==0)
+			fprintf(stderr, "No orbit escapes after %d iterations\n", min_iter);
+		MPI_Finalize();
+		exit(1);
+	}
+
+	nthreads = omp_get_max_threads();
+	npix = (size_t)image_size*image_size;
+	density = malloc(nthreads*sizeof(unsigned int *));
+	if(!density)
+	{
+		fprintf(stderr, "Unable to allocate the density buffers\n");
+		MPI_Abort(MPI_COMM_WORLD, 1);
+	}
+
+	MPI_Barrier(MPI_COMM_WORLD);
+	start = MPI_Wtime();
+	kept = 0;
+
+	#pragma omp parallel num_threads(nthreads) reduction(+:kept)
+	{
+		int t, team, step;
+		size_t p;
+		long share;
+		unsigned long long state;
+
+		// The team may be smaller than requested, its actual size is used
+		t = omp_get_thread_num();
+		team = omp_get_num_threads();
+		density[t] = calloc(npix, sizeof(unsigned int));
+		if(!density[t])
+		{
+			fprintf(stderr, "Unable to allocate the density buffers\n");
+			exit(1);
+		}
+
+		// The samples are split evenly among the processes, then among their threads
+		share = samples/nproc + (rank < samples%nproc);
+		share = share/team + (t < share%team);
+		state = seed_random(seed, (unsigned long long)rank*nthreads+t);
+		kept = trace_samples(share, &state, cells, ncells, min_iter, c_x_min, c_y_max,
+			pixel_width, pixel_height, image_size, density[t]);
+
+		// Tree reduction, thread t adds thread t+step at every step
+		for(step=1; step<team; step*=2)
+		{
+			#pragma omp barrier
+			if(t%(2*step)==0 && t+step<team)
+			{
+				for(p=0; p<npix; p++)
+					density[t][p] += density[t+step][p];
+				free(density[t+step]);
+			}
+		}
+	}
+
+	total = NULL;
+	if(rank==0)
+	{
+		total = malloc(npix*sizeof(unsigned int));
+		if(!total)
+		{
+			fprintf(stderr, "Unable to allocate the density image\n");
+			MPI_Abort(MPI_COMM_WORLD, 1);
+		}
+	}
+	for(p=0; p<npix; p+=len)
+	{
+		len = npix-p<REDUCE_CHUNK ? npix-p : REDUCE_CHUNK;
+		MPI_Reduce(density[0]+p, rank==0 ? total+p : NULL, (int)len, MPI_UNSIGNED, MPI_SUM, 0, MPI_COMM_WORLD);
+	}
+	MPI_Reduce(rank==0 ? MPI_IN_PLACE : &kept, &kept, 1, MPI_LONG, MPI_SUM, 0, MPI_COMM_WORLD);
+	elapsed = MPI_Wtime()-start;
+
+	if(rank==0)
+	{
+		printf("Sampled %d of %d cells, %ld samples in %.3f s (%.0f samples/s), %ld orbits plotted\n",
+			ncells, GRID_SIZE*GRID_SIZE, samples, elapsed, samples/elapsed, kept);
+		write_density("mandelbrot_buddha.ppm", total, image_size);
+		free(total);
+	}
+
+	free(density[0]);
+	free(density);
+	free(cells);
+	MPI_Finalize();
+	return 0;
+}
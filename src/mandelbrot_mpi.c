@@ -7,13 +7,49 @@
  *  in which every processes is responsible for writing your work
  *
  *	Usage:
- *    mpirun -np NP ./mandelbrot_mpi c_x_min c_x_max c_y_min c_y_max image_size
+ *    mpirun -np NP ./mandelbrot_mpi c_x_min c_x_max c_y_min c_y_max image_size [options]
  *		- NP: Number of Open MPI processes
  *		- c_x_min: Lowest x boundary for the figure to be computed
  *		- c_x_max: Highest x boundary for the figure to be computed
  *		- c_y_mix: Lowest y boundary for the figure to be computed
  *		- c_y_max: Highest y boundary for the figure to be computed
  *		- image_size: The resolution of the resulting image
+ *	Options:
+ *		- --fallocate: Reserve the blocks of the whole image with
+ *		  posix_fallocate before any row is written
+ *		- --mmap: Map the image in memory (shared), so every process writes
+ *		  the RGB bytes of its rows straight into the file pages, with no row
+ *		  buffer and no write calls (ignored with --histogram)
+ *		- --histogram: Smooth coloring with a histogram-equalized palette. In
+ *		  a first pass every process keeps the fractional escape times of its
+ *		  rows in 16 bits and builds their histogram, the histograms are
+ *		  merged with MPI_Allreduce and a second pass colors the rows from
+ *		  the global cumulative distribution without recomputing the fractal
+ *		- --precision=auto|float|double|long: Arithmetic of the kernel
+ *		  (default double). auto takes single precision while the pixel
+ *		  spacing is well above float epsilon, then double, then long double
+ *		  as the window narrows. Only used by the plain render
+ *		- --power=d: Iterate z^d+c (Multibrot set) instead of z^2+c
+ *		- --julia=re,im: Render the Julia set of the constant re+im*i (with
+ *		  the power of --power) instead of the Mandelbrot set
+ *		- --tiles[=N]: Instead of one PPM, write a deep zoom tile pyramid of
+ *		  NxN tiles (default 256): the mandelbrot_mpi.dzi descriptor and the
+ *		  mandelbrot_mpi_files/level/col_row.ppm tiles. Processes render and
+ *		  write the tiles of the last level on their own and then build each
+ *		  level from the one below, so memory stays at a few tiles per
+ *		  process whatever the image size
+ *		- --costmap: Also write mandelbrot_mpi_cost.ppm, the iterations spent
+ *		  on every pixel (black to red, yellow and white for MAX_ITER, with
+ *		  the mirrored rows left black), and mandelbrot_mpi_owner.ppm, every
+ *		  row colored by the rank that computed it (its mirrored row at half
+ *		  brightness). Process zero prints the rows, iterations and compute
+ *		  time of every rank and their imbalance. Cannot be combined with
+ *		  --histogram or --tiles
+ *
+ *	When the window straddles the real axis on mirrored row positions (as
+ *	the Full Picture does) only the unique rows are distributed among the
+ *	processes and each of them is also written to its mirrored row (except
+ *	with --histogram).
  *  Usage examples:
  *      Full Picture: mpirun -np 4 ./mandelbrot_mpi -2.5 1.5 -2.0 2.0 11500
  *      Seahorse Valley: mpirun -np 4 ./mandelbrot_mpi -0.8 -0.7 0.05 0.15 8192
@@ -36,41 +72,459 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <float.h>
 #include <complex.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <mpi.h>
 
 #define MAX_ITER 300
 #define ESCAPE_RADIUS_SQUARED 4
+#define WRITE_CHUNK (4<<20)
+#define SMOOTH_RADIUS_SQUARED 256
+#define SMOOTH_SCALE 64
+#define SMOOTH_INSIDE 0xFFFF
+#define PRECISION_AUTO -1
+#define PRECISION_FLOAT 0
+#define PRECISION_DOUBLE 1
+#define PRECISION_LONG 2
+#define PRECISION_MARGIN 1024
+#define TILE_SIZE 256
+#define TILES_DIR "mandelbrot_mpi_files"
+#define TILES_DESCRIPTOR "mandelbrot_mpi.dzi"
 
 
 /**
- * @brief Perform the calculations for the set until divergence or MAX_ITER 
+ * @brief Generate an escape time kernel for one fixed formula
+ *
+ * Every kernel iterates z from the given point adding the constant c,
+ * which is the point itself for the Multibrot sets and a fixed constant
+ * for the Julia sets. The step is pasted into the loop, so each power is
+ * compiled on its own with no branch on the formula while iterating.
  *
- * For the complex number z0, it performs the Mandelbrot calculation until it
- * reaches divergence or it reaches the maximum number of iterations,
- * whichever happens first, returning the number of iterations until divergence
- * or MAX_ITER
+ * @param name name of the generated function
+ * @param step update of z (and temporaries) for one iteration
+ */
+#define FORMULA_KERNEL(name, step) \
+int name(complex z, complex c, int power) \
+{ \
+	int i; \
+	complex w; \
+ \
+	(void)power; \
+	(void)w; \
+	for(i=1; i<MAX_ITER; i++) \
+	{ \
+		step; \
+		if((creal(z)*creal(z))+(cimag(z)*cimag(z))>ESCAPE_RADIUS_SQUARED) \
+			break; \
+	} \
+ \
+	return i; \
+}
+
+FORMULA_KERNEL(formula_power2, z=z*z+c)
+FORMULA_KERNEL(formula_power3, z=z*z*z+c)
+FORMULA_KERNEL(formula_power4, w=z*z; z=w*w+c)
+FORMULA_KERNEL(formula_power5, w=z*z; z=w*w*z+c)
+FORMULA_KERNEL(formula_power6, w=z*z*z; z=w*w+c)
+
+
+/**
+ * @brief Escape time kernel of z^power+c for the powers without a
+ * specialized kernel
  *
- * @param z0 complex number to perform the Mandelbrot calculations
+ * @param z starting point of the orbit
+ * @param c constant added at every iteration
+ * @param power exponent of z
  * @return i integer with the number of iterations until divergerce or MAX_ITER
  */
-int mandelbrot(complex z0)
+int formula_generic(complex z, complex c, int power)
 {
-	int i;
-	complex z;
+	int i, k;
+	complex w;
 
-	z = z0;
 	for(i=1; i<MAX_ITER; i++)
 	{
-		z=z*z+z0;
+		w = z;
+		for(k=1; k<power; k++)
+			w *= z;
+		z = w+c;
 		if((creal(z)*creal(z))+(cimag(z)*cimag(z))>ESCAPE_RADIUS_SQUARED)
 			break;
-  	}
+	}
 
 	return i;
 }
 
 
+/**
+ * @brief Formula selected on the command line
+ */
+struct formula
+{
+	int (*kernel)(complex z, complex c, int power);
+	int power;
+	int julia;
+	complex c;
+};
+
+
+/**
+ * @brief Parse the --power=d and --julia=re,im options
+ *
+ * @param arg command line argument
+ * @param f formula updated with the option
+ * @return 1 if arg was a formula option, 0 otherwise
+ */
+int parse_formula(const char *arg, struct formula *f)
+{
+	double re, im;
+
+	if(strncmp(arg, "--power=", 8)==0 && sscanf(arg+8, "%d", &f->power)==1 && f->power>=2)
+		return 1;
+	if(strncmp(arg, "--julia=", 8)==0 && sscanf(arg+8, "%lf,%lf", &re, &im)==2)
+	{
+		f->julia = 1;
+		f->c = re+im*I;
+		return 1;
+	}
+	return 0;
+}
+
+
+/**
+ * @brief Pick the kernel for the power of the formula
+ *
+ * @param f formula whose kernel is set
+ */
+void select_formula(struct formula *f)
+{
+	switch(f->power)
+	{
+		case 2: f->kernel = formula_power2; break;
+		case 3: f->kernel = formula_power3; break;
+		case 4: f->kernel = formula_power4; break;
+		case 5: f->kernel = formula_power5; break;
+		case 6: f->kernel = formula_power6; break;
+		default: f->kernel = formula_generic;
+	}
+}
+
+
+/**
+ * @brief Number of iterations of one point with the selected formula
+ *
+ * @param f formula selected by select_formula
+ * @param z point of the complex plane
+ * @return i integer with the number of iterations until divergerce or MAX_ITER
+ */
+int formula_point(const struct formula *f, complex z)
+{
+	return f->kernel(z, f->julia ? f->c : z, f->power);
+}
+
+
+/**
+ * @brief Whether the image of the formula is symmetric about the real axis
+ *
+ * The Multibrot sets and the Julia sets of a real constant are their own
+ * complex conjugate, the other Julia sets are not.
+ *
+ * @param f formula selected on the command line
+ * @return 1 if the rows mirrored about the real axis are equal
+ */
+int formula_symmetric(const struct formula *f)
+{
+	return !f->julia || cimag(f->c)==0;
+}
+
+
+/**
+ * @brief Fractional escape time of a point (smooth coloring)
+ *
+ * Same iteration of formula_point(), but with a larger escape radius so
+ * that the continuous count n+1-log_d(log|z|) (d the power of the formula)
+ * is free of visible steps.
+ *
+ * @param f formula selected by select_formula
+ * @param z point of the complex plane
+ * @return the fractional number of iterations or MAX_ITER for points of
+ *		   the set
+ */
+double formula_smooth(const struct formula *f, complex z)
+{
+	int i, k;
+	double mu;
+	complex c, w;
+
+	c = f->julia ? f->c : z;
+	for(i=1; i<MAX_ITER; i++)
+	{
+		w = z;
+		for(k=1; k<f->power; k++)
+			w *= z;
+		z = w+c;
+		if((creal(z)*creal(z))+(cimag(z)*cimag(z))>SMOOTH_RADIUS_SQUARED)
+			break;
+	}
+
+	if(i==MAX_ITER)
+		return MAX_ITER;
+
+	mu = i+1-log2(log(cabs(z)))/log2(f->power);
+	return mu<0 ? 0 : (mu>=MAX_ITER ? MAX_ITER-1e-3 : mu);
+}
+
+
+/**
+ * @brief Pack a fractional escape time in 16 bits
+ *
+ * @param mu value returned by formula_smooth
+ * @return mu in fixed point with SMOOTH_SCALE steps per iteration, or
+ *		   SMOOTH_INSIDE for points of the set
+ */
+unsigned short pack_smooth(double mu)
+{
+	if(mu>=MAX_ITER)
+		return SMOOTH_INSIDE;
+	return (unsigned short)(mu*SMOOTH_SCALE);
+}
+
+
+/**
+ * @brief Color one pixel from the cumulative distribution of escape times
+ *
+ * The integer part of the escape time selects the bin of the histogram and
+ * the fractional part interpolates to the next bin, so the palette is used
+ * evenly (histogram equalization) and without bands.
+ *
+ * @param px pointer to the 3 bytes (RGB) of the pixel
+ * @param v packed escape time of the pixel
+ * @param cdf fraction of the escaping pixels below each bin (MAX_ITER+1)
+ */
+void set_smooth_color(unsigned char *px, unsigned short v, const double *cdf)
+{
+	int n;
+	double t;
+
+	if(v==SMOOTH_INSIDE)
+	{
+		px[0]=255;
+		px[1]=255;
+		px[2]=255;
+		return;
+	}
+
+	n = v/SMOOTH_SCALE;
+	t = cdf[n]+(cdf[n+1]-cdf[n])*(v%SMOOTH_SCALE)/SMOOTH_SCALE;
+
+	// Same hues of the fixed color scheme: white to red to yellow
+	px[0]=255;
+	if(t<0.5)
+	{
+		px[1]=(unsigned char)(255*(1-2*t));
+		px[2]=px[1];
+	}
+	else
+	{
+		px[1]=(unsigned char)(255*(2*t-1));
+		px[2]=0;
+	}
+}
+
+
+/**
+ * @brief Turn a histogram of escape times into its cumulative distribution
+ *
+ * @param hist number of escaping pixels in each bin (MAX_ITER bins)
+ * @param cdf output with MAX_ITER+1 entries, from 0 to 1
+ */
+void histogram_cdf(const long *hist, double *cdf)
+{
+	long total, acc;
+	int n;
+
+	for(n=0, total=0; n<MAX_ITER; n++)
+		total += hist[n];
+
+	cdf[0] = 0;
+	for(n=0, acc=0; n<MAX_ITER; n++)
+	{
+		acc += hist[n];
+		cdf[n+1] = total ? (double)acc/total : 0;
+	}
+}
+
+
+/**
+ * @brief Single precision version of formula_power2() for wide windows
+ *
+ * @param x0 real part of the point
+ * @param y0 imaginary part of the point
+ * @return i integer with the number of iterations until divergerce or MAX_ITER
+ */
+int mandelbrot_float(float x0, float y0)
+{
+	int i;
+	float x, y, xx, yy;
+
+	x = x0;
+	y = y0;
+	for(i=1; i<MAX_ITER; i++)
+	{
+		xx = x*x;
+		yy = y*y;
+		y = 2*x*y+y0;
+		x = xx-yy+x0;
+		if(x*x+y*y>ESCAPE_RADIUS_SQUARED)
+			break;
+	}
+
+	return i;
+}
+
+
+/**
+ * @brief Extended precision version of formula_power2() for deep zooms
+ *
+ * @param x0 real part of the point
+ * @param y0 imaginary part of the point
+ * @return i integer with the number of iterations until divergerce or MAX_ITER
+ */
+int mandelbrot_long(long double x0, long double y0)
+{
+	int i;
+	long double x, y, xx, yy;
+
+	x = x0;
+	y = y0;
+	for(i=1; i<MAX_ITER; i++)
+	{
+		xx = x*x;
+		yy = y*y;
+		y = 2*x*y+y0;
+		x = xx-yy+x0;
+		if(x*x+y*y>ESCAPE_RADIUS_SQUARED)
+			break;
+	}
+
+	return i;
+}
+
+
+/**
+ * @brief Choose the cheapest precision able to resolve the pixels
+ *
+ * A precision is used when the pixel spacing is at least PRECISION_MARGIN
+ * times its epsilon relative to the magnitude of the points (never less
+ * than the escape radius, which every escaping orbit reaches).
+ *
+ * @param c_x_min lowest x boundary of the figure
+ * @param c_x_max highest x boundary of the figure
+ * @param c_y_min lowest y boundary of the figure
+ * @param c_y_max highest y boundary of the figure
+ * @param pixel_width width of one pixel
+ * @param pixel_height height of one pixel
+ * @return PRECISION_FLOAT, PRECISION_DOUBLE or PRECISION_LONG
+ */
+int select_precision(double c_x_min, double c_x_max, double c_y_min,
+	double c_y_max, double pixel_width, double pixel_height)
+{
+	double scale, spacing;
+
+	scale = 2;
+	if(fabs(c_x_min)>scale)
+		scale = fabs(c_x_min);
+	if(fabs(c_x_max)>scale)
+		scale = fabs(c_x_max);
+	if(fabs(c_y_min)>scale)
+		scale = fabs(c_y_min);
+	if(fabs(c_y_max)>scale)
+		scale = fabs(c_y_max);
+
+	spacing = fabs(pixel_width)<fabs(pixel_height) ? fabs(pixel_width) : fabs(pixel_height);
+
+	if(spacing>scale*FLT_EPSILON*PRECISION_MARGIN)
+		return PRECISION_FLOAT;
+	if(spacing>scale*DBL_EPSILON*PRECISION_MARGIN)
+		return PRECISION_DOUBLE;
+	return PRECISION_LONG;
+}
+
+
+/**
+ * @brief Parse the window again in extended precision
+ *
+ * @param argv command line arguments (window and image_size)
+ * @param lwin output with c_x_min, c_y_max, pixel_width and pixel_height
+ */
+void parse_long_window(char **argv, long double *lwin)
+{
+	long double c_x_min, c_x_max, c_y_min, c_y_max;
+	int image_size;
+
+	sscanf(argv[1], "%Lf", &c_x_min);
+	sscanf(argv[2], "%Lf", &c_x_max);
+	sscanf(argv[3], "%Lf", &c_y_min);
+	sscanf(argv[4], "%Lf", &c_y_max);
+	sscanf(argv[5], "%d", &image_size);
+
+	lwin[0] = c_x_min;
+	lwin[1] = c_y_max;
+	lwin[2] = (c_x_max-c_x_min)/image_size;
+	lwin[3] = (c_y_max-c_y_min)/image_size;
+}
+
+
+/**
+ * @brief Compute the iterations of one row with the chosen precision
+ *
+ * @param precision PRECISION_FLOAT, PRECISION_DOUBLE or PRECISION_LONG
+ * @param i row of the image
+ * @param image_size the resolution of the image
+ * @param c_x_min lowest x boundary of the figure
+ * @param c_y_max highest y boundary of the figure
+ * @param pixel_width width of one pixel
+ * @param pixel_height height of one pixel
+ * @param lwin window parsed by parse_long_window (used by PRECISION_LONG)
+ * @param formula formula iterated by the double precision kernel
+ * @param row output with the iterations of every pixel of the row
+ */
+void compute_row(int precision, int i, int image_size, double c_x_min,
+	double c_y_max, double pixel_width, double pixel_height,
+	const long double *lwin, const struct formula *formula, int *row)
+{
+	int j;
+	float y;
+	complex z;
+
+	switch(precision)
+	{
+		case PRECISION_FLOAT:
+			y = c_y_max-i*pixel_height;
+			for(j=0; j<image_size; j++)
+				row[j]=mandelbrot_float(c_x_min+j*pixel_width, y);
+			break;
+		case PRECISION_LONG:
+			for(j=0; j<image_size; j++)
+				row[j]=mandelbrot_long(lwin[0]+j*lwin[2], lwin[1]-i*lwin[3]);
+			break;
+		default:
+			for(j=0; j<image_size; j++)
+			{
+				z=c_x_min+j*(pixel_width)+(c_y_max-i*(pixel_height))*I;
+				row[j]=formula_point(formula, z);
+			}
+	}
+}
+
+
 /**
  * @brief Function responsible for printing usage instructions
  *
@@ -79,7 +533,9 @@ int mandelbrot(complex z0)
  */
 void print_instructions()
 {
-	printf("usage: mpirun -np NP ./mandelbrot_mpi c_x_min c_x_max c_y_min c_y_max image_size\n");
+	printf("usage: mpirun -np NP ./mandelbrot_mpi c_x_min c_x_max c_y_min c_y_max image_size [--fallocate] [--mmap] [--histogram]\n");
+	printf("    [--precision=auto|float|double|long] [--power=d] [--julia=re,im] [--tiles[=N]]\n");
+	printf("    [--costmap]\n");
 	printf("examples with image_size = 11500:\n");
 	printf("    Full Picture: mpirun -np 4 ./mandelbrot_mpi -2.5 1.5 -2.0 2.0 11500\n");
 	printf("    Seahorse Valley: mpirun -np 8 ./mandelbrot_mpi -0.8 -0.7 0.05 0.15 11500\n");
@@ -88,13 +544,767 @@ void print_instructions()
 }
 
 
+/**
+ * @brief Find the axis of the conjugate symmetry of the image
+ *
+ * The set is symmetric about the real axis, so when the window straddles it
+ * and the rows fall on mirrored positions, row i and row m-i have the same
+ * pixels. Such rows are computed once and written twice.
+ *
+ * @param c_y_min lowest y boundary of the figure
+ * @param c_y_max highest y boundary of the figure
+ * @param pixel_height height of one pixel
+ * @return m the sum of the indexes of two mirrored rows, or -1 if the
+ *		   window has no usable symmetry
+ */
+int mirror_axis(double c_y_min, double c_y_max, double pixel_height)
+{
+	double m;
+	int r;
+
+	if(c_y_min>=0 || c_y_max<=0)
+		return -1;
+
+	m = 2*c_y_max/pixel_height;
+	r = (int)(m+0.5);
+	if(m-r>1e-6 || r-m>1e-6)
+		return -1;
+
+	return r;
+}
+
+
+/**
+ * @brief First row of the block of a process when n rows are split evenly
+ *
+ * The product is computed in 64 bits, rank*n overflows an int long before
+ * n reaches the gigapixel sizes.
+ *
+ * @param rank rank of the process (nproc for the end of the last block)
+ * @param n number of rows to split
+ * @param nproc number of processes
+ * @return index of the first row of the block
+ */
+int block_start(int rank, int n, int nproc)
+{
+	return (int)(((long long)rank*n)/nproc);
+}
+
+
+/**
+ * @brief Count the rows that must really be computed
+ *
+ * Rows in (m/2, m] are copies of rows [0, m/2), everything else is unique.
+ *
+ * @param m axis returned by mirror_axis
+ * @param image_size the resolution of the image
+ * @return the number of unique rows
+ */
+int unique_rows(int m, int image_size)
+{
+	int last;
+
+	if(m<0)
+		return image_size;
+
+	last = m<image_size-1 ? m : image_size-1;
+	return last>m/2 ? image_size-(last-m/2) : image_size;
+}
+
+
+/**
+ * @brief Map the k-th unique row to its row in the image
+ *
+ * @param k index among the unique rows
+ * @param m axis returned by mirror_axis
+ * @return the row of the image
+ */
+int unique_row(int k, int m)
+{
+	if(m<0 || k<=m/2)
+		return k;
+	return k+m-m/2;
+}
+
+
+/**
+ * @brief Find the row that is a copy of row i
+ *
+ * @param i row of the image
+ * @param m axis returned by mirror_axis
+ * @param image_size the resolution of the image
+ * @return the mirrored row, or -1 if row i has no distinct mirror
+ */
+int mirror_row(int i, int m, int image_size)
+{
+	if(m<0 || 2*i>=m || m-i>=image_size)
+		return -1;
+	return m-i;
+}
+
+
+/**
+ * @brief Write the whole buffer at the given file offset
+ *
+ * Uses pwrite on the raw file descriptor, so there is no stdio buffering
+ * and no shared file position between the processes. Aborts every process
+ * if the write fails.
+ *
+ * @param fd destination file descriptor
+ * @param buf data to be written
+ * @param len number of bytes to be written
+ * @param off offset of the first byte in the file
+ */
+void pwrite_all(int fd, const unsigned char *buf, size_t len, off_t off)
+{
+	ssize_t n;
+
+	while(len>0)
+	{
+		n = pwrite(fd, buf, len, off);
+		if(n<=0)
+		{
+			perror("Unable to write the image");
+			MPI_Abort(MPI_COMM_WORLD, 1);
+		}
+		buf += n;
+		len -= n;
+		off += n;
+	}
+}
+
+
+/**
+ * @brief Create the image file shared by every process
+ *
+ * Process zero creates (truncating) the file, writes the header and sets
+ * the final size, optionally reserving its blocks. Only after that the
+ * other processes open it, so no truncation can race with a row write.
+ *
+ * @param name path of the image
+ * @param image_size the resolution of the image
+ * @param rank rank of the calling process
+ * @param reserve whether posix_fallocate should be used
+ * @param hdr returns the size of the header
+ * @return fd the file descriptor opened for reading and writing
+ */
+int open_image(const char *name, int image_size, int rank, int reserve, int *hdr)
+{
+	char header[64];
+	off_t total;
+	int fd, err;
+
+	*hdr = snprintf(header, sizeof(header), "P6\n%d %d 255\n", image_size, image_size);
+	total = *hdr+(off_t)3*image_size*image_size;
+	err = 0;
+
+	if(rank==0)
+	{
+		// posix_fallocate returns its error instead of setting errno, and
+		// the error is reported before MPI_Bcast can change errno
+		fd = open(name, O_RDWR|O_CREAT|O_TRUNC, 0644);
+		if(fd<0)
+			err = errno;
+		else if(reserve)
+			err = posix_fallocate(fd, 0, total);
+		if(!err && ftruncate(fd, total))
+			err = errno;
+
+		if(err)
+			fprintf(stderr, "Unable to create the image: %s\n", strerror(err));
+		else
+			pwrite_all(fd, (unsigned char *)header, *hdr, 0);
+	}
+
+	MPI_Bcast(&err, 1, MPI_INT, 0, MPI_COMM_WORLD);
+	if(err)
+	{
+		MPI_Finalize();
+		exit(1);
+	}
+
+	if(rank!=0)
+		fd = open(name, O_RDWR);
+	if(fd<0)
+	{
+		perror("Unable to open the image");
+		MPI_Abort(MPI_COMM_WORLD, 1);
+	}
+
+	return fd;
+}
+
+
+/**
+ * @brief Map the whole image file (shared) in memory
+ *
+ * The rows of the process are written in order, so the kernel is told
+ * its block of the file is accessed sequentially.
+ *
+ * @param fd descriptor returned by open_image
+ * @param total size of the whole file
+ * @param first offset of the first byte written by the process
+ * @param last offset after the last byte written by the process
+ * @return map pointer to the first byte of the file
+ */
+unsigned char *map_image(int fd, size_t total, off_t first, off_t last)
+{
+	unsigned char *map;
+	long page;
+
+	map = mmap(NULL, total, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	if(map==MAP_FAILED)
+	{
+		perror("Unable to map the image");
+		MPI_Abort(MPI_COMM_WORLD, 1);
+	}
+
+	page = sysconf(_SC_PAGESIZE);
+	// Rows of the process are a contiguous block written in order
+	madvise(map+(first&~(off_t)(page-1)), last-(first&~(off_t)(page-1)), MADV_SEQUENTIAL);
+
+	return map;
+}
+
+
+/**
+ * @brief Schedule the write back of the rows of the process and unmap
+ *
+ * @param map pointer returned by map_image
+ * @param total size of the whole file
+ * @param first offset of the first byte written by the process
+ * @param last offset after the last byte written by the process
+ */
+void unmap_image(unsigned char *map, size_t total, off_t first, off_t last)
+{
+	off_t start;
+
+	if(last>first)
+	{
+		start = first&~(off_t)(sysconf(_SC_PAGESIZE)-1);
+		msync(map+start, last-start, MS_ASYNC);
+	}
+	munmap(map, total);
+}
+
+
+/**
+ * @brief Render the rows of the process with histogram-equalized colors
+ *
+ * The escape times of the block of rows of the process stay resident in
+ * 16 bits per pixel while the per process histograms are merged, so the
+ * fractal is computed only once. Colored rows are written in chunks.
+ *
+ * @param c_x_min lowest x boundary of the figure
+ * @param c_y_max highest y boundary of the figure
+ * @param pixel_width width of one pixel
+ * @param pixel_height height of one pixel
+ * @param image_size the resolution of the resulting image
+ * @param rank rank of the calling process
+ * @param nproc number of processes
+ * @param formula formula selected on the command line
+ * @param fd descriptor returned by open_image
+ * @param hdr size of the header
+ */
+void render_histogram(double c_x_min, double c_y_max, double pixel_width,
+	double pixel_height, int image_size, int rank, int nproc,
+	const struct formula *formula, int fd, int hdr)
+{
+	int i, j, first, last, chunk_rows, nrows;
+	unsigned short *values, v;
+	unsigned char *chunk;
+	long local[MAX_ITER], hist[MAX_ITER];
+	double cdf[MAX_ITER+1];
+	complex z;
+
+	first = block_start(rank, image_size, nproc);
+	last = block_start(rank+1, image_size, nproc);
+	chunk_rows = WRITE_CHUNK/(3*image_size);
+	if(chunk_rows<1)
+		chunk_rows = 1;
+
+	values = malloc(((size_t)(last-first)*image_size+1)*sizeof(unsigned short));
+	chunk = malloc((size_t)chunk_rows*3*image_size*sizeof(unsigned char));
+	if(!values || !chunk)
+	{
+		fprintf(stderr, "Unable to allocate the histogram buffers\n");
+		MPI_Abort(MPI_COMM_WORLD, 1);
+	}
+
+	// First pass: escape times and the histogram of the process
+	memset(local, 0, sizeof(local));
+	for(i=first; i<last; i++)
+	{
+		for(j=0; j<image_size; j++)
+		{
+			z=c_x_min+j*(pixel_width)+(c_y_max-i*(pixel_height))*I;
+			v=pack_smooth(formula_smooth(formula, z));
+			values[(size_t)(i-first)*image_size+j]=v;
+			if(v!=SMOOTH_INSIDE)
+				local[v/SMOOTH_SCALE]++;
+		}
+	}
+
+	MPI_Allreduce(local, hist, MAX_ITER, MPI_LONG, MPI_SUM, MPI_COMM_WORLD);
+	histogram_cdf(hist, cdf);
+
+	// Second pass: colors from the global distribution
+	for(i=first, nrows=0; i<last; i++)
+	{
+		for(j=0; j<image_size; j++)
+			set_smooth_color(&chunk[3*((size_t)nrows*image_size+j)], values[(size_t)(i-first)*image_size+j], cdf);
+
+		if(++nrows==chunk_rows || i==last-1)
+		{
+			pwrite_all(fd, chunk, (size_t)nrows*3*image_size, hdr+(off_t)3*image_size*(i+1-nrows));
+			nrows = 0;
+		}
+	}
+
+	free(values);
+	free(chunk);
+}
+
+/**
+ * @brief Apply the fixed color scheme to one pixel
+ *
+ * @param px pointer to the 3 bytes (RGB) of the pixel
+ * @param iter number of iterations computed for the pixel
+ */
+void set_color(unsigned char *px, int iter)
+{
+	if(iter==MAX_ITER)
+	{
+		px[0]=255;
+		px[1]=255;
+		px[2]=255;
+	}
+	else if(iter<=63)
+	{
+		px[0]=255;
+		px[1]=255-4*iter;
+		px[2]=255-4*iter;
+	}
+	else
+	{
+		px[0]=255;
+		px[1]=iter-63;
+		px[2]=0;
+	}
+}
+
+
+/**
+ * @brief Side of the image at one level of the tile pyramid
+ *
+ * The last level is the full image and every level above halves it
+ * (rounding up) down to the single pixel of level zero.
+ *
+ * @param image_size the resolution of the image
+ * @param level level of the pyramid
+ * @param max_level last level of the pyramid
+ * @return side of the level in pixels
+ */
+int level_size(int image_size, int level, int max_level)
+{
+	int size;
+
+	for(size=image_size; level<max_level; level++)
+		size = (size+1)/2;
+	return size;
+}
+
+
+/**
+ * @brief Write one tile of the pyramid as a PPM file
+ *
+ * @param level level of the tile
+ * @param col column of the tile
+ * @param row row of the tile
+ * @param rgb colors of the tile
+ * @param w width of the tile
+ * @param h height of the tile
+ */
+void write_tile(int level, int col, int row, const unsigned char *rgb, int w, int h)
+{
+	char path[128];
+	FILE *f;
+
+	snprintf(path, sizeof(path), TILES_DIR "/%d/%d_%d.ppm", level, col, row);
+	f = fopen(path, "w");
+	if(!f)
+	{
+		perror("Unable to create a tile");
+		MPI_Abort(MPI_COMM_WORLD, 1);
+	}
+	fprintf(f, "P6\n%d %d 255\n", w, h);
+	fwrite(rgb, 1, (size_t)3*w*h, f);
+	fclose(f);
+}
+
+
+/**
+ * @brief Read one tile of the pyramid written by write_tile
+ *
+ * @param level level of the tile
+ * @param col column of the tile
+ * @param row row of the tile
+ * @param rgb buffer of tile_size x tile_size pixels receiving the colors
+ * @param w returns the width of the tile
+ * @param h returns the height of the tile
+ */
+void read_tile(int level, int col, int row, unsigned char *rgb, int *w, int *h)
+{
+	char path[128];
+	FILE *f;
+
+	snprintf(path, sizeof(path), TILES_DIR "/%d/%d_%d.ppm", level, col, row);
+	f = fopen(path, "r");
+	if(!f || fscanf(f, "P6 %d %d 255", w, h)!=2 || fgetc(f)==EOF
+		|| fread(rgb, 1, (size_t)3*(*w)*(*h), f)!=(size_t)3*(*w)*(*h))
+	{
+		fprintf(stderr, "Unable to read tile %d/%d_%d\n", level, col, row);
+		MPI_Abort(MPI_COMM_WORLD, 1);
+	}
+	fclose(f);
+}
+
+
+/**
+ * @brief Render the image as a deep zoom tile pyramid
+ *
+ * Tiles of the last level are distributed cyclically and every process
+ * renders and writes its own, one at a time. Each upper level is then
+ * built from the level below: a tile is the 2x2 average of its (up to)
+ * four children, read back from their files. No process ever holds more
+ * than two tiles, so the memory does not depend on image_size.
+ *
+ * @param c_x_min lowest x boundary of the figure
+ * @param c_y_max highest y boundary of the figure
+ * @param pixel_width width of one pixel
+ * @param pixel_height height of one pixel
+ * @param image_size the resolution of the image
+ * @param tile_size width and height of the tiles
+ * @param formula formula selected on the command line
+ * @param rank rank of the calling process
+ * @param nproc number of processes
+ */
+void render_tiles(double c_x_min, double c_y_max, double pixel_width,
+	double pixel_height, int image_size, int tile_size,
+	const struct formula *formula, int rank, int nproc)
+{
+	char path[128];
+	int i, j, k, n, x, y, w, h, cw, ch, err, level, max_level, size, tiles;
+	int *sum, *acc;
+	unsigned char *rgb, *child;
+	complex z;
+	FILE *f;
+
+	for(max_level=0; (1<<max_level)<image_size; max_level++);
+
+	// Process zero creates the directories and the descriptor
+	err = 0;
+	if(rank==0)
+	{
+		if(mkdir(TILES_DIR, 0755) && errno!=EEXIST)
+			err = 1;
+		for(level=0; level<=max_level && !err; level++)
+		{
+			snprintf(path, sizeof(path), TILES_DIR "/%d", level);
+			if(mkdir(path, 0755) && errno!=EEXIST)
+				err = 1;
+		}
+
+		f = fopen(TILES_DESCRIPTOR, "w");
+		if(!f)
+			err = 1;
+		else
+		{
+			fprintf(f, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n");
+			fprintf(f, "<Image xmlns=\"http://schemas.microsoft.com/deepzoom/2008\"");
+			fprintf(f, " TileSize=\"%d\" Overlap=\"0\" Format=\"ppm\">\n", tile_size);
+			fprintf(f, "  <Size Width=\"%d\" Height=\"%d\"/>\n", image_size, image_size);
+			fprintf(f, "</Image>\n");
+			fclose(f);
+		}
+	}
+
+	MPI_Bcast(&err, 1, MPI_INT, 0, MPI_COMM_WORLD);
+	if(err)
+	{
+		if(rank==0)
+			perror("Unable to create the tile pyramid");
+		MPI_Finalize();
+		exit(1);
+	}
+
+	rgb = malloc((size_t)3*tile_size*tile_size);
+	child = malloc((size_t)3*tile_size*tile_size);
+	sum = malloc((size_t)4*tile_size*tile_size*sizeof(int));
+	if(!rgb || !child || !sum)
+	{
+		fprintf(stderr, "Unable to allocate the tile buffers\n");
+		MPI_Abort(MPI_COMM_WORLD, 1);
+	}
+
+	// Last level: the fractal itself
+	tiles = (image_size+tile_size-1)/tile_size;
+	for(k=rank; k<tiles*tiles; k+=nproc)
+	{
+		x = (k%tiles)*tile_size;
+		y = (k/tiles)*tile_size;
+		w = image_size-x<tile_size ? image_size-x : tile_size;
+		h = image_size-y<tile_size ? image_size-y : tile_size;
+
+		for(i=0; i<h; i++)
+		{
+			for(j=0; j<w; j++)
+			{
+				z=c_x_min+(x+j)*(pixel_width)+(c_y_max-(y+i)*(pixel_height))*I;
+				set_color(&rgb[3*(i*w+j)], formula_point(formula, z));
+			}
+		}
+		write_tile(max_level, k%tiles, k/tiles, rgb, w, h);
+	}
+
+	// Upper levels: every pixel averages the 2x2 pixels below it
+	for(level=max_level-1; level>=0; level--)
+	{
+		// The children of every tile of this level must be on disk
+		MPI_Barrier(MPI_COMM_WORLD);
+
+		size = level_size(image_size, level, max_level);
+		tiles = (size+tile_size-1)/tile_size;
+		for(k=rank; k<tiles*tiles; k+=nproc)
+		{
+			x = (k%tiles)*tile_size;
+			y = (k/tiles)*tile_size;
+			w = size-x<tile_size ? size-x : tile_size;
+			h = size-y<tile_size ? size-y : tile_size;
+			memset(sum, 0, (size_t)4*w*h*sizeof(int));
+
+			for(n=0; n<4; n++)
+			{
+				// Children past the border of the level below do not exist
+				if(2*x+(n&1)*tile_size>=level_size(image_size, level+1, max_level)
+					|| 2*y+(n>>1)*tile_size>=level_size(image_size, level+1, max_level))
+					continue;
+
+				read_tile(level+1, 2*(k%tiles)+(n&1), 2*(k/tiles)+(n>>1), child, &cw, &ch);
+				for(i=0; i<ch; i++)
+				{
+					for(j=0; j<cw; j++)
+					{
+						acc = &sum[4*((((n>>1)*tile_size+i)/2)*w+((n&1)*tile_size+j)/2)];
+						acc[0] += child[3*(i*cw+j)];
+						acc[1] += child[3*(i*cw+j)+1];
+						acc[2] += child[3*(i*cw+j)+2];
+						acc[3]++;
+					}
+				}
+			}
+
+			for(i=0; i<w*h; i++)
+			{
+				rgb[3*i] = sum[4*i]/sum[4*i+3];
+				rgb[3*i+1] = sum[4*i+1]/sum[4*i+3];
+				rgb[3*i+2] = sum[4*i+2]/sum[4*i+3];
+			}
+			write_tile(level, k%tiles, k/tiles, rgb, w, h);
+		}
+	}
+
+	free(rgb);
+	free(child);
+	free(sum);
+}
+
+
+/**
+ * @brief Files and counters of the --costmap instrumentation
+ */
+struct costmap
+{
+	int cost_fd;
+	int owner_fd;
+	int hdr;
+	unsigned char *line;
+	double totals[3];
+};
+
+
+/**
+ * @brief Create the cost and ownership images of --costmap
+ *
+ * @param cm costmap to initialize
+ * @param cost_name path of the cost image
+ * @param owner_name path of the ownership image
+ * @param image_size the resolution of the image
+ * @param rank rank of the calling process
+ */
+void costmap_open(struct costmap *cm, const char *cost_name, const char *owner_name, int image_size, int rank)
+{
+	cm->cost_fd = open_image(cost_name, image_size, rank, 0, &cm->hdr);
+	cm->owner_fd = open_image(owner_name, image_size, rank, 0, &cm->hdr);
+	cm->line = malloc(3*image_size*sizeof(unsigned char));
+	cm->totals[0] = cm->totals[1] = cm->totals[2] = 0;
+}
+
+
+/**
+ * @brief Heat color of the iterations spent on one pixel
+ *
+ * Black for no iteration, then red, yellow and white for MAX_ITER.
+ *
+ * @param px pointer to the 3 bytes (RGB) of the pixel
+ * @param iter number of iterations computed for the pixel
+ */
+void cost_color(unsigned char *px, int iter)
+{
+	int v;
+
+	v = 765*iter/MAX_ITER;
+	px[0] = v>255 ? 255 : v;
+	px[1] = v>510 ? 255 : (v>255 ? v-255 : 0);
+	px[2] = v>510 ? v-510 : 0;
+}
+
+
+/**
+ * @brief Color of a rank in the ownership image
+ *
+ * The ranks are spread over the hue circle, mirrored rows (written but not
+ * computed by the rank) are drawn at half brightness.
+ *
+ * @param px pointer to the 3 bytes (RGB) of the pixel
+ * @param rank rank that owns the row
+ * @param nproc number of processes
+ * @param mirrored whether the row is a mirrored copy
+ */
+void owner_color(unsigned char *px, int rank, int nproc, int mirrored)
+{
+	int h, f, v, k;
+
+	h = 6*255*rank/nproc;
+	f = h%255;
+	v = mirrored ? 127 : 255;
+	for(k=0; k<3; k++)
+	{
+		// Sector of the hue for each channel, red leading
+		switch((h/255+6-2*k)%6)
+		{
+			case 0: case 5: px[k] = v; break;
+			case 1: px[k] = v*(255-f)/255; break;
+			case 4: px[k] = v*f/255; break;
+			default: px[k] = 0;
+		}
+	}
+}
+
+
+/**
+ * @brief Record one computed row in the cost and ownership images
+ *
+ * @param cm costmap opened by costmap_open
+ * @param row iterations of every pixel of the row
+ * @param image_size the resolution of the image
+ * @param i row of the image
+ * @param r mirrored row of i, -1 if none
+ * @param rank rank of the calling process
+ * @param nproc number of processes
+ * @param seconds time spent computing the row
+ */
+void costmap_row(struct costmap *cm, const int *row, int image_size, int i, int r,
+	int rank, int nproc, double seconds)
+{
+	int j;
+	long iters;
+
+	iters = 0;
+	for(j=0; j<image_size; j++)
+	{
+		cost_color(cm->line+3*j, row[j]);
+		iters += row[j];
+	}
+	pwrite_all(cm->cost_fd, cm->line, 3*image_size, cm->hdr+(off_t)3*image_size*i);
+
+	// A mirrored row costs nothing, it stays black in the cost image
+	if(r>=0)
+	{
+		memset(cm->line, 0, 3*image_size);
+		pwrite_all(cm->cost_fd, cm->line, 3*image_size, cm->hdr+(off_t)3*image_size*r);
+		for(j=0; j<image_size; j++)
+			owner_color(cm->line+3*j, rank, nproc, 1);
+		pwrite_all(cm->owner_fd, cm->line, 3*image_size, cm->hdr+(off_t)3*image_size*r);
+	}
+
+	for(j=0; j<image_size; j++)
+		owner_color(cm->line+3*j, rank, nproc, 0);
+	pwrite_all(cm->owner_fd, cm->line, 3*image_size, cm->hdr+(off_t)3*image_size*i);
+
+	cm->totals[0] += 1;
+	cm->totals[1] += iters;
+	cm->totals[2] += seconds;
+}
+
+
+/**
+ * @brief Close the images of --costmap and report the totals of every rank
+ *
+ * The rows, iterations and compute time of every rank are gathered on
+ * process zero, which prints them with the imbalance (slowest rank over
+ * the mean) of the iterations and of the time.
+ *
+ * @param cm costmap opened by costmap_open
+ * @param rank rank of the calling process
+ * @param nproc number of processes
+ */
+void costmap_close(struct costmap *cm, int rank, int nproc)
+{
+	int p;
+	double *all, top[2], sum[2];
+
+	close(cm->cost_fd);
+	close(cm->owner_fd);
+	free(cm->line);
+
+	all = NULL;
+	if(rank==0)
+		all = malloc(3*nproc*sizeof(double));
+	MPI_Gather(cm->totals, 3, MPI_DOUBLE, all, 3, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+	if(rank!=0)
+		return;
+
+	top[0] = top[1] = sum[0] = sum[1] = 0;
+	printf("rank       rows      iterations     seconds\n");
+	for(p=0; p<nproc; p++)
+	{
+		printf("%4d %10.0f %15.0f %11.4f\n", p, all[3*p], all[3*p+1], all[3*p+2]);
+		sum[0] += all[3*p+1];
+		sum[1] += all[3*p+2];
+		if(all[3*p+1]>top[0])
+			top[0] = all[3*p+1];
+		if(all[3*p+2]>top[1])
+			top[1] = all[3*p+2];
+	}
+	printf("imbalance (max/mean): iterations %.3f, seconds %.3f\n",
+		sum[0]>0 ? top[0]*nproc/sum[0] : 1.0, sum[1]>0 ? top[1]*nproc/sum[1] : 1.0);
+	free(all);
+}
+
+
 int main(int argc, char** argv)
 {
 	double c_x_min, c_x_max, c_y_min, c_y_max, pixel_width, pixel_height;
-	int i, j, image_size, i_x_max, i_y_max, rank, nproc, hdr, *row;
-	unsigned char *line;
-	complex z;
-	FILE *img;
+	int i, j, image_size, i_x_max, i_y_max, rank, nproc, hdr, reserve, use_mmap, fd, *row;
+	int k, m, r, nunique, first, chunk_rows, nrows, histogram, precision, tiles, use_costmap;
+	double t0;
+	unsigned char *line, *chunk, *map;
+	size_t total;
+	off_t start, end;
+	long double lwin[4];
+	struct formula formula;
+	struct costmap cm;
 
 	MPI_Init(NULL, NULL);
 	MPI_Comm_size(MPI_COMM_WORLD, &nproc);
@@ -121,25 +1331,140 @@ int main(int argc, char** argv)
         pixel_height      = (c_y_max - c_y_min) / i_y_max;
     }
 
+	reserve = 0;
+	use_mmap = 0;
+	histogram = 0;
+	precision = PRECISION_DOUBLE;
+	tiles = 0;
+	use_costmap = 0;
+	formula.power = 2;
+	formula.julia = 0;
+	formula.c = 0;
+	for(i=6; i<argc; i++)
+	{
+		if(strcmp(argv[i], "--fallocate")==0)
+			reserve = 1;
+		else if(strcmp(argv[i], "--tiles")==0)
+			tiles = TILE_SIZE;
+		else if(strncmp(argv[i], "--tiles=", 8)==0 && sscanf(argv[i]+8, "%d", &tiles)==1 && tiles>=1)
+			continue;
+		else if(strcmp(argv[i], "--precision=auto")==0)
+			precision = PRECISION_AUTO;
+		else if(strcmp(argv[i], "--precision=float")==0)
+			precision = PRECISION_FLOAT;
+		else if(strcmp(argv[i], "--precision=double")==0)
+			precision = PRECISION_DOUBLE;
+		else if(strcmp(argv[i], "--precision=long")==0)
+			precision = PRECISION_LONG;
+		else if(strcmp(argv[i], "--histogram")==0)
+			histogram = 1;
+		else if(strcmp(argv[i], "--mmap")==0)
+			use_mmap = 1;
+		else if(strcmp(argv[i], "--costmap")==0)
+			use_costmap = 1;
+		else if(parse_formula(argv[i], &formula))
+			continue;
+		else
+		{
+			if(rank==0)
+				print_instructions();
+			MPI_Finalize();
+			exit(1);
+		}
+	}
+
+	// The cost and ownership maps are only built by the plain render
+	if(use_costmap && (tiles || histogram))
+	{
+		if(rank==0)
+			print_instructions();
+		MPI_Finalize();
+		exit(1);
+	}
+
+	// Every process takes the same decision from the same window
+	// The float and long double kernels only iterate z^2+c
+	select_formula(&formula);
+	if(formula.power!=2 || formula.julia)
+		precision = PRECISION_DOUBLE;
+
+	if(precision==PRECISION_AUTO)
+	{
+		precision = select_precision(c_x_min, c_x_max, c_y_min, c_y_max, pixel_width, pixel_height);
+		if(rank==0)
+			printf("Precision: %s\n", precision==PRECISION_FLOAT ? "float" :
+				precision==PRECISION_DOUBLE ? "double" : "long double");
+	}
+	parse_long_window(argv, lwin);
+
+	if(tiles)
+	{
+		render_tiles(c_x_min, c_y_max, pixel_width, pixel_height, image_size, tiles, &formula, rank, nproc);
+		MPI_Finalize();
+		return 0;
+	}
+
+	if(histogram)
+	{
+		fd = open_image("mandelbrot_mpi.ppm", image_size, rank, reserve, &hdr);
+		render_histogram(c_x_min, c_y_max, pixel_width, pixel_height, image_size, rank, nproc, &formula, fd, hdr);
+		close(fd);
+		MPI_Finalize();
+		return 0;
+	}
+
+	// Rows of a process are contiguous in the file, so they are written in
+	// chunks of up to WRITE_CHUNK bytes
+	chunk_rows = WRITE_CHUNK/(3*image_size);
+	if(chunk_rows<1)
+		chunk_rows = 1;
+
 	row = malloc(image_size*sizeof(int));
-	line = malloc(3*image_size*sizeof(unsigned char));
-	img=fopen("mandelbrot_mpi.ppm","w");
+	if(!use_mmap)
+		chunk = malloc((size_t)chunk_rows*3*image_size*sizeof(unsigned char));
+	fd = open_image("mandelbrot_mpi.ppm", image_size, rank, reserve, &hdr);
+	if(use_costmap)
+		costmap_open(&cm, "mandelbrot_mpi_cost.ppm", "mandelbrot_mpi_owner.ppm", image_size, rank);
 
-	MPI_Barrier(MPI_COMM_WORLD);
+	m = formula_symmetric(&formula) ? mirror_axis(c_y_min, c_y_max, pixel_height) : -1;
+	nunique = unique_rows(m, image_size);
 
-	if(rank==0)
-		hdr = fprintf(img, "P6\n%d %d 255\n", image_size, image_size);
+	total = hdr+(size_t)3*image_size*image_size;
+	start = end = 0;
+	if(block_start(rank, nunique, nproc)<block_start(rank+1, nunique, nproc))
+	{
+		start = hdr+(off_t)3*image_size*unique_row(block_start(rank, nunique, nproc), m);
+		end = hdr+(off_t)3*image_size*(unique_row(block_start(rank+1, nunique, nproc)-1, m)+1);
+	}
+	if(use_mmap)
+		map = map_image(fd, total, start, end);
 
-	MPI_Bcast(&hdr, 1, MPI_INT, 0, MPI_COMM_WORLD);
+	first = 0;
+	nrows = 0;
 
-	for(i=(rank*image_size)/nproc; i<((rank+1)*image_size)/nproc; i++)
+	for(k=block_start(rank, nunique, nproc); k<block_start(rank+1, nunique, nproc); k++)
 	{
-		for(j=0; j<i_x_max; j++)
+		i = unique_row(k, m);
+
+		// The block of unique rows has a gap where the mirrored rows are
+		if(!use_mmap && nrows>0 && i!=first+nrows)
 		{
-			z=c_x_min+j*(pixel_width)+(c_y_max-i*(pixel_height))*I;
-			row[j]=mandelbrot(z);
+			pwrite_all(fd, chunk, (size_t)nrows*3*image_size, hdr+(off_t)3*image_size*first);
+			nrows = 0;
 		}
+		if(nrows==0)
+			first = i;
+
+		t0 = MPI_Wtime();
+		compute_row(precision, i, i_x_max, c_x_min, c_y_max, pixel_width, pixel_height, lwin, &formula, row);
+		if(use_costmap)
+			costmap_row(&cm, row, image_size, i, mirror_row(i, m, image_size), rank, nproc, MPI_Wtime()-t0);
 
+		// With --mmap the colors go straight to the row in the file
+		if(use_mmap)
+			line = map+hdr+(size_t)3*image_size*i;
+		else
+			line = chunk+(size_t)nrows*3*image_size;
 		for(j=0; j<image_size; j++)
 		{
 			if(row[j]<=63)
@@ -162,10 +1487,30 @@ int main(int argc, char** argv)
 			}
 		}
 
-		fseek(img, hdr+3*image_size*i, SEEK_SET);
-		fwrite(line, 1, 3*image_size, img);
+		r = mirror_row(i, m, image_size);
+		if(r>=0)
+		{
+			if(use_mmap)
+				memcpy(map+hdr+(size_t)3*image_size*r, line, 3*image_size);
+			else
+				pwrite_all(fd, line, 3*image_size, hdr+(off_t)3*image_size*r);
+		}
+
+		if(!use_mmap && ++nrows==chunk_rows)
+		{
+			pwrite_all(fd, chunk, (size_t)nrows*3*image_size, hdr+(off_t)3*image_size*first);
+			nrows = 0;
+		}
 	}
 
+	if(nrows>0)
+		pwrite_all(fd, chunk, (size_t)nrows*3*image_size, hdr+(off_t)3*image_size*first);
+
+	if(use_mmap)
+		unmap_image(map, total, start, end);
+	close(fd);
+	if(use_costmap)
+		costmap_close(&cm, rank, nproc);
 	MPI_Finalize();
 	return 0;
 }
@@ -0,0 +1,696 @@
+/** @file 	mandelbrot_mpi_hms.c
+ *	@brief	Open MPI C implementation to compute and plot mandelbrot set
+ *	
+ *	Open MPI C implementation of a program to compute and plot
+ *  some subset of a mandelbrot set adapted from the classes given by
+ *  MJ Rutter (https://www.tcm.phy.cam.ac.uk/~mjr/courses/MPI/MPI.pdf)
+ *  using a hierarchical Master/Slave paradigm
+ *
+ *	The processes of every node (found by splitting MPI_COMM_WORLD with
+ *	MPI_COMM_TYPE_SHARED) are led by their first process, the sub-master.
+ *	Sub-masters claim blocks of rows from a counter kept by process zero in
+ *	an MPI window (MPI_Fetch_and_op), hand the rows of their blocks one at a
+ *	time to the slaves of the node and write the rows they receive straight
+ *	to the image with pwrite. Process zero only answers one atomic increment
+ *	per block, so its traffic grows with the number of blocks and nodes
+ *	instead of the number of rows. A node with a single process renders its
+ *	blocks by itself.
+ *
+ *	Usage:
+ *    mpirun -np NP ./mandelbrot_mpi_hms c_x_min c_x_max c_y_min c_y_max image_size [options]
+ *		- NP: Number of Open MPI processes
+ *		- c_x_min: Lowest x boundary for the figure to be computed
+ *		- c_x_max: Highest x boundary for the figure to be computed
+ *		- c_y_mix: Lowest y boundary for the figure to be computed
+ *		- c_y_max: Highest y boundary for the figure to be computed
+ *		- image_size: The resolution of the resulting image
+ *	Options:
+ *		- --block=N: Rows claimed by a sub-master at a time (default
+ *		  BLOCK_ROWS)
+ *		- --fallocate: Reserve the blocks of the whole image with
+ *		  posix_fallocate before any row is written
+ *		- --power=d: Iterate z^d+c (Multibrot set) instead of z^2+c
+ *		- --julia=re,im: Render the Julia set of the constant re+im*i (with
+ *		  the power of --power) instead of the Mandelbrot set
+ *
+ *	When the window straddles the real axis on mirrored row positions (as
+ *	the Full Picture does) only the unique rows are split in blocks and
+ *	each of them is also written to its mirrored row.
+ *  Usage examples:
+ *      Full Picture: mpirun -np 4 ./mandelbrot_mpi_hms -2.5 1.5 -2.0 2.0 11500
+ *      Seahorse Valley: mpirun -np 4 ./mandelbrot_mpi_hms -0.8 -0.7 0.05 0.15 8192
+ *      Elephant Valley: mpirun -np 8 ./mandelbrot_mpi_hms 0.175 0.375 -0.1 0.1 800
+ *      TS Valley: mpirun -np 2 ./mandelbrot_mpi_hms -0.188 -0.012 0.554 0.754 400
+ *
+ *	Notes:
+ *      Although we made modifications, this code is heavily based on the
+ *		class examples provided by MJ Rutter.
+ *		Because of that, in any event of license and copyright conflict, the
+ *		license/copyright provided by Mr. Rutter TAKE PRECEDENCE OVER the
+ *		GPLv3 on which this code was released.
+ *
+ *	@author		Decio Lauro Soares (deciolauro@gmail.com)
+ *	@date		05 Jul 2017
+ *	@bug		No known bugs
+ *	@warning	Based on class given by MJ Rutter(May contain Copyright issues)
+ * 	@copyright	GNU Public License v3
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <complex.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <mpi.h>
+
+#define MAX_ITER 300
+#define ESCAPE_RADIUS_SQUARED 4
+#define BLOCK_ROWS 64
+
+
+/**
+ * @brief Generate an escape time kernel for one fixed formula
+ *
+ * Every kernel iterates z from the given point adding the constant c,
+ * which is the point itself for the Multibrot sets and a fixed constant
+ * for the Julia sets. The step is pasted into the loop, so each power is
+ * compiled on its own with no branch on the formula while iterating.
+ *
+ * @param name name of the generated function
+ * @param step update of z (and temporaries) for one iteration
+ */
+#define FORMULA_KERNEL(name, step) \
+int name(complex z, complex c, int power) \
+{ \
+	int i; \
+	complex w; \
+ \
+	(void)power; \
+	(void)w; \
+	for(i=1; i<MAX_ITER; i++) \
+	{ \
+		step; \
+		if((creal(z)*creal(z))+(cimag(z)*cimag(z))>ESCAPE_RADIUS_SQUARED) \
+			break; \
+	} \
+ \
+	return i; \
+}
+
+FORMULA_KERNEL(formula_power2, z=z*z+c)
+FORMULA_KERNEL(formula_power3, z=z*z*z+c)
+FORMULA_KERNEL(formula_power4, w=z*z; z=w*w+c)
+FORMULA_KERNEL(formula_power5, w=z*z; z=w*w*z+c)
+FORMULA_KERNEL(formula_power6, w=z*z*z; z=w*w+c)
+
+
+/**
+ * @brief Escape time kernel of z^power+c for the powers without a
+ * specialized kernel
+ *
+ * @param z starting point of the orbit
+ * @param c constant added at every iteration
+ * @param power exponent of z
+ * @return i integer with the number of iterations until divergerce or MAX_ITER
+ */
+int formula_generic(complex z, complex c, int power)
+{
+	int i, k;
+	complex w;
+
+	for(i=1; i<MAX_ITER; i++)
+	{
+		w = z;
+		for(k=1; k<power; k++)
+			w *= z;
+		z = w+c;
+		if((creal(z)*creal(z))+(cimag(z)*cimag(z))>ESCAPE_RADIUS_SQUARED)
+			break;
+	}
+
+	return i;
+}
+
+
+/**
+ * @brief Formula selected on the command line
+ */
+struct formula
+{
+	int (*kernel)(complex z, complex c, int power);
+	int power;
+	int julia;
+	complex c;
+};
+
+
+/**
+ * @brief Parse the --power=d and --julia=re,im options
+ *
+ * @param arg command line argument
+ * @param f formula updated with the option
+ * @return 1 if arg was a formula option, 0 otherwise
+ */
+int parse_formula(const char *arg, struct formula *f)
+{
+	double re, im;
+
+	if(strncmp(arg, "--power=", 8)==0 && sscanf(arg+8, "%d", &f->power)==1 && f->power>=2)
+		return 1;
+	if(strncmp(arg, "--julia=", 8)==0 && sscanf(arg+8, "%lf,%lf", &re, &im)==2)
+	{
+		f->julia = 1;
+		f->c = re+im*I;
+		return 1;
+	}
+	return 0;
+}
+
+
+/**
+ * @brief Pick the kernel for the power of the formula
+ *
+ * @param f formula whose kernel is set
+ */
+void select_formula(struct formula *f)
+{
+	switch(f->power)
+	{
+		case 2: f->kernel = formula_power2; break;
+		case 3: f->kernel = formula_power3; break;
+		case 4: f->kernel = formula_power4; break;
+		case 5: f->kernel = formula_power5; break;
+		case 6: f->kernel = formula_power6; break;
+		default: f->kernel = formula_generic;
+	}
+}
+
+
+/**
+ * @brief Number of iterations of one point with the selected formula
+ *
+ * @param f formula selected by select_formula
+ * @param z point of the complex plane
+ * @return i integer with the number of iterations until divergerce or MAX_ITER
+ */
+int formula_point(const struct formula *f, complex z)
+{
+	return f->kernel(z, f->julia ? f->c : z, f->power);
+}
+
+
+/**
+ * @brief Whether the image of the formula is symmetric about the real axis
+ *
+ * The Multibrot sets and the Julia sets of a real constant are their own
+ * complex conjugate, the other Julia sets are not.
+ *
+ * @param f formula selected on the command line
+ * @return 1 if the rows mirrored about the real axis are equal
+ */
+int formula_symmetric(const struct formula *f)
+{
+	return !f->julia || cimag(f->c)==0;
+}
+
+
+/**
+ * @brief Function responsible for printing usage instructions
+ *
+ * This function is responsible for printing the usage instructions
+ *
+ */
+void print_instructions()
+{
+	printf("usage: mpirun -np NP ./mandelbrot_mpi_hms c_x_min c_x_max c_y_min c_y_max image_size [--block=N] [--fallocate]\n");
+	printf("    [--power=d] [--julia=re,im]\n");
+	printf("examples with image_size = 11500:\n");
+	printf("    Full Picture:         mpirun -np 4 ./mandelbrot_mpi_hms -2.5 1.5 -2.0 2.0 11500\n");
+	printf("    Seahorse Valley:      mpirun -np 4 ./mandelbrot_mpi_hms -0.8 -0.7 0.05 0.15 11500\n");
+	printf("    Elephant Valley:      mpirun -np 4 ./mandelbrot_mpi_hms 0.175 0.375 -0.1 0.1 11500\n");
+	printf("    Triple Spiral Valley: mpirun -np 4 ./mandelbrot_mpi_hms -0.188 -0.012 0.554 0.754 11500\n");
+}
+
+
+/**
+ * @brief Find the axis of the conjugate symmetry of the image
+ *
+ * The set is symmetric about the real axis, so when the window straddles it
+ * and the rows fall on mirrored positions, row i and row m-i have the same
+ * pixels. Such rows are computed once and written twice.
+ *
+ * @param c_y_min lowest y boundary of the figure
+ * @param c_y_max highest y boundary of the figure
+ * @param pixel_height height of one pixel
+ * @return m the sum of the indexes of two mirrored rows, or -1 if the
+ *		   window has no usable symmetry
+ */
+int mirror_axis(double c_y_min, double c_y_max, double pixel_height)
+{
+	double m;
+	int r;
+
+	if(c_y_min>=0 || c_y_max<=0)
+		return -1;
+
+	m = 2*c_y_max/pixel_height;
+	r = (int)(m+0.5);
+	if(m-r>1e-6 || r-m>1e-6)
+		return -1;
+
+	return r;
+}
+
+
+/**
+ * @brief Count the rows that must really be computed
+ *
+ * Rows in (m/2, m] are copies of rows [0, m/2), everything else is unique.
+ *
+ * @param m axis returned by mirror_axis
+ * @param image_size the resolution of the image
+ * @return the number of unique rows
+ */
+int unique_rows(int m, int image_size)
+{
+	int last;
+
+	if(m<0)
+		return image_size;
+
+	last = m<image_size-1 ? m : image_size-1;
+	return last>m/2 ? image_size-(last-m/2) : image_size;
+}
+
+
+/**
+ * @brief Map the k-th unique row to its row in the image
+ *
+ * @param k index among the unique rows
+ * @param m axis returned by mirror_axis
+ * @return the row of the image
+ */
+int unique_row(int k, int m)
+{
+	if(m<0 || k<=m/2)
+		return k;
+	return k+m-m/2;
+}
+
+
+/**
+ * @brief Find the row that is a copy of row i
+ *
+ * @param i row of the image
+ * @param m axis returned by mirror_axis
+ * @param image_size the resolution of the image
+ * @return the mirrored row, or -1 if row i has no distinct mirror
+ */
+int mirror_row(int i, int m, int image_size)
+{
+	if(m<0 || 2*i>=m || m-i>=image_size)
+		return -1;
+	return m-i;
+}
+
+
+/**
+ * @brief Write the whole buffer at the given file offset
+ *
+ * Uses pwrite on the raw file descriptor, so there is no stdio buffering
+ * and no shared file position between the processes. Aborts every process
+ * if the write fails.
+ *
+ * @param fd destination file descriptor
+ * @param buf data to be written
+ * @param len number of bytes to be written
+ * @param off offset of the first byte in the file
+ */
+void pwrite_all(int fd, const unsigned char *buf, size_t len, off_t off)
+{
+	ssize_t n;
+
+	while(len>0)
+	{
+		n = pwrite(fd, buf, len, off);
+		if(n<=0)
+		{
+			perror("Unable to write the image");
+			MPI_Abort(MPI_COMM_WORLD, 1);
+		}
+		buf += n;
+		len -= n;
+		off += n;
+	}
+}
+
+
+/**
+ * @brief Create the image file shared by every process
+ *
+ * Process zero creates (truncating) the file, writes the header and sets
+ * the final size, optionally reserving its blocks. Only after that the
+ * other processes open it, so no truncation can race with a row write.
+ *
+ * @param name path of the image
+ * @param image_size the resolution of the image
+ * @param rank rank of the calling process
+ * @param reserve whether posix_fallocate should be used
+ * @param hdr returns the size of the header
+ * @return fd the file descriptor opened for reading and writing
+ */
+int open_image(const char *name, int image_size, int rank, int reserve, int *hdr)
+{
+	char header[64];
+	off_t total;
+	int fd, err;
+
+	*hdr = snprintf(header, sizeof(header), "P6\n%d %d 255\n", image_size, image_size);
+	total = *hdr+(off_t)3*image_size*image_size;
+	err = 0;
+
+	if(rank==0)
+	{
+		// posix_fallocate returns its error instead of setting errno, and
+		// the error is reported before MPI_Bcast can change errno
+		fd = open(name, O_RDWR|O_CREAT|O_TRUNC, 0644);
+		if(fd<0)
+			err = errno;
+		else if(reserve)
+			err = posix_fallocate(fd, 0, total);
+		if(!err && ftruncate(fd, total))
+			err = errno;
+
+		if(err)
+			fprintf(stderr, "Unable to create the image: %s\n", strerror(err));
+		else
+			pwrite_all(fd, (unsigned char *)header, *hdr, 0);
+	}
+
+	MPI_Bcast(&err, 1, MPI_INT, 0, MPI_COMM_WORLD);
+	if(err)
+	{
+		MPI_Finalize();
+		exit(1);
+	}
+
+	if(rank!=0)
+		fd = open(name, O_RDWR);
+	if(fd<0)
+	{
+		perror("Unable to open the image");
+		MPI_Abort(MPI_COMM_WORLD, 1);
+	}
+
+	return fd;
+}
+
+
+
+/**
+ * @brief Apply the fixed color scheme to one pixel
+ *
+ * @param px pointer to the 3 bytes (RGB) of the pixel
+ * @param iter number of iterations computed for the pixel
+ */
+void set_color(unsigned char *px, int iter)
+{
+	if(iter==MAX_ITER)
+	{
+		px[0]=255;
+		px[1]=255;
+		px[2]=255;
+	}
+	else if(iter<=63)
+	{
+		px[0]=255;
+		px[1]=255-4*iter;
+		px[2]=255-4*iter;
+	}
+	else
+	{
+		px[0]=255;
+		px[1]=iter-63;
+		px[2]=0;
+	}
+}
+
+
+/**
+ * @brief Compute and color one row of the image
+ *
+ * @param c_x_min lowest x boundary of the figure
+ * @param c_y_max highest y boundary of the figure
+ * @param pixel_width width of one pixel
+ * @param pixel_height height of one pixel
+ * @param image_size the resolution of the image
+ * @param formula formula selected on the command line
+ * @param i row of the image
+ * @param line output with the colors of the row
+ */
+void render_row(double c_x_min, double c_y_max, double pixel_width,
+	double pixel_height, int image_size, const struct formula *formula,
+	int i, unsigned char *line)
+{
+	int j;
+	complex z;
+
+	for(j=0; j<image_size; j++)
+	{
+		z=c_x_min+j*(pixel_width)+(c_y_max-i*(pixel_height))*I;
+		set_color(&line[3*j], formula_point(formula, z));
+	}
+}
+
+
+/**
+ * @brief Write one row and its mirrored row to the image
+ *
+ * @param fd descriptor returned by open_image
+ * @param hdr size of the header
+ * @param line colors of the row
+ * @param image_size the resolution of the image
+ * @param m axis returned by mirror_axis
+ * @param i row of the image
+ */
+void write_row(int fd, int hdr, const unsigned char *line, int image_size, int m, int i)
+{
+	int r;
+
+	pwrite_all(fd, line, 3*image_size, hdr+(off_t)3*image_size*i);
+	r = mirror_row(i, m, image_size);
+	if(r>=0)
+		pwrite_all(fd, line, 3*image_size, hdr+(off_t)3*image_size*r);
+}
+
+
+/**
+ * @brief Next row of the sub-master, claiming a new block when needed
+ *
+ * Blocks are numbered from the counter of process zero, incremented
+ * atomically with MPI_Fetch_and_op, so no block is claimed twice and no
+ * message goes through process zero's main loop.
+ *
+ * @param win window holding the block counter on process zero
+ * @param next index (among the unique rows) of the next row of the block
+ * @param end index after the last row of the block
+ * @param nunique number of unique rows
+ * @param block rows per block
+ * @param m axis returned by mirror_axis
+ * @return the next row of the image, or -1 once every block was claimed
+ */
+int claim_row(MPI_Win win, int *next, int *end, int nunique, int block, int m)
+{
+	int one, b;
+
+	if(*next==*end)
+	{
+		one = 1;
+		MPI_Fetch_and_op(&one, &b, MPI_INT, 0, 0, MPI_SUM, win);
+		MPI_Win_flush(0, win);
+
+		if((long long)b*block>=nunique)
+			return -1;
+		*next = b*block;
+		*end = nunique-*next<block ? nunique : *next+block;
+	}
+
+	return unique_row((*next)++, m);
+}
+
+
+/**
+ * @brief Sub-master of a node
+ *
+ * Keeps every slave of the node with one row and writes the rows it gets
+ * back. Without slaves the sub-master computes its rows itself.
+ *
+ * @param node communicator of the processes of the node
+ * @param win window holding the block counter on process zero
+ * @param fd descriptor returned by open_image
+ * @param hdr size of the header
+ * @param image_size the resolution of the image
+ * @param block rows per block
+ * @param m axis returned by mirror_axis
+ * @param line buffer for one row
+ * @param c_x_min lowest x boundary of the figure
+ * @param c_y_max highest y boundary of the figure
+ * @param pixel_width width of one pixel
+ * @param pixel_height height of one pixel
+ * @param formula formula selected on the command line
+ */
+void submaster(MPI_Comm node, MPI_Win win, int fd, int hdr, int image_size,
+	int block, int m, unsigned char *line, double c_x_min, double c_y_max,
+	double pixel_width, double pixel_height, const struct formula *formula)
+{
+	int i, s, nslaves, busy, next, end, nunique;
+	MPI_Status st;
+
+	MPI_Comm_size(node, &nslaves);
+	nslaves--;
+	nunique = unique_rows(m, image_size);
+	next = end = 0;
+
+	if(nslaves==0)
+	{
+		while((i=claim_row(win, &next, &end, nunique, block, m))>=0)
+		{
+			render_row(c_x_min, c_y_max, pixel_width, pixel_height, image_size, formula, i, line);
+			write_row(fd, hdr, line, image_size, m, i);
+		}
+		return;
+	}
+
+	busy = 0;
+	for(s=1; s<=nslaves; s++)
+	{
+		i = claim_row(win, &next, &end, nunique, block, m);
+		MPI_Send(&i, 1, MPI_INT, s, 0, node);
+		if(i>=0)
+			busy++;
+	}
+
+	while(busy>0)
+	{
+		MPI_Recv(line, 3*image_size, MPI_CHAR, MPI_ANY_SOURCE, MPI_ANY_TAG, node, &st);
+		write_row(fd, hdr, line, image_size, m, st.MPI_TAG);
+
+		// If there is no row left, -1 closes the slave
+		i = claim_row(win, &next, &end, nunique, block, m);
+		MPI_Send(&i, 1, MPI_INT, st.MPI_SOURCE, 0, node);
+		if(i<0)
+			busy--;
+	}
+}
+
+
+int main(int argc, char** argv)
+{
+	double c_x_min, c_x_max, c_y_min, c_y_max, pixel_width, pixel_height;
+	int i, image_size, i_x_max, i_y_max, rank, node_rank, hdr, fd;
+	int m, block, reserve, *counter;
+	unsigned char *line;
+	struct formula formula;
+	MPI_Comm node, leaders;
+	MPI_Status st;
+	MPI_Win win;
+
+	MPI_Init(NULL, NULL);
+	MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+
+	if(argc < 6)
+	{
+		if(rank==0)
+			print_instructions();
+        exit(0);
+    }
+    else
+	{
+        sscanf(argv[1], "%lf", &c_x_min);
+        sscanf(argv[2], "%lf", &c_x_max);
+        sscanf(argv[3], "%lf", &c_y_min);
+        sscanf(argv[4], "%lf", &c_y_max);
+        sscanf(argv[5], "%d", &image_size);
+
+        i_x_max           = image_size;
+        i_y_max           = image_size;
+
+        pixel_width       = (c_x_max - c_x_min) / i_x_max;
+        pixel_height      = (c_y_max - c_y_min) / i_y_max;
+    }
+
+	block = BLOCK_ROWS;
+	reserve = 0;
+	formula.power = 2;
+	formula.julia = 0;
+	formula.c = 0;
+	for(i=6; i<argc; i++)
+	{
+		if(strcmp(argv[i], "--fallocate")==0)
+			reserve = 1;
+		else if(strncmp(argv[i], "--block=", 8)==0 && sscanf(argv[i]+8, "%d", &block)==1 && block>=1)
+			continue;
+		else if(parse_formula(argv[i], &formula))
+			continue;
+		else
+		{
+			if(rank==0)
+				print_instructions();
+			MPI_Finalize();
+			exit(1);
+		}
+	}
+
+	select_formula(&formula);
+	m = formula_symmetric(&formula) ? mirror_axis(c_y_min, c_y_max, pixel_height) : -1;
+
+	// Processes sharing memory form a node, led by their first process
+	MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, rank, MPI_INFO_NULL, &node);
+	MPI_Comm_rank(node, &node_rank);
+	MPI_Comm_split(MPI_COMM_WORLD, node_rank==0 ? 0 : MPI_UNDEFINED, rank, &leaders);
+
+	fd = open_image("mandelbrot_mpi_hms.ppm", image_size, rank, reserve, &hdr);
+	line = malloc(3*image_size*sizeof(unsigned char));
+
+	if(node_rank==0)
+	{
+		// The block counter lives on process zero (rank 0 of leaders too)
+		MPI_Win_allocate(rank==0 ? sizeof(int) : 0, sizeof(int), MPI_INFO_NULL, leaders, &counter, &win);
+		MPI_Win_lock_all(0, win);
+		if(rank==0)
+		{
+			*counter = 0;
+			MPI_Win_sync(win);
+		}
+		MPI_Barrier(leaders);
+
+		submaster(node, win, fd, hdr, image_size, block, m, line,
+			c_x_min, c_y_max, pixel_width, pixel_height, &formula);
+
+		MPI_Win_unlock_all(win);
+		MPI_Win_free(&win);
+		MPI_Comm_free(&leaders);
+	}
+	// Slave
+	else
+	{
+		for(;;)
+		{
+			MPI_Recv(&i, 1, MPI_INT, 0, 0, node, &st);
+
+			// If received message -1, close the slave
+			if(i==-1)
+				break;
+
+			render_row(c_x_min, c_y_max, pixel_width, pixel_height, image_size, &formula, i, line);
+			MPI_Send(line, 3*image_size, MPI_CHAR, 0, i, node);
+		}
+	}
+
+	close(fd);
+	MPI_Comm_free(&node);
+	MPI_Finalize();
+	return 0;
+}
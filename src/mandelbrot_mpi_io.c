@@ -8,13 +8,43 @@
  *  by using the MPI_Gather call and a buffer to keep the transfer
  *
  *	Usage:
- *    mpirun -np NP ./mandelbrot_mpi_io c_x_min c_x_max c_y_min c_y_max image_size
+ *    mpirun -np NP ./mandelbrot_mpi_io c_x_min c_x_max c_y_min c_y_max image_size [options]
  *		- NP: Number of Open MPI processes
  *		- c_x_min: Lowest x boundary for the figure to be computed
  *		- c_x_max: Highest x boundary for the figure to be computed
  *		- c_y_mix: Lowest y boundary for the figure to be computed
  *		- c_y_max: Highest y boundary for the figure to be computed
  *		- image_size: The resolution of the resulting image
+ *	Options:
+ *		- --shm: When every process runs on the same node, keep the image in
+ *		  an MPI shared memory window where each process writes its own rows,
+ *		  replacing the per row MPI_Gather. Process zero streams the window
+ *		  out after a single synchronization
+ *		- --power=d: Iterate z^d+c (Multibrot set) instead of z^2+c
+ *		- --julia=re,im: Render the Julia set of the constant re+im*i (with
+ *		  the power of --power) instead of the Mandelbrot set
+ *		- --async: Process zero copies the gathered rows into a bounded ring
+ *		  of RING_SLOTS segments that background threads write to the image
+ *		  (with io_uring when built with HAVE_LIBURING, with WRITER_THREADS
+ *		  pwrite threads otherwise), so the next MPI_Gather does not wait
+ *		  for the disk. Ignored with --shm
+ *		- --bind: Pin every process to one CPU, spreading the processes of a
+ *		  node evenly over the CPUs they are allowed to use (launch with
+ *		  --bind-to none to offer them the whole node), before any buffer
+ *		  is allocated and touched. The --async writer threads run on the
+ *		  other CPUs the process was allowed to use. Process zero prints
+ *		  the host, CPU and NUMA node of every process and of its writers
+ *		- --hugepages: Back the gather buffer of process zero (when it holds
+ *		  at least one huge page) with explicit huge pages (MAP_HUGETLB)
+ *		  when some are reserved, with transparent huge pages otherwise, and
+ *		  report which ones it actually got. With --shm the shared image is
+ *		  advised to use transparent huge pages
+ *
+ *	When the window straddles the real axis on mirrored row positions (as
+ *	the Full Picture does) only the unique rows are distributed among the
+ *	processes and process zero also writes each of them to its mirrored row.
+ *	Every buffer is cleared by the process that allocates it, so its pages
+ *	are placed on the NUMA node where that process runs.
  *  Usage examples:
  *      Full Picture: mpirun -np 4 ./mandelbrot_mpi_io -2.5 1.5 -2.0 2.0 11500
  *      Seahorse Valley: mpirun -np 4 ./mandelbrot_mpi_io -0.8 -0.7 0.05 0.15 8192
@@ -35,43 +65,545 @@
  * 	@copyright	GNU Public License v3
  */
 
+// sched_setaffinity, pthread_setaffinity_np, the CPU_* macros and MAP_HUGETLB
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
 #include <complex.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/mman.h>
 #include <mpi.h>
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
 
 #define MAX_ITER 300
 #define ESCAPE_RADIUS_SQUARED 4
+#define RING_SLOTS 64
+#define WRITER_THREADS 2
+#define GATHER_CHUNK (4<<20)
+#define HUGE_PAGE (2<<20)
+#define MAX_NODES 64
+#define PAGES_NORMAL 0
+#define PAGES_TRANSPARENT 1
+#define PAGES_EXPLICIT 2
 
 
 /**
- * @brief Perform the calculations for the set until divergence or MAX_ITER 
+ * @brief Generate an escape time kernel for one fixed formula
  *
- * For the complex number z0, it performs the Mandelbrot calculation until it
- * reaches divergence or it reaches the maximum number of iterations,
- * whichever happens first, returning the number of iterations until divergence
- * or MAX_ITER
+ * Every kernel iterates z from the given point adding the constant c,
+ * which is the point itself for the Multibrot sets and a fixed constant
+ * for the Julia sets. The step is pasted into the loop, so each power is
+ * compiled on its own with no branch on the formula while iterating.
+ *
+ * @param name name of the generated function
+ * @param step update of z (and temporaries) for one iteration
+ */
+#define FORMULA_KERNEL(name, step) \
+int name(complex z, complex c, int power) \
+{ \
+	int i; \
+	complex w; \
+ \
+	(void)power; \
+	(void)w; \
+	for(i=1; i<MAX_ITER; i++) \
+	{ \
+		step; \
+		if((creal(z)*creal(z))+(cimag(z)*cimag(z))>ESCAPE_RADIUS_SQUARED) \
+			break; \
+	} \
+ \
+	return i; \
+}
+
+FORMULA_KERNEL(formula_power2, z=z*z+c)
+FORMULA_KERNEL(formula_power3, z=z*z*z+c)
+FORMULA_KERNEL(formula_power4, w=z*z; z=w*w+c)
+FORMULA_KERNEL(formula_power5, w=z*z; z=w*w*z+c)
+FORMULA_KERNEL(formula_power6, w=z*z*z; z=w*w+c)
+
+
+/**
+ * @brief Escape time kernel of z^power+c for the powers without a
+ * specialized kernel
  *
- * @param z0 complex number to perform the Mandelbrot calculations
+ * @param z starting point of the orbit
+ * @param c constant added at every iteration
+ * @param power exponent of z
  * @return i integer with the number of iterations until divergerce or MAX_ITER
  */
-int mandelbrot(complex z0)
+int formula_generic(complex z, complex c, int power)
 {
-	int i;
-	complex z;
+	int i, k;
+	complex w;
 
-	z = z0;
 	for(i=1; i<MAX_ITER; i++)
 	{
-		z=z*z+z0;
+		w = z;
+		for(k=1; k<power; k++)
+			w *= z;
+		z = w+c;
 		if((creal(z)*creal(z))+(cimag(z)*cimag(z))>ESCAPE_RADIUS_SQUARED)
 			break;
-  	}
+	}
 
 	return i;
 }
 
 
+/**
+ * @brief Formula selected on the command line
+ */
+struct formula
+{
+	int (*kernel)(complex z, complex c, int power);
+	int power;
+	int julia;
+	complex c;
+};
+
+
+/**
+ * @brief Parse the --power=d and --julia=re,im options
+ *
+ * @param arg command line argument
+ * @param f formula updated with the option
+ * @return 1 if arg was a formula option, 0 otherwise
+ */
+int parse_formula(const char *arg, struct formula *f)
+{
+	double re, im;
+
+	if(strncmp(arg, "--power=", 8)==0 && sscanf(arg+8, "%d", &f->power)==1 && f->power>=2)
+		return 1;
+	if(strncmp(arg, "--julia=", 8)==0 && sscanf(arg+8, "%lf,%lf", &re, &im)==2)
+	{
+		f->julia = 1;
+		f->c = re+im*I;
+		return 1;
+	}
+	return 0;
+}
+
+
+/**
+ * @brief Pick the kernel for the power of the formula
+ *
+ * @param f formula whose kernel is set
+ */
+void select_formula(struct formula *f)
+{
+	switch(f->power)
+	{
+		case 2: f->kernel = formula_power2; break;
+		case 3: f->kernel = formula_power3; break;
+		case 4: f->kernel = formula_power4; break;
+		case 5: f->kernel = formula_power5; break;
+		case 6: f->kernel = formula_power6; break;
+		default: f->kernel = formula_generic;
+	}
+}
+
+
+/**
+ * @brief Number of iterations of one point with the selected formula
+ *
+ * @param f formula selected by select_formula
+ * @param z point of the complex plane
+ * @return i integer with the number of iterations until divergerce or MAX_ITER
+ */
+int formula_point(const struct formula *f, complex z)
+{
+	return f->kernel(z, f->julia ? f->c : z, f->power);
+}
+
+
+/**
+ * @brief Whether the image of the formula is symmetric about the real axis
+ *
+ * The Multibrot sets and the Julia sets of a real constant are their own
+ * complex conjugate, the other Julia sets are not.
+ *
+ * @param f formula selected on the command line
+ * @return 1 if the rows mirrored about the real axis are equal
+ */
+int formula_symmetric(const struct formula *f)
+{
+	return !f->julia || cimag(f->c)==0;
+}
+
+
+/**
+ * @brief One pending write of the asynchronous writer
+ */
+struct write_req
+{
+	size_t len;
+	off_t off;
+	off_t mirror;
+	int done;
+};
+
+
+/**
+ * @brief Asynchronous writer of the I/O process
+ *
+ * Rows are copied (or received) into a bounded ring of RING_SLOTS slots
+ * and written by background threads, so the message loop only waits for
+ * the disk when the ring is full. Slots are released in order once their
+ * write completed. With HAVE_LIBURING a single thread submits every batch
+ * of queued rows to io_uring, otherwise WRITER_THREADS threads pwrite them.
+ * The threads never call MPI: a failed write is kept in error and reported
+ * by the main thread.
+ */
+struct writer
+{
+	int fd, stop, error;
+	size_t slot_size;
+	unsigned char *slots;
+	struct write_req req[RING_SLOTS];
+	long head, next, tail;
+	pthread_mutex_t lock;
+	pthread_cond_t ready, room;
+	pthread_t threads[WRITER_THREADS];
+	int nthreads;
+#ifdef HAVE_LIBURING
+	int uring;
+	struct io_uring ring;
+#endif
+};
+
+
+/**
+ * @brief Write the whole buffer at the given offset
+ *
+ * @param fd destination file descriptor
+ * @param buf data to be written
+ * @param len number of bytes to be written
+ * @param off offset of the first byte in the file
+ * @return 0 on success, the error of the failed write otherwise
+ */
+int pwrite_all(int fd, const unsigned char *buf, size_t len, off_t off)
+{
+	ssize_t n;
+
+	while(len>0)
+	{
+		n = pwrite(fd, buf, len, off);
+		if(n<=0)
+			return n<0 ? errno : EIO;
+		buf += n;
+		len -= n;
+		off += n;
+	}
+
+	return 0;
+}
+
+
+/**
+ * @brief Release the slots whose writes completed, in ring order
+ *
+ * Called with the lock held.
+ *
+ * @param w writer
+ */
+void writer_release(struct writer *w)
+{
+	while(w->tail<w->next && w->req[w->tail%RING_SLOTS].done)
+		w->tail++;
+	pthread_cond_broadcast(&w->room);
+}
+
+
+#ifdef HAVE_LIBURING
+/**
+ * @brief Writer thread submitting the queued rows to io_uring in batches
+ *
+ * Every queued row (and its mirror) becomes one write request, the whole
+ * batch is submitted with a single system call in queue order, and short
+ * writes are completed with pwrite.
+ *
+ * @param arg the writer
+ * @return NULL
+ */
+void *writer_uring(void *arg)
+{
+	struct writer *w = arg;
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	struct write_req *r;
+	unsigned char *buf;
+	long k, first, last;
+	int n, err, ret;
+
+	pthread_mutex_lock(&w->lock);
+	for(;;)
+	{
+		while(w->next==w->head && !w->stop)
+			pthread_cond_wait(&w->ready, &w->lock);
+		if(w->next==w->head)
+			break;
+		first = w->next;
+		last = w->head;
+		w->next = last;
+		pthread_mutex_unlock(&w->lock);
+
+		n = 0;
+		for(k=first; k<last; k++)
+		{
+			r = &w->req[k%RING_SLOTS];
+			buf = w->slots+(k%RING_SLOTS)*w->slot_size;
+			sqe = io_uring_get_sqe(&w->ring);
+			io_uring_prep_write(sqe, w->fd, buf, r->len, r->off);
+			io_uring_sqe_set_data(sqe, (void *)(k*2));
+			n++;
+			if(r->mirror>=0)
+			{
+				sqe = io_uring_get_sqe(&w->ring);
+				io_uring_prep_write(sqe, w->fd, buf, r->len, r->mirror);
+				io_uring_sqe_set_data(sqe, (void *)(k*2+1));
+				n++;
+			}
+		}
+		io_uring_submit_and_wait(&w->ring, n);
+
+		err = 0;
+		while(n-->0)
+		{
+			ret = io_uring_wait_cqe(&w->ring, &cqe);
+			if(ret<0)
+			{
+				err = -ret;
+				break;
+			}
+			k = (long)io_uring_cqe_get_data(cqe);
+			r = &w->req[(k/2)%RING_SLOTS];
+			buf = w->slots+((k/2)%RING_SLOTS)*w->slot_size;
+			if(cqe->res<0 || (size_t)cqe->res<r->len)
+			{
+				if(cqe->res<0)
+					cqe->res = 0;
+				ret = pwrite_all(w->fd, buf+cqe->res, r->len-cqe->res, (k%2 ? r->mirror : r->off)+cqe->res);
+				if(ret && !err)
+					err = ret;
+			}
+			io_uring_cqe_seen(&w->ring, cqe);
+		}
+
+		// Failed slots are released too, the main thread aborts on error
+		pthread_mutex_lock(&w->lock);
+		if(err && !w->error)
+			w->error = err;
+		for(k=first; k<last; k++)
+			w->req[k%RING_SLOTS].done = 1;
+		writer_release(w);
+	}
+	pthread_mutex_unlock(&w->lock);
+
+	return NULL;
+}
+#endif
+
+
+/**
+ * @brief Writer thread of the pwrite pool
+ *
+ * Each thread takes the oldest queued row, writes it (and its mirror) and
+ * marks its slot as done.
+ *
+ * @param arg the writer
+ * @return NULL
+ */
+void *writer_pwrite(void *arg)
+{
+	struct writer *w = arg;
+	struct write_req *r;
+	unsigned char *buf;
+	long k;
+	int err;
+
+	pthread_mutex_lock(&w->lock);
+	for(;;)
+	{
+		while(w->next==w->head && !w->stop)
+			pthread_cond_wait(&w->ready, &w->lock);
+		if(w->next==w->head)
+			break;
+		k = w->next++;
+		pthread_mutex_unlock(&w->lock);
+
+		r = &w->req[k%RING_SLOTS];
+		buf = w->slots+(k%RING_SLOTS)*w->slot_size;
+		err = pwrite_all(w->fd, buf, r->len, r->off);
+		if(!err && r->mirror>=0)
+			err = pwrite_all(w->fd, buf, r->len, r->mirror);
+
+		// Failed slots are released too, the main thread aborts on error
+		pthread_mutex_lock(&w->lock);
+		if(err && !w->error)
+			w->error = err;
+		r->done = 1;
+		writer_release(w);
+	}
+	pthread_mutex_unlock(&w->lock);
+
+	return NULL;
+}
+
+
+/**
+ * @brief Create the ring and start the writer threads
+ *
+ * @param w writer
+ * @param fd destination file descriptor
+ * @param slot_size bytes of the largest write (one row)
+ */
+void writer_start(struct writer *w, int fd, size_t slot_size)
+{
+	int i;
+
+	w->fd = fd;
+	w->stop = 0;
+	w->error = 0;
+	w->slot_size = slot_size;
+	w->head = w->next = w->tail = 0;
+	w->slots = malloc(RING_SLOTS*slot_size);
+	if(!w->slots)
+	{
+		fprintf(stderr, "Unable to allocate the write ring\n");
+		MPI_Abort(MPI_COMM_WORLD, 1);
+	}
+	pthread_mutex_init(&w->lock, NULL);
+	pthread_cond_init(&w->ready, NULL);
+	pthread_cond_init(&w->room, NULL);
+
+#ifdef HAVE_LIBURING
+	// Up to two writes (row and mirror) per slot in a batch
+	w->uring = io_uring_queue_init(2*RING_SLOTS, &w->ring, 0)==0;
+	if(w->uring)
+	{
+		w->nthreads = 1;
+		if(pthread_create(&w->threads[0], NULL, writer_uring, w))
+		{
+			fprintf(stderr, "Unable to create the writer thread\n");
+			MPI_Abort(MPI_COMM_WORLD, 1);
+		}
+		return;
+	}
+	fprintf(stderr, "io_uring is not available, writing with pwrite threads\n");
+#endif
+
+	w->nthreads = WRITER_THREADS;
+	for(i=0; i<w->nthreads; i++)
+	{
+		if(pthread_create(&w->threads[i], NULL, writer_pwrite, w))
+		{
+			fprintf(stderr, "Unable to create the writer threads\n");
+			MPI_Abort(MPI_COMM_WORLD, 1);
+		}
+	}
+}
+
+
+/**
+ * @brief Free slot where the next row must be placed
+ *
+ * Blocks only while every slot is still waiting to be written.
+ *
+ * @param w writer
+ * @return pointer to slot_size bytes
+ */
+unsigned char *writer_slot(struct writer *w)
+{
+	pthread_mutex_lock(&w->lock);
+	while(w->head-w->tail==RING_SLOTS)
+		pthread_cond_wait(&w->room, &w->lock);
+	pthread_mutex_unlock(&w->lock);
+
+	return w->slots+(w->head%RING_SLOTS)*w->slot_size;
+}
+
+
+/**
+ * @brief Queue the slot returned by writer_slot
+ *
+ * @param w writer
+ * @param len bytes to be written
+ * @param off offset in the file
+ * @param mirror second offset where the same bytes go, or -1
+ */
+void writer_push(struct writer *w, size_t len, off_t off, off_t mirror)
+{
+	struct write_req *r;
+
+	pthread_mutex_lock(&w->lock);
+	r = &w->req[w->head%RING_SLOTS];
+	r->len = len;
+	r->off = off;
+	r->mirror = mirror;
+	r->done = 0;
+	w->head++;
+	pthread_cond_signal(&w->ready);
+	pthread_mutex_unlock(&w->lock);
+}
+
+
+/**
+ * @brief Abort if a writer thread failed to write the image
+ *
+ * Called by the main thread, the only one calling MPI.
+ *
+ * @param w writer
+ */
+void writer_check(struct writer *w)
+{
+	if(w->error)
+	{
+		fprintf(stderr, "Unable to write the image: %s\n", strerror(w->error));
+		MPI_Abort(MPI_COMM_WORLD, 1);
+	}
+}
+
+
+/**
+ * @brief Write what is left, stop the threads and free the ring
+ *
+ * Aborts when any of the writes failed.
+ *
+ * @param w writer
+ */
+void writer_stop(struct writer *w)
+{
+	int i;
+
+	pthread_mutex_lock(&w->lock);
+	w->stop = 1;
+	pthread_cond_broadcast(&w->ready);
+	pthread_mutex_unlock(&w->lock);
+
+	for(i=0; i<w->nthreads; i++)
+		pthread_join(w->threads[i], NULL);
+
+#ifdef HAVE_LIBURING
+	if(w->uring)
+		io_uring_queue_exit(&w->ring);
+#endif
+	pthread_mutex_destroy(&w->lock);
+	pthread_cond_destroy(&w->ready);
+	pthread_cond_destroy(&w->room);
+	free(w->slots);
+	writer_check(w);
+}
+
 /**
  * @brief Function responsible for printing usage instructions
  *
@@ -80,7 +612,8 @@ int mandelbrot(complex z0)
  */
 void print_instructions()
 {
-	printf("usage: mpirun -np NP ./mandelbrot_mpi_io c_x_min c_x_max c_y_min c_y_max image_size\n");
+	printf("usage: mpirun -np NP ./mandelbrot_mpi_io c_x_min c_x_max c_y_min c_y_max image_size [--shm] [--async]\n");
+	printf("    [--power=d] [--julia=re,im] [--bind] [--hugepages]\n");
 	printf("examples with image_size = 11500:\n");
 	printf("    Full Picture: mpirun -np 4 ./mandelbrot_mpi_io -2.5 1.5 -2.0 2.0 11500\n");
 	printf("    Seahorse Valley: mpirun -np 8 ./mandelbrot_mpi_io -0.8 -0.7 0.05 0.15 11500\n");
@@ -89,15 +622,525 @@ void print_instructions()
 }
 
 
+/**
+ * @brief Find the axis of the conjugate symmetry of the image
+ *
+ * The set is symmetric about the real axis, so when the window straddles it
+ * and the rows fall on mirrored positions, row i and row m-i have the same
+ * pixels. Such rows are computed once and written twice.
+ *
+ * @param c_y_min lowest y boundary of the figure
+ * @param c_y_max highest y boundary of the figure
+ * @param pixel_height height of one pixel
+ * @return m the sum of the indexes of two mirrored rows, or -1 if the
+ *		   window has no usable symmetry
+ */
+int mirror_axis(double c_y_min, double c_y_max, double pixel_height)
+{
+	double m;
+	int r;
+
+	if(c_y_min>=0 || c_y_max<=0)
+		return -1;
+
+	m = 2*c_y_max/pixel_height;
+	r = (int)(m+0.5);
+	if(m-r>1e-6 || r-m>1e-6)
+		return -1;
+
+	return r;
+}
+
+
+/**
+ * @brief Count the rows that must really be computed
+ *
+ * Rows in (m/2, m] are copies of rows [0, m/2), everything else is unique.
+ *
+ * @param m axis returned by mirror_axis
+ * @param image_size the resolution of the image
+ * @return the number of unique rows
+ */
+int unique_rows(int m, int image_size)
+{
+	int last;
+
+	if(m<0)
+		return image_size;
+
+	last = m<image_size-1 ? m : image_size-1;
+	return last>m/2 ? image_size-(last-m/2) : image_size;
+}
+
+
+/**
+ * @brief Map the k-th unique row to its row in the image
+ *
+ * @param k index among the unique rows
+ * @param m axis returned by mirror_axis
+ * @return the row of the image
+ */
+int unique_row(int k, int m)
+{
+	if(m<0 || k<=m/2)
+		return k;
+	return k+m-m/2;
+}
+
+
+/**
+ * @brief Find the row that is a copy of row i
+ *
+ * @param i row of the image
+ * @param m axis returned by mirror_axis
+ * @param image_size the resolution of the image
+ * @return the mirrored row, or -1 if row i has no distinct mirror
+ */
+int mirror_row(int i, int m, int image_size)
+{
+	if(m<0 || 2*i>=m || m-i>=image_size)
+		return -1;
+	return m-i;
+}
+
+
+/**
+ * @brief Write one segment of a row at its position in the image
+ *
+ * @param img destination file
+ * @param hdr size of the header
+ * @param data colors of the segment
+ * @param image_size the resolution of the image
+ * @param i row of the image
+ * @param off offset of the segment in the row, in bytes
+ * @param len length of the segment, in bytes
+ */
+void write_row(FILE *img, int hdr, unsigned char *data, int image_size, int i,
+	size_t off, size_t len)
+{
+	fseeko(img, hdr+(off_t)3*image_size*i+(off_t)off, SEEK_SET);
+	fwrite(data, 1, len, img);
+}
+
+
+/**
+ * @brief Allocate the whole image in an MPI shared memory window
+ *
+ * Only possible when every process runs on the same node, which is
+ * detected by splitting MPI_COMM_WORLD with MPI_COMM_TYPE_SHARED. Process
+ * zero owns the memory and every process write their rows straight into it,
+ * so no row data is exchanged through MPI. A passive target epoch is kept
+ * open on the window for the whole run (see free_shared_image).
+ *
+ * @param image_size the resolution of the image
+ * @param rank rank of the calling process
+ * @param win returns the window holding the image
+ * @return image pointer to the first pixel or NULL if the processes do not
+ *		   share a node
+ */
+unsigned char *alloc_shared_image(int image_size, int rank, MPI_Win *win)
+{
+	MPI_Comm node;
+	MPI_Aint size;
+	unsigned char *base, *image;
+	int nproc, nlocal, disp;
+
+	MPI_Comm_size(MPI_COMM_WORLD, &nproc);
+	MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, rank, MPI_INFO_NULL, &node);
+	MPI_Comm_size(node, &nlocal);
+	if(nlocal!=nproc)
+	{
+		MPI_Comm_free(&node);
+		return NULL;
+	}
+
+	size = rank==0 ? (MPI_Aint)3*image_size*image_size : 0;
+	MPI_Win_allocate_shared(size, 1, MPI_INFO_NULL, node, &base, win);
+	MPI_Win_shared_query(*win, 0, &size, &disp, &image);
+	MPI_Win_lock_all(MPI_MODE_NOCHECK, *win);
+	MPI_Comm_free(&node);
+
+	return image;
+}
+
+
+/**
+ * @brief Close the epoch opened by alloc_shared_image and free the window
+ *
+ * @param win window returned by alloc_shared_image
+ */
+void free_shared_image(MPI_Win *win)
+{
+	MPI_Win_unlock_all(*win);
+	MPI_Win_free(win);
+}
+
+
+/**
+ * @brief Compute the rows of the process straight into the shared image
+ *
+ * Unique rows are distributed cyclically as in the MPI_Gather version and
+ * copied to their mirrored rows. After a single synchronization process
+ * zero writes the whole image at once.
+ *
+ * @param image shared image returned by alloc_shared_image
+ * @param m axis returned by mirror_axis
+ * @param c_x_min lowest x boundary of the figure
+ * @param c_y_max highest y boundary of the figure
+ * @param pixel_width width of one pixel
+ * @param pixel_height height of one pixel
+ * @param image_size the resolution of the resulting image
+ * @param rank rank of the calling process
+ * @param nproc number of processes
+ * @param win window holding the image
+ * @param formula formula selected on the command line
+ */
+void shared_render(unsigned char *image, int m, double c_x_min, double c_y_max,
+	double pixel_width, double pixel_height, int image_size, int rank,
+	int nproc, MPI_Win win, const struct formula *formula)
+{
+	int i, j, k, r, nunique, *row;
+	unsigned char *line;
+	complex z;
+	FILE *img;
+
+	row = malloc(image_size*sizeof(int));
+	nunique = unique_rows(m, image_size);
+
+	for(k=rank; k<nunique; k+=nproc)
+	{
+		i = unique_row(k, m);
+
+		for(j=0; j<image_size; j++)
+		{
+			z=c_x_min+j*(pixel_width)+(c_y_max-i*(pixel_height))*I;
+			row[j]=formula_point(formula, z);
+		}
+
+		line = image+(size_t)3*image_size*i;
+		for(j=0; j<image_size; j++)
+		{
+			if(row[j]<=63)
+			{
+				line[3*j]=255;
+				line[3*j+1]=255-4*row[j];
+				line[3*j+2]=255-4*row[j];
+			}
+			else
+			{
+				line[3*j]=255;
+				line[3*j+1]=row[j]-63;
+				line[3*j+2]=0;
+			}
+			if(row[j]==MAX_ITER)
+			{
+				line[3*j]=255;
+				line[3*j+1]=255;
+				line[3*j+2]=255;
+			}
+		}
+
+		r = mirror_row(i, m, image_size);
+		if(r>=0)
+			memcpy(image+(size_t)3*image_size*r, line, 3*image_size);
+	}
+
+	// Make every row visible to process zero
+	MPI_Win_sync(win);
+	MPI_Barrier(MPI_COMM_WORLD);
+	MPI_Win_sync(win);
+
+	if(rank==0)
+	{
+		img=fopen("mandelbrot_mpi_io.ppm","w");
+		fprintf(img, "P6\n%d %d 255\n", image_size, image_size);
+		fwrite(image, 1, (size_t)3*image_size*image_size, img);
+		fclose(img);
+	}
+
+	free(row);
+}
+
+
+/**
+ * @brief NUMA node of a CPU, as listed under /sys/devices/system/cpu
+ *
+ * @param cpu number of the CPU
+ * @return node number of the node, -1 if unknown
+ */
+int cpu_node(int cpu)
+{
+	char path[64];
+	int node;
+
+	for(node=0; node<MAX_NODES; node++)
+	{
+		snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/node%d", cpu, node);
+		if(access(path, F_OK)==0)
+			return node;
+	}
+
+	return -1;
+}
+
+
+/**
+ * @brief Pin the process to one of the CPUs it is allowed to run on
+ *
+ * The processes of a node (MPI_COMM_TYPE_SHARED) are spread evenly over the
+ * CPUs of their affinity mask by node rank, so with CPUs numbered socket
+ * by socket the first half of the node ranks lands on the first socket and
+ * the second half on the second one. Threads started afterwards inherit
+ * the CPU, so the mask the process was allowed to use is returned for
+ * bind_writers.
+ *
+ * @param rank rank of the calling process
+ * @param allowed returns the affinity mask before pinning
+ * @return cpu the CPU the process was pinned to, -1 on failure
+ */
+int bind_process(int rank, cpu_set_t *allowed)
+{
+	MPI_Comm node;
+	cpu_set_t mask;
+	int c, n, cpu, local, nlocal;
+
+	MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, rank, MPI_INFO_NULL, &node);
+	MPI_Comm_rank(node, &local);
+	MPI_Comm_size(node, &nlocal);
+	MPI_Comm_free(&node);
+
+	CPU_ZERO(allowed);
+	if(sched_getaffinity(0, sizeof(mask), &mask))
+		return -1;
+	*allowed = mask;
+
+	// The local rank picks the (local*count/nlocal)-th allowed CPU
+	n = (int)(((long)local*CPU_COUNT(&mask))/nlocal);
+	cpu = -1;
+	for(c=0; c<CPU_SETSIZE && cpu<0; c++)
+		if(CPU_ISSET(c, &mask) && n--==0)
+			cpu = c;
+
+	if(cpu<0)
+		return -1;
+	CPU_ZERO(&mask);
+	CPU_SET(cpu, &mask);
+	if(sched_setaffinity(0, sizeof(mask), &mask))
+		return -1;
+
+	return cpu;
+}
+
+
+/**
+ * @brief Print on process zero the CPU and NUMA node of every process
+ *
+ * @param cpu CPU returned by bind_process
+ * @param rank rank of the calling process
+ * @param nproc number of processes
+ */
+void report_binding(int cpu, int rank, int nproc)
+{
+	char host[MPI_MAX_PROCESSOR_NAME], *hosts;
+	int p, len, place[2], *places;
+
+	memset(host, 0, sizeof(host));
+	MPI_Get_processor_name(host, &len);
+	place[0] = cpu;
+	place[1] = cpu>=0 ? cpu_node(cpu) : -1;
+
+	hosts = NULL;
+	places = NULL;
+	if(rank==0)
+	{
+		hosts = malloc((size_t)nproc*MPI_MAX_PROCESSOR_NAME);
+		places = malloc(2*nproc*sizeof(int));
+	}
+	MPI_Gather(host, MPI_MAX_PROCESSOR_NAME, MPI_CHAR, hosts, MPI_MAX_PROCESSOR_NAME, MPI_CHAR, 0, MPI_COMM_WORLD);
+	MPI_Gather(place, 2, MPI_INT, places, 2, MPI_INT, 0, MPI_COMM_WORLD);
+	if(rank!=0)
+		return;
+
+	for(p=0; p<nproc; p++)
+	{
+		if(places[2*p]<0)
+			printf("Binding: rank %d on %s not pinned\n", p, hosts+(size_t)p*MPI_MAX_PROCESSOR_NAME);
+		else
+			printf("Binding: rank %d on %s cpu %d NUMA node %d\n", p,
+				hosts+(size_t)p*MPI_MAX_PROCESSOR_NAME, places[2*p], places[2*p+1]);
+	}
+
+	free(hosts);
+	free(places);
+}
+
+
+/**
+ * @brief Move the writer threads off the CPU of the pinned process
+ *
+ * The writers would otherwise inherit the single CPU of process zero and
+ * take turns with the MPI_Gather loop, so they are allowed to run on every
+ * other CPU of the mask the process had before bind_process. When there is
+ * no other CPU they share it with the process.
+ *
+ * @param w writer whose threads are moved
+ * @param allowed affinity mask returned by bind_process
+ * @param cpu CPU returned by bind_process
+ */
+void bind_writers(struct writer *w, const cpu_set_t *allowed, int cpu)
+{
+	cpu_set_t mask;
+	int i, n;
+
+	if(cpu<0)
+		return;
+	mask = *allowed;
+	CPU_CLR(cpu, &mask);
+	n = CPU_COUNT(&mask);
+	if(n==0)
+	{
+		printf("Binding: %d writer threads of rank 0 share cpu %d\n", w->nthreads, cpu);
+		return;
+	}
+
+	for(i=0; i<w->nthreads; i++)
+		if(pthread_setaffinity_np(w->threads[i], sizeof(mask), &mask))
+		{
+			printf("Binding: %d writer threads of rank 0 share cpu %d\n", w->nthreads, cpu);
+			return;
+		}
+	printf("Binding: %d writer threads of rank 0 on the %d other allowed cpus\n", w->nthreads, n);
+}
+
+
+/**
+ * @brief Ask for transparent huge pages on the huge pages inside a range
+ *
+ * @param ptr first byte of the range
+ * @param len size of the range
+ */
+void advise_huge(void *ptr, size_t len)
+{
+	uintptr_t first, last;
+
+	first = ((uintptr_t)ptr+HUGE_PAGE-1)&~(uintptr_t)(HUGE_PAGE-1);
+	last = ((uintptr_t)ptr+len)&~(uintptr_t)(HUGE_PAGE-1);
+	if(last>first)
+		madvise((void *)first, last-first, MADV_HUGEPAGE);
+}
+
+
+/**
+ * @brief Whether the mapping holding an address has transparent huge pages
+ *
+ * Reads the AnonHugePages line of the mapping in /proc/self/smaps, which is
+ * the only way to know if the kernel honoured MADV_HUGEPAGE.
+ *
+ * @param ptr address inside the mapping
+ * @return 1 if some of its memory is on transparent huge pages, 0 otherwise
+ */
+int anon_huge_pages(const void *ptr)
+{
+	FILE *smaps;
+	char line[256];
+	unsigned long start, end;
+	long kb;
+	int inside;
+
+	smaps = fopen("/proc/self/smaps", "r");
+	if(!smaps)
+		return 0;
+
+	kb = 0;
+	inside = 0;
+	while(fgets(line, sizeof(line), smaps))
+	{
+		// Every mapping starts with its range, followed by its counters
+		if(sscanf(line, "%lx-%lx ", &start, &end)==2)
+			inside = (uintptr_t)ptr>=start && (uintptr_t)ptr<end;
+		else if(inside && sscanf(line, "AnonHugePages: %ld kB", &kb)==1)
+			break;
+	}
+	fclose(smaps);
+
+	return kb>0;
+}
+
+
+/**
+ * @brief Allocate a buffer and touch it from the calling process
+ *
+ * Pages are placed on the NUMA node of the first process that writes them,
+ * so the buffer is cleared right away by its owner (once pinned by
+ * --bind). With huge and a buffer of at least one huge page, explicit huge
+ * pages (MAP_HUGETLB) are tried first, then transparent huge pages on a
+ * mapping aligned to HUGE_PAGE, then plain malloc. Transparent huge pages
+ * are only reported once the kernel shows some in /proc/self/smaps.
+ *
+ * @param size size of the buffer
+ * @param huge whether huge pages are wanted
+ * @param kind returns PAGES_EXPLICIT, PAGES_TRANSPARENT or PAGES_NORMAL
+ * @return buf the buffer, NULL if it could not be allocated
+ */
+void *alloc_buffer(size_t size, int huge, int *kind)
+{
+	unsigned char *buf, *map;
+	size_t len, head;
+
+	*kind = PAGES_NORMAL;
+	buf = MAP_FAILED;
+	len = (size+HUGE_PAGE-1)&~(size_t)(HUGE_PAGE-1);
+	if(huge && size>=HUGE_PAGE)
+	{
+		*kind = PAGES_EXPLICIT;
+		buf = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+		if(buf==MAP_FAILED)
+		{
+			// Map one huge page more and trim it so the buffer starts on one
+			*kind = PAGES_TRANSPARENT;
+			map = mmap(NULL, len+HUGE_PAGE, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+			if(map!=MAP_FAILED)
+			{
+				buf = (unsigned char *)(((uintptr_t)map+HUGE_PAGE-1)&~(uintptr_t)(HUGE_PAGE-1));
+				head = buf-map;
+				if(head>0)
+					munmap(map, head);
+				munmap(buf+len, HUGE_PAGE-head);
+				madvise(buf, len, MADV_HUGEPAGE);
+			}
+		}
+	}
+	if(buf==MAP_FAILED)
+	{
+		*kind = PAGES_NORMAL;
+		buf = malloc(size);
+		if(!buf)
+			return NULL;
+	}
+
+	memset(buf, 0, size);
+	if(*kind==PAGES_TRANSPARENT && !anon_huge_pages(buf))
+		*kind = PAGES_NORMAL;
+	return buf;
+}
+
+
 int main(int argc, char** argv)
 {
 	double c_x_min, c_x_max, c_y_min, c_y_max, pixel_width, pixel_height;
-	int i, j, image_size, i_x_max, i_y_max, rank, nproc, *row;
-	unsigned char *line, *buffer;
+	int i, j, image_size, i_x_max, i_y_max, rank, nproc, use_shm, hdr, *row;
+	int k, m, p, r, t, nunique, use_async, use_bind, hugepages, kind, provided, cpu;
+	unsigned char *line, *buffer, *image;
+	size_t row_bytes, seg, off, len;
+	struct writer w;
 	complex z;
+	struct formula formula;
 	FILE *img;
+	MPI_Win win;
+	cpu_set_t allowed;
 
-	MPI_Init(NULL, NULL);
+	// The writer threads of --async never call MPI
+	MPI_Init_thread(NULL, NULL, MPI_THREAD_FUNNELED, &provided);
 	MPI_Comm_size(MPI_COMM_WORLD, &nproc);
 	MPI_Comm_rank(MPI_COMM_WORLD, &rank);
 
@@ -122,60 +1165,187 @@ int main(int argc, char** argv)
         pixel_height      = (c_y_max - c_y_min) / i_y_max;
     }
 
-	row = malloc(image_size*sizeof(int));
-	line = malloc(3*image_size*sizeof(unsigned char));
+	use_shm = 0;
+	use_async = 0;
+	use_bind = 0;
+	hugepages = 0;
+	formula.power = 2;
+	formula.julia = 0;
+	formula.c = 0;
+	for(i=6; i<argc; i++)
+	{
+		if(strcmp(argv[i], "--shm")==0)
+			use_shm = 1;
+		else if(strcmp(argv[i], "--async")==0)
+			use_async = 1;
+		else if(strcmp(argv[i], "--bind")==0)
+			use_bind = 1;
+		else if(strcmp(argv[i], "--hugepages")==0)
+			hugepages = 1;
+		else if(parse_formula(argv[i], &formula))
+			continue;
+		else
+		{
+			if(rank==0)
+				print_instructions();
+			MPI_Finalize();
+			exit(1);
+		}
+	}
+
+	// The writer threads need at least MPI_THREAD_FUNNELED
+	if(use_async && provided<MPI_THREAD_FUNNELED)
+	{
+		use_async = 0;
+		if(rank==0)
+			fprintf(stderr, "The MPI library does not support threads, ignoring --async\n");
+	}
+
+	// Pin before any buffer is allocated, so they are touched on the node
+	cpu = -1;
+	if(use_bind)
+	{
+		cpu = bind_process(rank, &allowed);
+		report_binding(cpu, rank, nproc);
+	}
+
+	select_formula(&formula);
+	m = formula_symmetric(&formula) ? mirror_axis(c_y_min, c_y_max, pixel_height) : -1;
+	nunique = unique_rows(m, image_size);
+
+	if(use_shm)
+	{
+		image = alloc_shared_image(image_size, rank, &win);
+		if(image)
+		{
+			if(rank==0 && hugepages)
+				advise_huge(image, (size_t)3*image_size*image_size);
+			shared_render(image, m, c_x_min, c_y_max, pixel_width, pixel_height, image_size, rank, nproc, win, &formula);
+			free_shared_image(&win);
+			MPI_Finalize();
+			return 0;
+		}
+		if(rank==0)
+			fprintf(stderr, "Processes span more than one node, ignoring --shm\n");
+	}
+
+	row = alloc_buffer(image_size*sizeof(int), 0, &kind);
+	line = alloc_buffer(3*image_size*sizeof(unsigned char), 0, &kind);
 	img=fopen("mandelbrot_mpi_io.ppm","w");
 
+	// Rows are gathered in segments so that the buffer of process zero
+	// never holds more than GATHER_CHUNK bytes, whatever nproc is
+	row_bytes = (size_t)3*image_size;
+	seg = 3*(GATHER_CHUNK/(3*(size_t)nproc));
+	if(seg<3)
+		seg = 3;
+	if(seg>row_bytes)
+		seg = row_bytes;
+
 	if(rank==0)
 	{
-    	buffer=malloc(nproc*3*image_size);
+    	buffer=alloc_buffer((size_t)nproc*seg, hugepages, &kind);
     	if(!buffer)
 		{
 			fprintf(stderr, "Unable to allocate the buffer\n");
 			exit(1);
 		}
+		if(hugepages)
+			printf("Gather buffer: %zu bytes on %s pages\n", (size_t)nproc*seg,
+				kind==PAGES_EXPLICIT ? "explicit huge" : kind==PAGES_TRANSPARENT ? "transparent huge" : "normal");
 	}
 
 	MPI_Barrier(MPI_COMM_WORLD);
 
 	if(rank==0)
-		fprintf(img, "P6\n%d %d 255\n", image_size, image_size);
+	{
+		hdr = fprintf(img, "P6\n%d %d 255\n", image_size, image_size);
+		if(use_async)
+		{
+			fflush(img);
+			writer_start(&w, fileno(img), seg);
+			if(use_bind)
+				bind_writers(&w, &allowed, cpu);
+		}
+	}
 
-	for(i=rank; i<i_y_max; i+=nproc)
+	// Every round gathers one unique row per process (the processes past
+	// the last unique row send an unused line)
+	for(t=0; t<nunique; t+=nproc)
 	{
-		for(j=0; j<i_x_max; j++)
+		k = t+rank;
+		if(k<nunique)
 		{
-			z=c_x_min+j*(pixel_width)+(c_y_max-i*(pixel_height))*I;
-      		row[j]=mandelbrot(z);
-    	}
+			i = unique_row(k, m);
+			for(j=0; j<i_x_max; j++)
+			{
+				z=c_x_min+j*(pixel_width)+(c_y_max-i*(pixel_height))*I;
+				row[j]=formula_point(&formula, z);
+			}
 
-		for(j=0; j<image_size; j++)
+			for(j=0; j<image_size; j++)
+			{
+				if(row[j]<=63)
+				{
+					line[3*j]=255;
+					line[3*j+1]=255-4*row[j];
+					line[3*j+2]=255-4*row[j];
+				}
+				else
+				{
+					line[3*j]=255;
+					line[3*j+1]=row[j]-63;
+					line[3*j+2]=0;
+				}
+				if(row[j]==MAX_ITER)
+				{
+					line[3*j]=255;
+					line[3*j+1]=255;
+					line[3*j+2]=255;
+				}
+			}
+		}
+
+		for(off=0; off<row_bytes; off+=seg)
 		{
-			if(row[j]<=63)
+			len = row_bytes-off<seg ? row_bytes-off : seg;
+			MPI_Gather(line+off, len, MPI_CHAR, buffer, len, MPI_CHAR, 0, MPI_COMM_WORLD);
+			if(rank!=0)
+				continue;
+
+			// With --async the segments are copied to the write ring
+			if(use_async)
 			{
-        		line[3*j]=255;
-        		line[3*j+1]=255-4*row[j];
-				line[3*j+2]=255-4*row[j];
-      		}
+				for(p=0; p<nproc && t+p<nunique; p++)
+				{
+					i = unique_row(t+p, m);
+					r = mirror_row(i, m, image_size);
+					memcpy(writer_slot(&w), buffer+len*p, len);
+					writer_push(&w, len, hdr+(off_t)3*image_size*i+(off_t)off,
+						r>=0 ? hdr+(off_t)3*image_size*r+(off_t)off : -1);
+				}
+				continue;
+			}
+
+			// Whole rows without mirrored ones are written in order
+			if(m<0 && len==row_bytes)
+				fwrite(buffer, 1, row_bytes*(nunique-t<nproc ? nunique-t : nproc), img);
 			else
 			{
-				line[3*j]=255;
-				line[3*j+1]=row[j]-63;
-				line[3*j+2]=0;
-      		}
-			if(row[j]==MAX_ITER)
-			{
-				line[3*j]=255;
-				line[3*j+1]=255;
-				line[3*j+2]=255;
+				for(p=0; p<nproc && t+p<nunique; p++)
+				{
+					i = unique_row(t+p, m);
+					write_row(img, hdr, buffer+len*p, image_size, i, off, len);
+					r = mirror_row(i, m, image_size);
+					if(r>=0)
+						write_row(img, hdr, buffer+len*p, image_size, r, off, len);
+				}
 			}
 		}
-
-		MPI_Gather(line, 3*image_size, MPI_CHAR, buffer, 3*image_size, MPI_CHAR, 0, MPI_COMM_WORLD);
-		if(rank==0)
-			fwrite(buffer, 1, 3*nproc*image_size, img);
 	}
 
+	if(rank==0 && use_async)
+		writer_stop(&w);
 	MPI_Finalize();
 	return 0;
 }
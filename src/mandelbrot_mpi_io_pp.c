@@ -8,13 +8,29 @@
  *  by using point-to-point MPI calls and no memory buffer
  *
  *	Usage:
- *    mpirun -np NP ./mandelbrot_mpi_io_pp c_x_min c_x_max c_y_min c_y_max image_size
+ *    mpirun -np NP ./mandelbrot_mpi_io_pp c_x_min c_x_max c_y_min c_y_max image_size [options]
  *		- NP: Number of Open MPI processes
  *		- c_x_min: Lowest x boundary for the figure to be computed
  *		- c_x_max: Highest x boundary for the figure to be computed
  *		- c_y_mix: Lowest y boundary for the figure to be computed
  *		- c_y_max: Highest y boundary for the figure to be computed
  *		- image_size: The resolution of the resulting image
+ *	Options:
+ *		- --power=d: Iterate z^d+c (Multibrot set) instead of z^2+c
+ *		- --julia=re,im: Render the Julia set of the constant re+im*i (with
+ *		  the power of --power) instead of the Mandelbrot set
+ *		- --async: Process zero receives the rows into a bounded ring of
+ *		  RING_SLOTS rows that background threads write to the image (with
+ *		  io_uring when built with HAVE_LIBURING, with WRITER_THREADS pwrite
+ *		  threads otherwise), so the message loop does not wait for the disk
+ *		- --rle: Run-length encode the iteration counts sent to process zero
+ *
+ *	When the window straddles the real axis on mirrored row positions (as
+ *	the Full Picture does) only the unique rows are distributed among the
+ *	processes and process zero also writes each of them to its mirrored row.
+ *	The processes send the 16 bit iteration counts of their rows and process
+ *	zero colorizes them through a lookup table, then reports the bytes
+ *	received against the RGB rows they replace.
  *  Usage examples:
  *      Full Picture: mpirun -np 4 ./mandelbrot_mpi_io_pp -2.5 1.5 -2.0 2.0 11500
  *      Seahorse Valley: mpirun -np 4 ./mandelbrot_mpi_io_pp -0.8 -0.7 0.05 0.15 8192
@@ -37,41 +53,720 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
 #include <complex.h>
+#include <unistd.h>
+#include <pthread.h>
 #include <mpi.h>
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
 
 #define MAX_ITER 300
 #define ESCAPE_RADIUS_SQUARED 4
+#define RING_SLOTS 64
+#define WRITER_THREADS 2
 
 
 /**
- * @brief Perform the calculations for the set until divergence or MAX_ITER 
+ * @brief Generate an escape time kernel for one fixed formula
+ *
+ * Every kernel iterates z from the given point adding the constant c,
+ * which is the point itself for the Multibrot sets and a fixed constant
+ * for the Julia sets. The step is pasted into the loop, so each power is
+ * compiled on its own with no branch on the formula while iterating.
  *
- * For the complex number z0, it performs the Mandelbrot calculation until it
- * reaches divergence or it reaches the maximum number of iterations,
- * whichever happens first, returning the number of iterations until divergence
- * or MAX_ITER
+ * @param name name of the generated function
+ * @param step update of z (and temporaries) for one iteration
+ */
+#define FORMULA_KERNEL(name, step) \
+int name(complex z, complex c, int power) \
+{ \
+	int i; \
+	complex w; \
+ \
+	(void)power; \
+	(void)w; \
+	for(i=1; i<MAX_ITER; i++) \
+	{ \
+		step; \
+		if((creal(z)*creal(z))+(cimag(z)*cimag(z))>ESCAPE_RADIUS_SQUARED) \
+			break; \
+	} \
+ \
+	return i; \
+}
+
+FORMULA_KERNEL(formula_power2, z=z*z+c)
+FORMULA_KERNEL(formula_power3, z=z*z*z+c)
+FORMULA_KERNEL(formula_power4, w=z*z; z=w*w+c)
+FORMULA_KERNEL(formula_power5, w=z*z; z=w*w*z+c)
+FORMULA_KERNEL(formula_power6, w=z*z*z; z=w*w+c)
+
+
+/**
+ * @brief Escape time kernel of z^power+c for the powers without a
+ * specialized kernel
  *
- * @param z0 complex number to perform the Mandelbrot calculations
+ * @param z starting point of the orbit
+ * @param c constant added at every iteration
+ * @param power exponent of z
  * @return i integer with the number of iterations until divergerce or MAX_ITER
  */
-int mandelbrot(complex z0)
+int formula_generic(complex z, complex c, int power)
 {
-	int i;
-	complex z;
+	int i, k;
+	complex w;
 
-	z = z0;
 	for(i=1; i<MAX_ITER; i++)
 	{
-		z=z*z+z0;
+		w = z;
+		for(k=1; k<power; k++)
+			w *= z;
+		z = w+c;
 		if((creal(z)*creal(z))+(cimag(z)*cimag(z))>ESCAPE_RADIUS_SQUARED)
 			break;
-  	}
+	}
 
 	return i;
 }
 
 
+/**
+ * @brief Formula selected on the command line
+ */
+struct formula
+{
+	int (*kernel)(complex z, complex c, int power);
+	int power;
+	int julia;
+	complex c;
+};
+
+
+/**
+ * @brief Parse the --power=d and --julia=re,im options
+ *
+ * @param arg command line argument
+ * @param f formula updated with the option
+ * @return 1 if arg was a formula option, 0 otherwise
+ */
+int parse_formula(const char *arg, struct formula *f)
+{
+	double re, im;
+
+	if(strncmp(arg, "--power=", 8)==0 && sscanf(arg+8, "%d", &f->power)==1 && f->power>=2)
+		return 1;
+	if(strncmp(arg, "--julia=", 8)==0 && sscanf(arg+8, "%lf,%lf", &re, &im)==2)
+	{
+		f->julia = 1;
+		f->c = re+im*I;
+		return 1;
+	}
+	return 0;
+}
+
+
+/**
+ * @brief Pick the kernel for the power of the formula
+ *
+ * @param f formula whose kernel is set
+ */
+void select_formula(struct formula *f)
+{
+	switch(f->power)
+	{
+		case 2: f->kernel = formula_power2; break;
+		case 3: f->kernel = formula_power3; break;
+		case 4: f->kernel = formula_power4; break;
+		case 5: f->kernel = formula_power5; break;
+		case 6: f->kernel = formula_power6; break;
+		default: f->kernel = formula_generic;
+	}
+}
+
+
+/**
+ * @brief Number of iterations of one point with the selected formula
+ *
+ * @param f formula selected by select_formula
+ * @param z point of the complex plane
+ * @return i integer with the number of iterations until divergerce or MAX_ITER
+ */
+int formula_point(const struct formula *f, complex z)
+{
+	return f->kernel(z, f->julia ? f->c : z, f->power);
+}
+
+
+/**
+ * @brief Whether the image of the formula is symmetric about the real axis
+ *
+ * The Multibrot sets and the Julia sets of a real constant are their own
+ * complex conjugate, the other Julia sets are not.
+ *
+ * @param f formula selected on the command line
+ * @return 1 if the rows mirrored about the real axis are equal
+ */
+int formula_symmetric(const struct formula *f)
+{
+	return !f->julia || cimag(f->c)==0;
+}
+
+
+/**
+ * @brief Find the axis of the conjugate symmetry of the image
+ *
+ * The set is symmetric about the real axis, so when the window straddles it
+ * and the rows fall on mirrored positions, row i and row m-i have the same
+ * pixels. Such rows are computed once and written twice.
+ *
+ * @param c_y_min lowest y boundary of the figure
+ * @param c_y_max highest y boundary of the figure
+ * @param pixel_height height of one pixel
+ * @return m the sum of the indexes of two mirrored rows, or -1 if the
+ *		   window has no usable symmetry
+ */
+int mirror_axis(double c_y_min, double c_y_max, double pixel_height)
+{
+	double m;
+	int r;
+
+	if(c_y_min>=0 || c_y_max<=0)
+		return -1;
+
+	m = 2*c_y_max/pixel_height;
+	r = (int)(m+0.5);
+	if(m-r>1e-6 || r-m>1e-6)
+		return -1;
+
+	return r;
+}
+
+
+/**
+ * @brief Count the rows that must really be computed
+ *
+ * Rows in (m/2, m] are copies of rows [0, m/2), everything else is unique.
+ *
+ * @param m axis returned by mirror_axis
+ * @param image_size the resolution of the image
+ * @return the number of unique rows
+ */
+int unique_rows(int m, int image_size)
+{
+	int last;
+
+	if(m<0)
+		return image_size;
+
+	last = m<image_size-1 ? m : image_size-1;
+	return last>m/2 ? image_size-(last-m/2) : image_size;
+}
+
+
+/**
+ * @brief Map the k-th unique row to its row in the image
+ *
+ * @param k index among the unique rows
+ * @param m axis returned by mirror_axis
+ * @return the row of the image
+ */
+int unique_row(int k, int m)
+{
+	if(m<0 || k<=m/2)
+		return k;
+	return k+m-m/2;
+}
+
+
+/**
+ * @brief Find the row that is a copy of row i
+ *
+ * @param i row of the image
+ * @param m axis returned by mirror_axis
+ * @param image_size the resolution of the image
+ * @return the mirrored row, or -1 if row i has no distinct mirror
+ */
+int mirror_row(int i, int m, int image_size)
+{
+	if(m<0 || 2*i>=m || m-i>=image_size)
+		return -1;
+	return m-i;
+}
+
+
+/**
+ * @brief One pending write of the asynchronous writer
+ */
+struct write_req
+{
+	size_t len;
+	off_t off;
+	off_t mirror;
+	int done;
+};
+
+
+/**
+ * @brief Asynchronous writer of the I/O process
+ *
+ * Rows are copied (or received) into a bounded ring of RING_SLOTS slots
+ * and written by background threads, so the message loop only waits for
+ * the disk when the ring is full. Slots are released in order once their
+ * write completed. With HAVE_LIBURING a single thread submits every batch
+ * of queued rows to io_uring, otherwise WRITER_THREADS threads pwrite them.
+ * The threads never call MPI: a failed write is kept in error and reported
+ * by the main thread.
+ */
+struct writer
+{
+	int fd, stop, error;
+	size_t slot_size;
+	unsigned char *slots;
+	struct write_req req[RING_SLOTS];
+	long head, next, tail;
+	pthread_mutex_t lock;
+	pthread_cond_t ready, room;
+	pthread_t threads[WRITER_THREADS];
+	int nthreads;
+#ifdef HAVE_LIBURING
+	int uring;
+	struct io_uring ring;
+#endif
+};
+
+
+/**
+ * @brief Write the whole buffer at the given offset
+ *
+ * @param fd destination file descriptor
+ * @param buf data to be written
+ * @param len number of bytes to be written
+ * @param off offset of the first byte in the file
+ * @return 0 on success, the error of the failed write otherwise
+ */
+int pwrite_all(int fd, const unsigned char *buf, size_t len, off_t off)
+{
+	ssize_t n;
+
+	while(len>0)
+	{
+		n = pwrite(fd, buf, len, off);
+		if(n<=0)
+			return n<0 ? errno : EIO;
+		buf += n;
+		len -= n;
+		off += n;
+	}
+
+	return 0;
+}
+
+
+/**
+ * @brief Release the slots whose writes completed, in ring order
+ *
+ * Called with the lock held.
+ *
+ * @param w writer
+ */
+void writer_release(struct writer *w)
+{
+	while(w->tail<w->next && w->req[w->tail%RING_SLOTS].done)
+		w->tail++;
+	pthread_cond_broadcast(&w->room);
+}
+
+
+#ifdef HAVE_LIBURING
+/**
+ * @brief Writer thread submitting the queued rows to io_uring in batches
+ *
+ * Every queued row (and its mirror) becomes one write request, the whole
+ * batch is submitted with a single system call in queue order, and short
+ * writes are completed with pwrite.
+ *
+ * @param arg the writer
+ * @return NULL
+ */
+void *writer_uring(void *arg)
+{
+	struct writer *w = arg;
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	struct write_req *r;
+	unsigned char *buf;
+	long k, first, last;
+	int n, err, ret;
+
+	pthread_mutex_lock(&w->lock);
+	for(;;)
+	{
+		while(w->next==w->head && !w->stop)
+			pthread_cond_wait(&w->ready, &w->lock);
+		if(w->next==w->head)
+			break;
+		first = w->next;
+		last = w->head;
+		w->next = last;
+		pthread_mutex_unlock(&w->lock);
+
+		n = 0;
+		for(k=first; k<last; k++)
+		{
+			r = &w->req[k%RING_SLOTS];
+			buf = w->slots+(k%RING_SLOTS)*w->slot_size;
+			sqe = io_uring_get_sqe(&w->ring);
+			io_uring_prep_write(sqe, w->fd, buf, r->len, r->off);
+			io_uring_sqe_set_data(sqe, (void *)(k*2));
+			n++;
+			if(r->mirror>=0)
+			{
+				sqe = io_uring_get_sqe(&w->ring);
+				io_uring_prep_write(sqe, w->fd, buf, r->len, r->mirror);
+				io_uring_sqe_set_data(sqe, (void *)(k*2+1));
+				n++;
+			}
+		}
+		io_uring_submit_and_wait(&w->ring, n);
+
+		err = 0;
+		while(n-->0)
+		{
+			ret = io_uring_wait_cqe(&w->ring, &cqe);
+			if(ret<0)
+			{
+				err = -ret;
+				break;
+			}
+			k = (long)io_uring_cqe_get_data(cqe);
+			r = &w->req[(k/2)%RING_SLOTS];
+			buf = w->slots+((k/2)%RING_SLOTS)*w->slot_size;
+			if(cqe->res<0 || (size_t)cqe->res<r->len)
+			{
+				if(cqe->res<0)
+					cqe->res = 0;
+				ret = pwrite_all(w->fd, buf+cqe->res, r->len-cqe->res, (k%2 ? r->mirror : r->off)+cqe->res);
+				if(ret && !err)
+					err = ret;
+			}
+			io_uring_cqe_seen(&w->ring, cqe);
+		}
+
+		// Failed slots are released too, the main thread aborts on error
+		pthread_mutex_lock(&w->lock);
+		if(err && !w->error)
+			w->error = err;
+		for(k=first; k<last; k++)
+			w->req[k%RING_SLOTS].done = 1;
+		writer_release(w);
+	}
+	pthread_mutex_unlock(&w->lock);
+
+	return NULL;
+}
+#endif
+
+
+/**
+ * @brief Writer thread of the pwrite pool
+ *
+ * Each thread takes the oldest queued row, writes it (and its mirror) and
+ * marks its slot as done.
+ *
+ * @param arg the writer
+ * @return NULL
+ */
+void *writer_pwrite(void *arg)
+{
+	struct writer *w = arg;
+	struct write_req *r;
+	unsigned char *buf;
+	long k;
+	int err;
+
+	pthread_mutex_lock(&w->lock);
+	for(;;)
+	{
+		while(w->next==w->head && !w->stop)
+			pthread_cond_wait(&w->ready, &w->lock);
+		if(w->next==w->head)
+			break;
+		k = w->next++;
+		pthread_mutex_unlock(&w->lock);
+
+		r = &w->req[k%RING_SLOTS];
+		buf = w->slots+(k%RING_SLOTS)*w->slot_size;
+		err = pwrite_all(w->fd, buf, r->len, r->off);
+		if(!err && r->mirror>=0)
+			err = pwrite_all(w->fd, buf, r->len, r->mirror);
+
+		// Failed slots are released too, the main thread aborts on error
+		pthread_mutex_lock(&w->lock);
+		if(err && !w->error)
+			w->error = err;
+		r->done = 1;
+		writer_release(w);
+	}
+	pthread_mutex_unlock(&w->lock);
+
+	return NULL;
+}
+
+
+/**
+ * @brief Create the ring and start the writer threads
+ *
+ * @param w writer
+ * @param fd destination file descriptor
+ * @param slot_size bytes of the largest write (one row)
+ */
+void writer_start(struct writer *w, int fd, size_t slot_size)
+{
+	int i;
+
+	w->fd = fd;
+	w->stop = 0;
+	w->error = 0;
+	w->slot_size = slot_size;
+	w->head = w->next = w->tail = 0;
+	w->slots = malloc(RING_SLOTS*slot_size);
+	if(!w->slots)
+	{
+		fprintf(stderr, "Unable to allocate the write ring\n");
+		MPI_Abort(MPI_COMM_WORLD, 1);
+	}
+	pthread_mutex_init(&w->lock, NULL);
+	pthread_cond_init(&w->ready, NULL);
+	pthread_cond_init(&w->room, NULL);
+
+#ifdef HAVE_LIBURING
+	// Up to two writes (row and mirror) per slot in a batch
+	w->uring = io_uring_queue_init(2*RING_SLOTS, &w->ring, 0)==0;
+	if(w->uring)
+	{
+		w->nthreads = 1;
+		if(pthread_create(&w->threads[0], NULL, writer_uring, w))
+		{
+			fprintf(stderr, "Unable to create the writer thread\n");
+			MPI_Abort(MPI_COMM_WORLD, 1);
+		}
+		return;
+	}
+	fprintf(stderr, "io_uring is not available, writing with pwrite threads\n");
+#endif
+
+	w->nthreads = WRITER_THREADS;
+	for(i=0; i<w->nthreads; i++)
+	{
+		if(pthread_create(&w->threads[i], NULL, writer_pwrite, w))
+		{
+			fprintf(stderr, "Unable to create the writer threads\n");
+			MPI_Abort(MPI_COMM_WORLD, 1);
+		}
+	}
+}
+
+
+/**
+ * @brief Free slot where the next row must be placed
+ *
+ * Blocks only while every slot is still waiting to be written.
+ *
+ * @param w writer
+ * @return pointer to slot_size bytes
+ */
+unsigned char *writer_slot(struct writer *w)
+{
+	pthread_mutex_lock(&w->lock);
+	while(w->head-w->tail==RING_SLOTS)
+		pthread_cond_wait(&w->room, &w->lock);
+	pthread_mutex_unlock(&w->lock);
+
+	return w->slots+(w->head%RING_SLOTS)*w->slot_size;
+}
+
+
+/**
+ * @brief Queue the slot returned by writer_slot
+ *
+ * @param w writer
+ * @param len bytes to be written
+ * @param off offset in the file
+ * @param mirror second offset where the same bytes go, or -1
+ */
+void writer_push(struct writer *w, size_t len, off_t off, off_t mirror)
+{
+	struct write_req *r;
+
+	pthread_mutex_lock(&w->lock);
+	r = &w->req[w->head%RING_SLOTS];
+	r->len = len;
+	r->off = off;
+	r->mirror = mirror;
+	r->done = 0;
+	w->head++;
+	pthread_cond_signal(&w->ready);
+	pthread_mutex_unlock(&w->lock);
+}
+
+
+/**
+ * @brief Abort if a writer thread failed to write the image
+ *
+ * Called by the main thread, the only one calling MPI.
+ *
+ * @param w writer
+ */
+void writer_check(struct writer *w)
+{
+	if(w->error)
+	{
+		fprintf(stderr, "Unable to write the image: %s\n", strerror(w->error));
+		MPI_Abort(MPI_COMM_WORLD, 1);
+	}
+}
+
+
+/**
+ * @brief Write what is left, stop the threads and free the ring
+ *
+ * Aborts when any of the writes failed.
+ *
+ * @param w writer
+ */
+void writer_stop(struct writer *w)
+{
+	int i;
+
+	pthread_mutex_lock(&w->lock);
+	w->stop = 1;
+	pthread_cond_broadcast(&w->ready);
+	pthread_mutex_unlock(&w->lock);
+
+	for(i=0; i<w->nthreads; i++)
+		pthread_join(w->threads[i], NULL);
+
+#ifdef HAVE_LIBURING
+	if(w->uring)
+		io_uring_queue_exit(&w->ring);
+#endif
+	pthread_mutex_destroy(&w->lock);
+	pthread_cond_destroy(&w->ready);
+	pthread_cond_destroy(&w->room);
+	free(w->slots);
+	writer_check(w);
+}
+
+
+/**
+ * @brief Apply the fixed color scheme to one pixel
+ *
+ * @param px pointer to the 3 bytes (RGB) of the pixel
+ * @param iter number of iterations computed for the pixel
+ */
+void set_color(unsigned char *px, int iter)
+{
+	if(iter==MAX_ITER)
+	{
+		px[0]=255;
+		px[1]=255;
+		px[2]=255;
+	}
+	else if(iter<=63)
+	{
+		px[0]=255;
+		px[1]=255-4*iter;
+		px[2]=255-4*iter;
+	}
+	else
+	{
+		px[0]=255;
+		px[1]=iter-63;
+		px[2]=0;
+	}
+}
+
+
+/**
+ * @brief Fill the color lookup table used to colorize the received rows
+ *
+ * @param lut 3*(MAX_ITER+1) bytes, the RGB of every iteration count
+ */
+void build_lut(unsigned char *lut)
+{
+	int n;
+
+	for(n=0; n<=MAX_ITER; n++)
+		set_color(lut+3*n, n);
+}
+
+
+/**
+ * @brief Pack the iteration counts of a row into a result message
+ *
+ * The counts fit in 16 bits (MAX_ITER is above 255). With use_rle the runs
+ * of equal counts, long in the interior and in the outer bands, are sent
+ * as (length, count) pairs, unless the pairs would not be shorter than
+ * the counts themselves. The receiver tells the two apart by the length
+ * of the message, which is below image_size only for pairs.
+ *
+ * @param row iteration counts of the row
+ * @param image_size the resolution of the image
+ * @param use_rle whether runs are encoded
+ * @param msg image_size elements receiving the message
+ * @return number of elements of the message
+ */
+int encode_row(const int *row, int image_size, int use_rle, unsigned short *msg)
+{
+	int j, n, len;
+
+	len = 0;
+	for(j=0; use_rle && j<image_size; j+=n)
+	{
+		for(n=1; j+n<image_size && row[j+n]==row[j] && n<65535; n++);
+		if(len+2>=image_size)
+			break;
+		msg[len++] = n;
+		msg[len++] = row[j];
+	}
+	if(use_rle && j>=image_size)
+		return len;
+
+	for(j=0; j<image_size; j++)
+		msg[j] = row[j];
+	return image_size;
+}
+
+
+/**
+ * @brief Colorize a result message into a row of the image
+ *
+ * @param msg message built by encode_row
+ * @param len number of elements of the message
+ * @param image_size the resolution of the image
+ * @param lut table filled by build_lut
+ * @param line 3*image_size bytes receiving the colors of the row
+ */
+void decode_row(const unsigned short *msg, int len, int image_size, const unsigned char *lut, unsigned char *line)
+{
+	int j, k, n;
+
+	if(len==image_size)
+	{
+		for(j=0; j<image_size; j++)
+			memcpy(line+3*j, lut+3*msg[j], 3);
+		return;
+	}
+
+	for(k=0, j=0; k+1<len; k+=2)
+		for(n=0; n<msg[k]; n++, j++)
+			memcpy(line+3*j, lut+3*msg[k+1], 3);
+}
+
+
 /**
  * @brief Function responsible for printing usage instructions
  *
@@ -80,7 +775,7 @@ int mandelbrot(complex z0)
  */
 void print_instructions()
 {
-	printf("usage: mpirun -np NP ./mandelbrot_mpi_io_pp c_x_min c_x_max c_y_min c_y_max image_size\n");
+	printf("usage: mpirun -np NP ./mandelbrot_mpi_io_pp c_x_min c_x_max c_y_min c_y_max image_size [--power=d] [--julia=re,im] [--async] [--rle]\n");
 	printf("examples with image_size = 11500:\n");
 	printf("    Full Picture: mpirun -np 4 ./mandelbrot_mpi_io_pp -2.5 1.5 -2.0 2.0 11500\n");
 	printf("    Seahorse Valley: mpirun -np 8 ./mandelbrot_mpi_io_pp -0.8 -0.7 0.05 0.15 11500\n");
@@ -89,16 +784,38 @@ void print_instructions()
 }
 
 
+/**
+ * @brief Write one row at its position in the image
+ *
+ * @param img destination file
+ * @param hdr size of the header
+ * @param line colors of the row
+ * @param image_size the resolution of the image
+ * @param i row of the image
+ */
+void write_row(FILE *img, int hdr, unsigned char *line, int image_size, int i)
+{
+	fseeko(img, hdr+(off_t)3*image_size*i, SEEK_SET);
+	fwrite(line, 1, 3*image_size, img);
+}
+
+
 int main(int argc, char** argv)
 {
 	double c_x_min, c_x_max, c_y_min, c_y_max, pixel_width, pixel_height;
 	int i, j, image_size, i_x_max, i_y_max, rank, nproc, hdr, *row;
-	unsigned char *line, *buffer;
+	int k, m, r, t, nunique, use_async, use_rle, len, provided;
+	long long sent;
+	unsigned short *msg;
+	unsigned char *line, *slot, lut[3*(MAX_ITER+1)];
 	complex z;
+	struct formula formula;
+	struct writer w;
 	FILE *img;
 	MPI_Status st;
 
-	MPI_Init(NULL, NULL);
+	// The writer threads of --async never call MPI
+	MPI_Init_thread(NULL, NULL, MPI_THREAD_FUNNELED, &provided);
 	MPI_Comm_size(MPI_COMM_WORLD, &nproc);
 	MPI_Comm_rank(MPI_COMM_WORLD, &rank);
 
@@ -123,74 +840,126 @@ int main(int argc, char** argv)
         pixel_height      = (c_y_max - c_y_min) / i_y_max;
     }
 
-	row = malloc(image_size*sizeof(int));
-	line = malloc(3*image_size*sizeof(unsigned char));
-	img=fopen("mandelbrot_mpi_io_pp.ppm", "w");
-
-	if(rank==0)
+	formula.power = 2;
+	formula.julia = 0;
+	formula.c = 0;
+	use_async = 0;
+	use_rle = 0;
+	for(i=6; i<argc; i++)
 	{
-    	buffer=malloc(nproc*3*image_size);
-    	if(!buffer)
+		if(strcmp(argv[i], "--async")==0)
+			use_async = 1;
+		else if(strcmp(argv[i], "--rle")==0)
+			use_rle = 1;
+		else if(!parse_formula(argv[i], &formula))
 		{
-			fprintf(stderr, "Unable to allocate the buffer\n");
+			if(rank==0)
+				print_instructions();
+			MPI_Finalize();
 			exit(1);
 		}
 	}
 
+	// The writer threads need at least MPI_THREAD_FUNNELED
+	if(use_async && provided<MPI_THREAD_FUNNELED)
+	{
+		use_async = 0;
+		if(rank==0)
+			fprintf(stderr, "The MPI library does not support threads, ignoring --async\n");
+	}
+	select_formula(&formula);
+
+	row = malloc(image_size*sizeof(int));
+	line = malloc(3*image_size*sizeof(unsigned char));
+	msg = malloc(image_size*sizeof(unsigned short));
+	build_lut(lut);
+	sent = 0;
+	img=fopen("mandelbrot_mpi_io_pp.ppm", "w");
+
 	MPI_Barrier(MPI_COMM_WORLD);
 
 	if(rank==0)
+	{
 		hdr = fprintf(img, "P6\n%d %d 255\n", image_size, image_size);
+		if(use_async)
+		{
+			fflush(img);
+			writer_start(&w, fileno(img), 3*image_size);
+		}
+	}
 
 	MPI_Bcast(&hdr, 1, MPI_INT, 0, MPI_COMM_WORLD);
 
-	for(i=rank; i<i_y_max; i+=nproc)
+	m = formula_symmetric(&formula) ? mirror_axis(c_y_min, c_y_max, pixel_height) : -1;
+	nunique = unique_rows(m, image_size);
+
+	// Every round computes one unique row per process
+	for(t=0; t<nunique; t+=nproc)
 	{
+		k = t+rank;
+		if(k>=nunique)
+			break;
+
+		i = unique_row(k, m);
 		for(j=0; j<i_x_max; j++)
 		{
 			z=c_x_min+j*(pixel_width)+(c_y_max-i*(pixel_height))*I;
-      		row[j]=mandelbrot(z);
-    	}
-
-		for(j=0; j<image_size; j++)
-		{
-			if(row[j]<=63)
-			{
-        		line[3*j]=255;
-        		line[3*j+1]=255-4*row[j];
-				line[3*j+2]=255-4*row[j];
-      		}
-			else
-			{
-				line[3*j]=255;
-				line[3*j+1]=row[j]-63;
-				line[3*j+2]=0;
-      		}
-			if(row[j]==MAX_ITER)
-			{
-				line[3*j]=255;
-				line[3*j+1]=255;
-				line[3*j+2]=255;
-			}
+			row[j]=formula_point(&formula, z);
 		}
 
+		len = encode_row(row, image_size, use_rle, msg);
+
 		if(rank==0)
 		{
-			// Write root own calculations
-			fwrite(line, 1, 3*image_size, img);
-			// Iterate to receive from other processes
-			for(j=1; j<nproc; j++)
+			// Write root own calculations and receive from other processes
+			for(j=0; j<nproc && t+j<nunique; j++)
 			{
-				MPI_Recv(line, 3*image_size, MPI_CHAR, j, i+j, MPI_COMM_WORLD, &st);
-				fwrite(line, 1, 3*image_size, img);
-      		}
+				i = unique_row(t+j, m);
+
+				// The own row of root is already in msg
+				if(j>0)
+				{
+					MPI_Recv(msg, image_size, MPI_UNSIGNED_SHORT, j, i, MPI_COMM_WORLD, &st);
+					MPI_Get_count(&st, MPI_UNSIGNED_SHORT, &len);
+					sent += len;
+				}
+
+				// With --async the row goes to a slot of the write ring
+				if(use_async)
+				{
+					slot = writer_slot(&w);
+					decode_row(msg, len, image_size, lut, slot);
+					r = mirror_row(i, m, image_size);
+					writer_push(&w, 3*image_size, hdr+(off_t)3*image_size*i,
+						r>=0 ? hdr+(off_t)3*image_size*r : -1);
+					continue;
+				}
+
+				decode_row(msg, len, image_size, lut, line);
+
+				// Without mirrored rows the image is written in order
+				if(m<0)
+					fwrite(line, 1, 3*image_size, img);
+				else
+				{
+					write_row(img, hdr, line, image_size, i);
+					r = mirror_row(i, m, image_size);
+					if(r>=0)
+						write_row(img, hdr, line, image_size, r);
+				}
+			}
 		}
 		else
 		{
-			MPI_Send(line, 3*image_size, MPI_CHAR, 0, i, MPI_COMM_WORLD);
+			MPI_Send(msg, len, MPI_UNSIGNED_SHORT, 0, i, MPI_COMM_WORLD);
 		}
 	}
 
+	if(rank==0 && use_async)
+		writer_stop(&w);
+	if(rank==0 && sent>0)
+		printf("Received %lld bytes of iteration counts for rows of %lld bytes as RGB\n",
+			sent*(long long)sizeof(unsigned short), (long long)3*image_size*(nunique-(nunique+nproc-1)/nproc));
 	MPI_Finalize();
 	return 0;
 }
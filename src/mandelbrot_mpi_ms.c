@@ -7,97 +7,1755 @@
  *  using the Master/Slave paradigm
  *
  *	Usage:
- *    mpirun -np NP ./mandelbrot_mpi_ms c_x_min c_x_max c_y_min c_y_max image_size
+ *    mpirun -np NP ./mandelbrot_mpi_ms c_x_min c_x_max c_y_min c_y_max image_size [options]
  *		- NP: Number of Open MPI processes
  *		- c_x_min: Lowest x boundary for the figure to be computed
  *		- c_x_max: Highest x boundary for the figure to be computed
  *		- c_y_mix: Lowest y boundary for the figure to be computed
  *		- c_y_max: Highest y boundary for the figure to be computed
  *		- image_size: The resolution of the resulting image
+ *	Options:
+ *		- --progressive: Render coarse-to-fine (1/8, 1/4, 1/2 and full
+ *		  resolution). Slaves only compute the samples of a row that were not
+ *		  computed by coarser levels and send back their iteration counts.
+ *		  The master writes mandelbrot_mpi_ms_preview_N.ppm (1/N of the
+ *		  resolution) as soon as each level is complete. Cannot be combined
+ *		  with --aa, --checkpoint, --resume, --timeout, --async or --rle
+ *		- --shm: When every process runs on the same node, keep the image in
+ *		  an MPI shared memory window where the slaves write their rows, so
+ *		  only row numbers are sent to the master, which streams the window
+ *		  out at the end. Ignored with --progressive or --aa
+ *		- --aa=N: Adaptive anti-aliasing. Slaves receive blocks of
+ *		  AA_TILE_ROWS rows, render them at 1x and refine with NxN samples
+ *		  only the pixels whose neighbors are in a different iteration band.
+ *		  The master reports the fraction of refined pixels. Cannot be
+ *		  combined with --checkpoint, --resume, --timeout, --async or --rle
+ *		- --power=d: Iterate z^d+c (Multibrot set) instead of z^2+c
+ *		- --julia=re,im: Render the Julia set of the constant re+im*i (with
+ *		  the power of --power) instead of the Mandelbrot set
+ *		- --checkpoint: Keep the mandelbrot_mpi_ms.done bitmap of the
+ *		  finished rows next to the image and hand the rows of slaves that
+ *		  stop answering to other slaves (plain render without --shm)
+ *		- --resume: Continue a --checkpoint render that was interrupted,
+ *		  computing only the rows missing from its bitmap (implies
+ *		  --checkpoint). The window, --power and --julia must be the ones of
+ *		  the interrupted render
+ *		- --timeout=S: With --checkpoint, seconds a slave may take for one
+ *		  row before the row is handed to another slave (default
+ *		  SLAVE_TIMEOUT). A slave that still has not answered after twice
+ *		  that time no longer counts as working
+ *		- --async: The master copies the rows it receives into a bounded
+ *		  ring of RING_SLOTS rows that background threads write to the image
+ *		  (with io_uring when built with HAVE_LIBURING, with WRITER_THREADS
+ *		  pwrite threads otherwise), so handing out the next row never waits
+ *		  for the disk. Used by the plain render without --shm
+ *		- --rle: Slaves run-length encode the iteration counts of their rows
+ *		  (plain render without --shm)
+ *
+ *	With --checkpoint the plain render saves the bitmap of finished rows
+ *	every CHECKPOINT_ROWS rows and removes it when the image is complete.
+ *	Each slave has a single outstanding row polled by the master, so a
+ *	slave that fails or stops answering only costs its current row.
+ *	Slaves send the 16 bit iteration counts of their rows, the master
+ *	colorizes them through a lookup table and reports the bytes received
+ *	against the RGB rows they replace.
+ *	When the window straddles the real axis on mirrored row positions (as
+ *	the Full Picture does) only the unique rows are handed out to the slaves
+ *	and each of them is also written to its mirrored row (except with
+ *	--progressive or --aa).
  *  Usage examples:
  *      Full Picture: mpirun -np 4 ./mandelbrot_mpi_ms -2.5 1.5 -2.0 2.0 11500
  *      Seahorse Valley: mpirun -np 4 ./mandelbrot_mpi_ms -0.8 -0.7 0.05 0.15 8192
  *      Elephant Valley: mpirun -np 8 ./mandelbrot_mpi_ms 0.175 0.375 -0.1 0.1 800
  *      TS Valley: mpirun -np 2 ./mandelbrot_mpi_ms -0.188 -0.012 0.554 0.754 400
  *
- *	Notes:
- *      Although we made modifications, this code is heavily based on the
- *		class examples provided by MJ Rutter.
- *		Because of that, in any event of license and copyright conflict, the
- *		license/copyright provided by Mr. Rutter TAKE PRECEDENCE OVER the
- *		GPLv3 on which this code was released.
+ *	Notes:
+ *      Although we made modifications, this code is heavily based on the
+ *		class examples provided by MJ Rutter.
+ *		Because of that, in any event of license and copyright conflict, the
+ *		license/copyright provided by Mr. Rutter TAKE PRECEDENCE OVER the
+ *		GPLv3 on which this code was released.
+ *
+ *	@author		Decio Lauro Soares (deciolauro@gmail.com)
+ *	@date		05 Jul 2017
+ *	@bug		No known bugs
+ *	@warning	Based on class given by MJ Rutter(May contain Copyright issues)
+ * 	@copyright	GNU Public License v3
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <complex.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <mpi.h>
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+#define MAX_ITER 300
+#define ESCAPE_RADIUS_SQUARED 4
+#define RING_SLOTS 64
+#define WRITER_THREADS 2
+#define PROGRESSIVE_STEP 8
+#define PROGRESSIVE_LEVELS 4
+#define AA_TILE_ROWS 32
+#define AA_BAND 8
+#define IMAGE_NAME "mandelbrot_mpi_ms.ppm"
+#define CHECKPOINT_NAME "mandelbrot_mpi_ms.done"
+#define CHECKPOINT_ROWS 64
+#define SLAVE_TIMEOUT 600
+#define SLAVE_IDLE 0
+#define SLAVE_BUSY 1
+#define SLAVE_LATE 2
+#define SLAVE_DEAD 3
+#define SLAVE_SILENT 4
+#define POLL_NSEC 100000
+
+/**
+ * @brief Generate an escape time kernel for one fixed formula
+ *
+ * Every kernel iterates z from the given point adding the constant c,
+ * which is the point itself for the Multibrot sets and a fixed constant
+ * for the Julia sets. The step is pasted into the loop, so each power is
+ * compiled on its own with no branch on the formula while iterating.
+ *
+ * @param name name of the generated function
+ * @param step update of z (and temporaries) for one iteration
+ */
+#define FORMULA_KERNEL(name, step) \
+int name(complex z, complex c, int power) \
+{ \
+	int i; \
+	complex w; \
+ \
+	(void)power; \
+	(void)w; \
+	for(i=1; i<MAX_ITER; i++) \
+	{ \
+		step; \
+		if((creal(z)*creal(z))+(cimag(z)*cimag(z))>ESCAPE_RADIUS_SQUARED) \
+			break; \
+	} \
+ \
+	return i; \
+}
+
+FORMULA_KERNEL(formula_power2, z=z*z+c)
+FORMULA_KERNEL(formula_power3, z=z*z*z+c)
+FORMULA_KERNEL(formula_power4, w=z*z; z=w*w+c)
+FORMULA_KERNEL(formula_power5, w=z*z; z=w*w*z+c)
+FORMULA_KERNEL(formula_power6, w=z*z*z; z=w*w+c)
+
+
+/**
+ * @brief Escape time kernel of z^power+c for the powers without a
+ * specialized kernel
+ *
+ * @param z starting point of the orbit
+ * @param c constant added at every iteration
+ * @param power exponent of z
+ * @return i integer with the number of iterations until divergerce or MAX_ITER
+ */
+int formula_generic(complex z, complex c, int power)
+{
+	int i, k;
+	complex w;
+
+	for(i=1; i<MAX_ITER; i++)
+	{
+		w = z;
+		for(k=1; k<power; k++)
+			w *= z;
+		z = w+c;
+		if((creal(z)*creal(z))+(cimag(z)*cimag(z))>ESCAPE_RADIUS_SQUARED)
+			break;
+	}
+
+	return i;
+}
+
+
+/**
+ * @brief Formula selected on the command line
+ */
+struct formula
+{
+	int (*kernel)(complex z, complex c, int power);
+	int power;
+	int julia;
+	complex c;
+};
+
+
+/**
+ * @brief Parse the --power=d and --julia=re,im options
+ *
+ * @param arg command line argument
+ * @param f formula updated with the option
+ * @return 1 if arg was a formula option, 0 otherwise
+ */
+int parse_formula(const char *arg, struct formula *f)
+{
+	double re, im;
+
+	if(strncmp(arg, "--power=", 8)==0 && sscanf(arg+8, "%d", &f->power)==1 && f->power>=2)
+		return 1;
+	if(strncmp(arg, "--julia=", 8)==0 && sscanf(arg+8, "%lf,%lf", &re, &im)==2)
+	{
+		f->julia = 1;
+		f->c = re+im*I;
+		return 1;
+	}
+	return 0;
+}
+
+
+/**
+ * @brief Pick the kernel for the power of the formula
+ *
+ * @param f formula whose kernel is set
+ */
+void select_formula(struct formula *f)
+{
+	switch(f->power)
+	{
+		case 2: f->kernel = formula_power2; break;
+		case 3: f->kernel = formula_power3; break;
+		case 4: f->kernel = formula_power4; break;
+		case 5: f->kernel = formula_power5; break;
+		case 6: f->kernel = formula_power6; break;
+		default: f->kernel = formula_generic;
+	}
+}
+
+
+/**
+ * @brief Number of iterations of one point with the selected formula
+ *
+ * @param f formula selected by select_formula
+ * @param z point of the complex plane
+ * @return i integer with the number of iterations until divergerce or MAX_ITER
+ */
+int formula_point(const struct formula *f, complex z)
+{
+	return f->kernel(z, f->julia ? f->c : z, f->power);
+}
+
+
+/**
+ * @brief Whether the image of the formula is symmetric about the real axis
+ *
+ * The Multibrot sets and the Julia sets of a real constant are their own
+ * complex conjugate, the other Julia sets are not.
+ *
+ * @param f formula selected on the command line
+ * @return 1 if the rows mirrored about the real axis are equal
+ */
+int formula_symmetric(const struct formula *f)
+{
+	return !f->julia || cimag(f->c)==0;
+}
+
+
+/**
+ * @brief One pending write of the asynchronous writer
+ */
+struct write_req
+{
+	size_t len;
+	off_t off;
+	off_t mirror;
+	int done;
+};
+
+
+/**
+ * @brief Asynchronous writer of the I/O process
+ *
+ * Rows are copied (or received) into a bounded ring of RING_SLOTS slots
+ * and written by background threads, so the message loop only waits for
+ * the disk when the ring is full. Slots are released in order once their
+ * write completed. With HAVE_LIBURING a single thread submits every batch
+ * of queued rows to io_uring, otherwise WRITER_THREADS threads pwrite them.
+ * The threads never call MPI: a failed write is kept in error and reported
+ * by the main thread.
+ */
+struct writer
+{
+	int fd, stop, error;
+	size_t slot_size;
+	unsigned char *slots;
+	struct write_req req[RING_SLOTS];
+	long head, next, tail;
+	pthread_mutex_t lock;
+	pthread_cond_t ready, room;
+	pthread_t threads[WRITER_THREADS];
+	int nthreads;
+#ifdef HAVE_LIBURING
+	int uring;
+	struct io_uring ring;
+#endif
+};
+
+
+/**
+ * @brief Write the whole buffer at the given offset
+ *
+ * @param fd destination file descriptor
+ * @param buf data to be written
+ * @param len number of bytes to be written
+ * @param off offset of the first byte in the file
+ * @return 0 on success, the error of the failed write otherwise
+ */
+int pwrite_all(int fd, const unsigned char *buf, size_t len, off_t off)
+{
+	ssize_t n;
+
+	while(len>0)
+	{
+		n = pwrite(fd, buf, len, off);
+		if(n<=0)
+			return n<0 ? errno : EIO;
+		buf += n;
+		len -= n;
+		off += n;
+	}
+
+	return 0;
+}
+
+
+/**
+ * @brief Release the slots whose writes completed, in ring order
+ *
+ * Called with the lock held.
+ *
+ * @param w writer
+ */
+void writer_release(struct writer *w)
+{
+	while(w->tail<w->next && w->req[w->tail%RING_SLOTS].done)
+		w->tail++;
+	pthread_cond_broadcast(&w->room);
+}
+
+
+#ifdef HAVE_LIBURING
+/**
+ * @brief Writer thread submitting the queued rows to io_uring in batches
+ *
+ * Every queued row (and its mirror) becomes one write request, the whole
+ * batch is submitted with a single system call in queue order, and short
+ * writes are completed with pwrite.
+ *
+ * @param arg the writer
+ * @return NULL
+ */
+void *writer_uring(void *arg)
+{
+	struct writer *w = arg;
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	struct write_req *r;
+	unsigned char *buf;
+	long k, first, last;
+	int n, err, ret;
+
+	pthread_mutex_lock(&w->lock);
+	for(;;)
+	{
+		while(w->next==w->head && !w->stop)
+			pthread_cond_wait(&w->ready, &w->lock);
+		if(w->next==w->head)
+			break;
+		first = w->next;
+		last = w->head;
+		w->next = last;
+		pthread_mutex_unlock(&w->lock);
+
+		n = 0;
+		for(k=first; k<last; k++)
+		{
+			r = &w->req[k%RING_SLOTS];
+			buf = w->slots+(k%RING_SLOTS)*w->slot_size;
+			sqe = io_uring_get_sqe(&w->ring);
+			io_uring_prep_write(sqe, w->fd, buf, r->len, r->off);
+			io_uring_sqe_set_data(sqe, (void *)(k*2));
+			n++;
+			if(r->mirror>=0)
+			{
+				sqe = io_uring_get_sqe(&w->ring);
+				io_uring_prep_write(sqe, w->fd, buf, r->len, r->mirror);
+				io_uring_sqe_set_data(sqe, (void *)(k*2+1));
+				n++;
+			}
+		}
+		io_uring_submit_and_wait(&w->ring, n);
+
+		err = 0;
+		while(n-->0)
+		{
+			ret = io_uring_wait_cqe(&w->ring, &cqe);
+			if(ret<0)
+			{
+				err = -ret;
+				break;
+			}
+			k = (long)io_uring_cqe_get_data(cqe);
+			r = &w->req[(k/2)%RING_SLOTS];
+			buf = w->slots+((k/2)%RING_SLOTS)*w->slot_size;
+			if(cqe->res<0 || (size_t)cqe->res<r->len)
+			{
+				if(cqe->res<0)
+					cqe->res = 0;
+				ret = pwrite_all(w->fd, buf+cqe->res, r->len-cqe->res, (k%2 ? r->mirror : r->off)+cqe->res);
+				if(ret && !err)
+					err = ret;
+			}
+			io_uring_cqe_seen(&w->ring, cqe);
+		}
+
+		// Failed slots are released too, the main thread aborts on error
+		pthread_mutex_lock(&w->lock);
+		if(err && !w->error)
+			w->error = err;
+		for(k=first; k<last; k++)
+			w->req[k%RING_SLOTS].done = 1;
+		writer_release(w);
+	}
+	pthread_mutex_unlock(&w->lock);
+
+	return NULL;
+}
+#endif
+
+
+/**
+ * @brief Writer thread of the pwrite pool
+ *
+ * Each thread takes the oldest queued row, writes it (and its mirror) and
+ * marks its slot as done.
+ *
+ * @param arg the writer
+ * @return NULL
+ */
+void *writer_pwrite(void *arg)
+{
+	struct writer *w = arg;
+	struct write_req *r;
+	unsigned char *buf;
+	long k;
+	int err;
+
+	pthread_mutex_lock(&w->lock);
+	for(;;)
+	{
+		while(w->next==w->head && !w->stop)
+			pthread_cond_wait(&w->ready, &w->lock);
+		if(w->next==w->head)
+			break;
+		k = w->next++;
+		pthread_mutex_unlock(&w->lock);
+
+		r = &w->req[k%RING_SLOTS];
+		buf = w->slots+(k%RING_SLOTS)*w->slot_size;
+		err = pwrite_all(w->fd, buf, r->len, r->off);
+		if(!err && r->mirror>=0)
+			err = pwrite_all(w->fd, buf, r->len, r->mirror);
+
+		// Failed slots are released too, the main thread aborts on error
+		pthread_mutex_lock(&w->lock);
+		if(err && !w->error)
+			w->error = err;
+		r->done = 1;
+		writer_release(w);
+	}
+	pthread_mutex_unlock(&w->lock);
+
+	return NULL;
+}
+
+
+/**
+ * @brief Create the ring and start the writer threads
+ *
+ * @param w writer
+ * @param fd destination file descriptor
+ * @param slot_size bytes of the largest write (one row)
+ */
+void writer_start(struct writer *w, int fd, size_t slot_size)
+{
+	int i;
+
+	w->fd = fd;
+	w->stop = 0;
+	w->error = 0;
+	w->slot_size = slot_size;
+	w->head = w->next = w->tail = 0;
+	w->slots = malloc(RING_SLOTS*slot_size);
+	if(!w->slots)
+	{
+		fprintf(stderr, "Unable to allocate the write ring\n");
+		MPI_Abort(MPI_COMM_WORLD, 1);
+	}
+	pthread_mutex_init(&w->lock, NULL);
+	pthread_cond_init(&w->ready, NULL);
+	pthread_cond_init(&w->room, NULL);
+
+#ifdef HAVE_LIBURING
+	// Up to two writes (row and mirror) per slot in a batch
+	w->uring = io_uring_queue_init(2*RING_SLOTS, &w->ring, 0)==0;
+	if(w->uring)
+	{
+		w->nthreads = 1;
+		if(pthread_create(&w->threads[0], NULL, writer_uring, w))
+		{
+			fprintf(stderr, "Unable to create the writer thread\n");
+			MPI_Abort(MPI_COMM_WORLD, 1);
+		}
+		return;
+	}
+	fprintf(stderr, "io_uring is not available, writing with pwrite threads\n");
+#endif
+
+	w->nthreads = WRITER_THREADS;
+	for(i=0; i<w->nthreads; i++)
+	{
+		if(pthread_create(&w->threads[i], NULL, writer_pwrite, w))
+		{
+			fprintf(stderr, "Unable to create the writer threads\n");
+			MPI_Abort(MPI_COMM_WORLD, 1);
+		}
+	}
+}
+
+
+/**
+ * @brief Free slot where the next row must be placed
+ *
+ * Blocks only while every slot is still waiting to be written.
+ *
+ * @param w writer
+ * @return pointer to slot_size bytes
+ */
+unsigned char *writer_slot(struct writer *w)
+{
+	pthread_mutex_lock(&w->lock);
+	while(w->head-w->tail==RING_SLOTS)
+		pthread_cond_wait(&w->room, &w->lock);
+	pthread_mutex_unlock(&w->lock);
+
+	return w->slots+(w->head%RING_SLOTS)*w->slot_size;
+}
+
+
+/**
+ * @brief Queue the slot returned by writer_slot
+ *
+ * @param w writer
+ * @param len bytes to be written
+ * @param off offset in the file
+ * @param mirror second offset where the same bytes go, or -1
+ */
+void writer_push(struct writer *w, size_t len, off_t off, off_t mirror)
+{
+	struct write_req *r;
+
+	pthread_mutex_lock(&w->lock);
+	r = &w->req[w->head%RING_SLOTS];
+	r->len = len;
+	r->off = off;
+	r->mirror = mirror;
+	r->done = 0;
+	w->head++;
+	pthread_cond_signal(&w->ready);
+	pthread_mutex_unlock(&w->lock);
+}
+
+
+/**
+ * @brief Abort if a writer thread failed to write the image
+ *
+ * Called by the main thread, the only one calling MPI.
+ *
+ * @param w writer
+ */
+void writer_check(struct writer *w)
+{
+	if(w->error)
+	{
+		fprintf(stderr, "Unable to write the image: %s\n", strerror(w->error));
+		MPI_Abort(MPI_COMM_WORLD, 1);
+	}
+}
+
+
+/**
+ * @brief Wait until every queued row was written
+ *
+ * @param w writer
+ */
+void writer_flush(struct writer *w)
+{
+	pthread_mutex_lock(&w->lock);
+	while(w->tail!=w->head)
+		pthread_cond_wait(&w->room, &w->lock);
+	pthread_mutex_unlock(&w->lock);
+	writer_check(w);
+}
+
+
+/**
+ * @brief Write what is left, stop the threads and free the ring
+ *
+ * Aborts when any of the writes failed.
+ *
+ * @param w writer
+ */
+void writer_stop(struct writer *w)
+{
+	int i;
+
+	pthread_mutex_lock(&w->lock);
+	w->stop = 1;
+	pthread_cond_broadcast(&w->ready);
+	pthread_mutex_unlock(&w->lock);
+
+	for(i=0; i<w->nthreads; i++)
+		pthread_join(w->threads[i], NULL);
+
+#ifdef HAVE_LIBURING
+	if(w->uring)
+		io_uring_queue_exit(&w->ring);
+#endif
+	pthread_mutex_destroy(&w->lock);
+	pthread_cond_destroy(&w->ready);
+	pthread_cond_destroy(&w->room);
+	free(w->slots);
+	writer_check(w);
+}
+
+/**
+ * @brief Function responsible for printing usage instructions
+ *
+ * This function is responsible for printing the usage instructions
+ *
+ */
+void print_instructions()
+{
+	printf("usage: mpirun -np NP ./mandelbrot_mpi_ms c_x_min c_x_max c_y_min c_y_max image_size [--progressive] [--shm] [--aa=N]\n");
+	printf("    [--checkpoint] [--resume] [--timeout=S] [--async] [--rle]\n");
+	printf("    [--power=d] [--julia=re,im]\n");
+	printf("examples with image_size = 11500:\n");
+	printf("    Full Picture: mpirun -np 4 ./mandelbrot_mpi_ms -2.5 1.5 -2.0 2.0 11500\n");
+	printf("    Seahorse Valley: mpirun -np 8 ./mandelbrot_mpi_ms -0.8 -0.7 0.05 0.15 11500\n");
+	printf("    Elephant Valley:  mpirun -np 2 ./mandelbrot_mpi_ms 0.175 0.375 -0.1 0.1 11500\n");
+	printf("    Triple Spiral Valley: mpirun -np 8 ./mandelbrot_mpi_ms -0.188 -0.012 0.554 0.754 11500\n");
+}
+
+
+/**
+ * @brief Find the axis of the conjugate symmetry of the image
+ *
+ * The set is symmetric about the real axis, so when the window straddles it
+ * and the rows fall on mirrored positions, row i and row m-i have the same
+ * pixels. Such rows are computed once and written twice.
+ *
+ * @param c_y_min lowest y boundary of the figure
+ * @param c_y_max highest y boundary of the figure
+ * @param pixel_height height of one pixel
+ * @return m the sum of the indexes of two mirrored rows, or -1 if the
+ *		   window has no usable symmetry
+ */
+int mirror_axis(double c_y_min, double c_y_max, double pixel_height)
+{
+	double m;
+	int r;
+
+	if(c_y_min>=0 || c_y_max<=0)
+		return -1;
+
+	m = 2*c_y_max/pixel_height;
+	r = (int)(m+0.5);
+	if(m-r>1e-6 || r-m>1e-6)
+		return -1;
+
+	return r;
+}
+
+
+/**
+ * @brief Count the rows that must really be computed
+ *
+ * Rows in (m/2, m] are copies of rows [0, m/2), everything else is unique.
+ *
+ * @param m axis returned by mirror_axis
+ * @param image_size the resolution of the image
+ * @return the number of unique rows
+ */
+int unique_rows(int m, int image_size)
+{
+	int last;
+
+	if(m<0)
+		return image_size;
+
+	last = m<image_size-1 ? m : image_size-1;
+	return last>m/2 ? image_size-(last-m/2) : image_size;
+}
+
+
+/**
+ * @brief Map the k-th unique row to its row in the image
+ *
+ * @param k index among the unique rows
+ * @param m axis returned by mirror_axis
+ * @return the row of the image
+ */
+int unique_row(int k, int m)
+{
+	if(m<0 || k<=m/2)
+		return k;
+	return k+m-m/2;
+}
+
+
+/**
+ * @brief Find the row that is a copy of row i
+ *
+ * @param i row of the image
+ * @param m axis returned by mirror_axis
+ * @param image_size the resolution of the image
+ * @return the mirrored row, or -1 if row i has no distinct mirror
+ */
+int mirror_row(int i, int m, int image_size)
+{
+	if(m<0 || 2*i>=m || m-i>=image_size)
+		return -1;
+	return m-i;
+}
+
+
+/**
+ * @brief Apply the fixed color scheme to one pixel
+ *
+ * @param px pointer to the 3 bytes (RGB) of the pixel
+ * @param iter number of iterations computed for the pixel
+ */
+void set_color(unsigned char *px, int iter)
+{
+	if(iter==MAX_ITER)
+	{
+		px[0]=255;
+		px[1]=255;
+		px[2]=255;
+	}
+	else if(iter<=63)
+	{
+		px[0]=255;
+		px[1]=255-4*iter;
+		px[2]=255-4*iter;
+	}
+	else
+	{
+		px[0]=255;
+		px[1]=iter-63;
+		px[2]=0;
+	}
+}
+
+
+/**
+ * @brief Fill the color lookup table used to colorize the received rows
+ *
+ * @param lut 3*(MAX_ITER+1) bytes, the RGB of every iteration count
+ */
+void build_lut(unsigned char *lut)
+{
+	int n;
+
+	for(n=0; n<=MAX_ITER; n++)
+		set_color(lut+3*n, n);
+}
+
+
+/**
+ * @brief Pack the iteration counts of a row into a result message
+ *
+ * The counts fit in 16 bits (MAX_ITER is above 255). With use_rle the runs
+ * of equal counts, long in the interior and in the outer bands, are sent
+ * as (length, count) pairs, unless the pairs would not be shorter than
+ * the counts themselves. The receiver tells the two apart by the length
+ * of the message, which is below image_size only for pairs.
+ *
+ * @param row iteration counts of the row
+ * @param image_size the resolution of the image
+ * @param use_rle whether runs are encoded
+ * @param msg image_size elements receiving the message
+ * @return number of elements of the message
+ */
+int encode_row(const int *row, int image_size, int use_rle, unsigned short *msg)
+{
+	int j, n, len;
+
+	len = 0;
+	for(j=0; use_rle && j<image_size; j+=n)
+	{
+		for(n=1; j+n<image_size && row[j+n]==row[j] && n<65535; n++);
+		if(len+2>=image_size)
+			break;
+		msg[len++] = n;
+		msg[len++] = row[j];
+	}
+	if(use_rle && j>=image_size)
+		return len;
+
+	for(j=0; j<image_size; j++)
+		msg[j] = row[j];
+	return image_size;
+}
+
+
+/**
+ * @brief Colorize a result message into a row of the image
+ *
+ * @param msg message built by encode_row
+ * @param len number of elements of the message
+ * @param image_size the resolution of the image
+ * @param lut table filled by build_lut
+ * @param line 3*image_size bytes receiving the colors of the row
+ */
+void decode_row(const unsigned short *msg, int len, int image_size, const unsigned char *lut, unsigned char *line)
+{
+	int j, k, n;
+
+	if(len==image_size)
+	{
+		for(j=0; j<image_size; j++)
+			memcpy(line+3*j, lut+3*msg[j], 3);
+		return;
+	}
+
+	for(k=0, j=0; k+1<len; k+=2)
+		for(n=0; n<msg[k]; n++, j++)
+			memcpy(line+3*j, lut+3*msg[k+1], 3);
+}
+
+
+/**
+ * @brief Tell whether a sample is computed for the first time by a level
+ *
+ * @param i row of the sample
+ * @param j column of the sample
+ * @param step distance between the samples of the level
+ * @return 1 if the sample is new in the level, 0 otherwise
+ */
+int is_new_sample(int i, int j, int step)
+{
+	if(i%step || j%step)
+		return 0;
+	return step==PROGRESSIVE_STEP || i%(2*step) || j%(2*step);
+}
+
+
+/**
+ * @brief Write the samples of one progressive level as a PPM image
+ *
+ * Only the samples whose row and column are multiples of step are used,
+ * resulting in an image with 1/step of the full resolution.
+ *
+ * @param img destination file
+ * @param iters iteration counts of the full resolution image
+ * @param image_size the full resolution of the image
+ * @param step distance between the samples of the level
+ */
+void write_level(FILE *img, unsigned short *iters, int image_size, int step)
+{
+	int i, j, side;
+	unsigned char *line;
+
+	side = (image_size+step-1)/step;
+	line = malloc(3*side*sizeof(unsigned char));
+
+	fprintf(img, "P6\n%d %d 255\n", side, side);
+	for(i=0; i<image_size; i+=step)
+	{
+		for(j=0; j<image_size; j+=step)
+			set_color(&line[3*(j/step)], iters[(size_t)i*image_size+j]);
+		fwrite(line, 1, 3*side, img);
+	}
+
+	free(line);
+}
+
+
+/**
+ * @brief Master side of the progressive render
+ *
+ * Work units are (row, step) pairs handed out level by level. The master
+ * scatters the received samples into the full resolution buffer and writes
+ * the preview of a level once it and every coarser level are complete.
+ *
+ * @param image_size the resolution of the resulting image
+ * @param nslaves number of slave processes
+ * @param img destination of the full resolution image
+ */
+void progressive_master(int image_size, int nslaves, FILE *img)
+{
+	int i, j, k, n, s, level, step, pending, preview_level, next_level, next_row;
+	int *assigned, msg[2], done[PROGRESSIVE_LEVELS], rows[PROGRESSIVE_LEVELS];
+	unsigned short *iters, *samples;
+	char name[64];
+	FILE *preview;
+	MPI_Status st;
+
+	iters = malloc((size_t)image_size*image_size*sizeof(unsigned short));
+	samples = malloc(image_size*sizeof(unsigned short));
+	assigned = malloc((nslaves+1)*sizeof(int[2]));
+	if(!iters || !samples || !assigned)
+	{
+		fprintf(stderr, "Unable to allocate the progressive buffer\n");
+		MPI_Abort(MPI_COMM_WORLD, 1);
+	}
+
+	for(level=0; level<PROGRESSIVE_LEVELS; level++)
+	{
+		done[level] = 0;
+		rows[level] = (image_size-1)/(PROGRESSIVE_STEP>>level)+1;
+	}
+
+	next_level = 0;
+	next_row = 0;
+	pending = 0;
+	preview_level = 0;
+
+	for(s=1; s<=nslaves || pending>0; )
+	{
+		if(s<=nslaves)
+		{
+			// Initial distribution
+			k = s++;
+		}
+		else
+		{
+			MPI_Recv(samples, image_size, MPI_UNSIGNED_SHORT, MPI_ANY_SOURCE, MPI_ANY_TAG, MPI_COMM_WORLD, &st);
+			pending--;
+			k = st.MPI_SOURCE;
+			i = assigned[2*k];
+			level = assigned[2*k+1];
+			step = PROGRESSIVE_STEP>>level;
+
+			for(j=0, n=0; j<image_size; j++)
+				if(is_new_sample(i, j, step))
+					iters[(size_t)i*image_size+j] = samples[n++];
+
+			// Previews are written in order, once all coarser levels are done
+			done[level]++;
+			while(preview_level<PROGRESSIVE_LEVELS-1 && done[preview_level]==rows[preview_level])
+			{
+				step = PROGRESSIVE_STEP>>preview_level;
+				snprintf(name, sizeof(name), "mandelbrot_mpi_ms_preview_%d.ppm", step);
+				preview=fopen(name, "w");
+				if(!preview)
+				{
+					perror("Unable to create the preview");
+					MPI_Abort(MPI_COMM_WORLD, 1);
+				}
+				write_level(preview, iters, image_size, step);
+				fclose(preview);
+				preview_level++;
+			}
+		}
+
+		if(next_level<PROGRESSIVE_LEVELS)
+		{
+			msg[0] = next_row;
+			msg[1] = PROGRESSIVE_STEP>>next_level;
+			assigned[2*k] = next_row;
+			assigned[2*k+1] = next_level;
+			pending++;
+
+			next_row += msg[1];
+			if(next_row>=image_size)
+			{
+				next_row = 0;
+				next_level++;
+			}
+		}
+		else
+		{
+			msg[0] = -1;
+			msg[1] = 0;
+		}
+		MPI_Send(msg, 2, MPI_INT, k, 0, MPI_COMM_WORLD);
+	}
+
+	write_level(img, iters, image_size, 1);
+	free(iters);
+	free(samples);
+	free(assigned);
+}
+
+
+/**
+ * @brief Slave side of the progressive render
+ *
+ * Computes only the samples of the received row that are new in the
+ * received level and sends back their iteration counts, in column order.
+ *
+ * @param c_x_min lowest x boundary of the figure
+ * @param c_y_max highest y boundary of the figure
+ * @param pixel_width width of one pixel
+ * @param pixel_height height of one pixel
+ * @param image_size the resolution of the resulting image
+ * @param formula formula selected on the command line
+ */
+void progressive_slave(double c_x_min, double c_y_max, double pixel_width,
+	double pixel_height, int image_size, const struct formula *formula)
+{
+	int i, j, n, msg[2];
+	unsigned short *samples;
+	complex z;
+	MPI_Status st;
+
+	samples = malloc(image_size*sizeof(unsigned short));
+
+	for(;;)
+	{
+		MPI_Recv(msg, 2, MPI_INT, 0, 0, MPI_COMM_WORLD, &st);
+
+		// If received message -1, close the slave
+		if(msg[0]==-1)
+			break;
+
+		i = msg[0];
+		for(j=0, n=0; j<image_size; j++)
+		{
+			if(is_new_sample(i, j, msg[1]))
+			{
+				z=c_x_min+j*(pixel_width)+(c_y_max-i*(pixel_height))*I;
+				samples[n++]=formula_point(formula, z);
+			}
+		}
+
+		MPI_Send(samples, n, MPI_UNSIGNED_SHORT, 0, i, MPI_COMM_WORLD);
+	}
+
+	free(samples);
+}
+
+
+/**
+ * @brief Iteration band used to detect the pixels that need supersampling
+ *
+ * @param iter number of iterations computed for the pixel
+ * @return the band of the pixel (points of the set have their own band)
+ */
+int aa_band(int iter)
+{
+	return iter==MAX_ITER ? -1 : iter/AA_BAND;
+}
+
+
+/**
+ * @brief Render a block of pixels with adaptive supersampling
+ *
+ * The block and a one pixel halo around it are computed at 1x. Only the
+ * pixels with a 4-neighbor in a different iteration band are refined with
+ * aa x aa samples, whose colors are averaged, so the extra cost follows the
+ * length of the boundaries inside the block instead of its area.
+ *
+ * @param c_x_min x of the sample of column 0
+ * @param c_y_max y of the sample of row 0
+ * @param pixel_width width of one pixel
+ * @param pixel_height height of one pixel
+ * @param r0 first row of the block
+ * @param c0 first column of the block
+ * @param h number of rows of the block
+ * @param w number of columns of the block
+ * @param aa number of samples per side of a refined pixel
+ * @param formula formula selected on the command line
+ * @param iters scratch buffer of (h+2)*(w+2) integers
+ * @param rgb output buffer of 3*w*h bytes
+ * @return the number of refined pixels
+ */
+long render_aa_block(double c_x_min, double c_y_max, double pixel_width,
+	double pixel_height, int r0, int c0, int h, int w, int aa,
+	const struct formula *formula, int *iters, unsigned char *rgb)
+{
+	int i, j, a, b, band, sum[3];
+	unsigned char px[3];
+	long refined;
+	complex z;
+
+	for(i=-1; i<=h; i++)
+		for(j=-1; j<=w; j++)
+		{
+			z=c_x_min+(c0+j)*(pixel_width)+(c_y_max-(r0+i)*(pixel_height))*I;
+			iters[(i+1)*(w+2)+j+1]=formula_point(formula, z);
+		}
+
+	refined = 0;
+	for(i=0; i<h; i++)
+		for(j=0; j<w; j++)
+		{
+			band = aa_band(iters[(i+1)*(w+2)+j+1]);
+			if(band==aa_band(iters[i*(w+2)+j+1]) && band==aa_band(iters[(i+2)*(w+2)+j+1])
+				&& band==aa_band(iters[(i+1)*(w+2)+j]) && band==aa_band(iters[(i+1)*(w+2)+j+2]))
+			{
+				set_color(&rgb[3*((size_t)i*w+j)], iters[(i+1)*(w+2)+j+1]);
+				continue;
+			}
+
+			// Edge pixel: average aa x aa samples centered on the pixel
+			sum[0] = sum[1] = sum[2] = 0;
+			for(a=0; a<aa; a++)
+				for(b=0; b<aa; b++)
+				{
+					z=c_x_min+(c0+j+(b+0.5)/aa-0.5)*(pixel_width)
+						+(c_y_max-(r0+i+(a+0.5)/aa-0.5)*(pixel_height))*I;
+					set_color(px, formula_point(formula, z));
+					sum[0] += px[0];
+					sum[1] += px[1];
+					sum[2] += px[2];
+				}
+			rgb[3*((size_t)i*w+j)] = sum[0]/(aa*aa);
+			rgb[3*((size_t)i*w+j)+1] = sum[1]/(aa*aa);
+			rgb[3*((size_t)i*w+j)+2] = sum[2]/(aa*aa);
+			refined++;
+		}
+
+	return refined;
+}
+
+
+/**
+ * @brief Master side of the anti-aliased render
+ *
+ * Hands out blocks of AA_TILE_ROWS rows and writes every received block at
+ * its position in the image.
+ *
+ * @param image_size the resolution of the resulting image
+ * @param nslaves number of slave processes
+ * @param img destination of the image
+ */
+void aa_master(int image_size, int nslaves, FILE *img)
+{
+	int i, s, t, h, hdr, ntiles, next;
+	unsigned char *rgb;
+	long refined, total;
+	MPI_Status st;
+
+	rgb = malloc((size_t)3*AA_TILE_ROWS*image_size*sizeof(unsigned char));
+	if(!rgb)
+	{
+		fprintf(stderr, "Unable to allocate the anti-aliasing buffer\n");
+		MPI_Abort(MPI_COMM_WORLD, 1);
+	}
+
+	hdr = fprintf(img, "P6\n%d %d 255\n", image_size, image_size);
+	ntiles = (image_size+AA_TILE_ROWS-1)/AA_TILE_ROWS;
+
+	for(s=1; s<=nslaves; s++)
+	{
+		next = s-1<ntiles ? s-1 : -1;
+		MPI_Send(&next, 1, MPI_INT, s, 0, MPI_COMM_WORLD);
+	}
+
+	for(i=0; i<ntiles; i++)
+	{
+		MPI_Recv(rgb, 3*AA_TILE_ROWS*image_size, MPI_CHAR, MPI_ANY_SOURCE, MPI_ANY_TAG, MPI_COMM_WORLD, &st);
+		t = st.MPI_TAG;
+		h = image_size-t*AA_TILE_ROWS<AA_TILE_ROWS ? image_size-t*AA_TILE_ROWS : AA_TILE_ROWS;
+		fseeko(img, hdr+(off_t)3*image_size*t*AA_TILE_ROWS, SEEK_SET);
+		fwrite(rgb, 1, (size_t)3*h*image_size, img);
+
+		next = i+nslaves<ntiles ? i+nslaves : -1;
+		MPI_Send(&next, 1, MPI_INT, st.MPI_SOURCE, 0, MPI_COMM_WORLD);
+	}
+
+	refined = 0;
+	MPI_Reduce(&refined, &total, 1, MPI_LONG, MPI_SUM, 0, MPI_COMM_WORLD);
+	printf("Refined pixels: %ld of %ld (%.2f%%)\n", total, (long)image_size*image_size,
+		100.0*total/((double)image_size*image_size));
+
+	free(rgb);
+}
+
+
+/**
+ * @brief Slave side of the anti-aliased render
+ *
+ * @param c_x_min lowest x boundary of the figure
+ * @param c_y_max highest y boundary of the figure
+ * @param pixel_width width of one pixel
+ * @param pixel_height height of one pixel
+ * @param image_size the resolution of the resulting image
+ * @param aa number of samples per side of a refined pixel
+ * @param formula formula selected on the command line
+ */
+void aa_slave(double c_x_min, double c_y_max, double pixel_width,
+	double pixel_height, int image_size, int aa, const struct formula *formula)
+{
+	int t, h, *iters;
+	unsigned char *rgb;
+	long refined;
+	MPI_Status st;
+
+	iters = malloc((size_t)(AA_TILE_ROWS+2)*(image_size+2)*sizeof(int));
+	rgb = malloc((size_t)3*AA_TILE_ROWS*image_size*sizeof(unsigned char));
+	if(!iters || !rgb)
+	{
+		fprintf(stderr, "Unable to allocate the anti-aliasing buffers\n");
+		MPI_Abort(MPI_COMM_WORLD, 1);
+	}
+
+	refined = 0;
+	for(;;)
+	{
+		MPI_Recv(&t, 1, MPI_INT, 0, 0, MPI_COMM_WORLD, &st);
+
+		// If received message -1, close the slave
+		if(t==-1)
+			break;
+
+		h = image_size-t*AA_TILE_ROWS<AA_TILE_ROWS ? image_size-t*AA_TILE_ROWS : AA_TILE_ROWS;
+		refined += render_aa_block(c_x_min, c_y_max, pixel_width, pixel_height,
+			t*AA_TILE_ROWS, 0, h, image_size, aa, formula, iters, rgb);
+		MPI_Send(rgb, 3*h*image_size, MPI_CHAR, 0, t, MPI_COMM_WORLD);
+	}
+
+	MPI_Reduce(&refined, NULL, 1, MPI_LONG, MPI_SUM, 0, MPI_COMM_WORLD);
+
+	free(iters);
+	free(rgb);
+}
+
+
+/**
+ * @brief Allocate the whole image in an MPI shared memory window
  *
- *	@author		Decio Lauro Soares (deciolauro@gmail.com)
- *	@date		05 Jul 2017
- *	@bug		No known bugs
- *	@warning	Based on class given by MJ Rutter(May contain Copyright issues)
- * 	@copyright	GNU Public License v3
+ * Only possible when every process runs on the same node, which is
+ * detected by splitting MPI_COMM_WORLD with MPI_COMM_TYPE_SHARED. Process
+ * zero owns the memory and the slaves write their rows straight into it,
+ * so no row data is exchanged through MPI. A passive target epoch is kept
+ * open on the window for the whole run (see free_shared_image).
+ *
+ * @param image_size the resolution of the image
+ * @param rank rank of the calling process
+ * @param win returns the window holding the image
+ * @return image pointer to the first pixel or NULL if the processes do not
+ *		   share a node
  */
+unsigned char *alloc_shared_image(int image_size, int rank, MPI_Win *win)
+{
+	MPI_Comm node;
+	MPI_Aint size;
+	unsigned char *base, *image;
+	int nproc, nlocal, disp;
 
-#include <stdio.h>
-#include <stdlib.h>
-#include <complex.h>
-#include <mpi.h>
+	MPI_Comm_size(MPI_COMM_WORLD, &nproc);
+	MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, rank, MPI_INFO_NULL, &node);
+	MPI_Comm_size(node, &nlocal);
+	if(nlocal!=nproc)
+	{
+		MPI_Comm_free(&node);
+		return NULL;
+	}
 
-#define MAX_ITER 300
-#define ESCAPE_RADIUS_SQUARED 4
+	size = rank==0 ? (MPI_Aint)3*image_size*image_size : 0;
+	MPI_Win_allocate_shared(size, 1, MPI_INFO_NULL, node, &base, win);
+	MPI_Win_shared_query(*win, 0, &size, &disp, &image);
+	MPI_Win_lock_all(MPI_MODE_NOCHECK, *win);
+	MPI_Comm_free(&node);
+
+	return image;
+}
+
+
+/**
+ * @brief Close the epoch opened by alloc_shared_image and free the window
+ *
+ * @param win window returned by alloc_shared_image
+ */
+void free_shared_image(MPI_Win *win)
+{
+	MPI_Win_unlock_all(*win);
+	MPI_Win_free(win);
+}
 
 /**
- * @brief Perform the calculations for the set until divergence or MAX_ITER 
+ * @brief Master of the plain render
  *
- * For the complex number z0, it performs the Mandelbrot calculation until it
- * reaches divergence or it reaches the maximum number of iterations,
- * whichever happens first, returning the number of iterations until divergence
- * or MAX_ITER
+ * Every slave starts with one row and gets the next one as soon as its
+ * answer comes, blocking in MPI_Recv on any source. With use_async the
+ * rows are queued to an asynchronous writer instead of being written
+ * before the next row is handed out.
  *
- * @param z0 complex number to perform the Mandelbrot calculations
- * @return i integer with the number of iterations until divergerce or MAX_ITER
+ * @param image_size the resolution of the image
+ * @param nslaves number of slaves
+ * @param m axis returned by mirror_axis
+ * @param use_async whether the rows go through the write ring
  */
-int mandelbrot(complex z0)
+void plain_master(int image_size, int nslaves, int m, int use_async)
 {
-	int i;
-	complex z;
+	int i, k, r, s, hdr, msg, len, nunique;
+	long long sent;
+	unsigned short *counts;
+	unsigned char *line, lut[3*(MAX_ITER+1)];
+	MPI_Status st;
+	FILE *img;
+	struct writer writer, *w;
 
-	z = z0;
-	for(i=1; i<MAX_ITER; i++)
+	nunique = unique_rows(m, image_size);
+	counts = malloc(image_size*sizeof(unsigned short));
+	line = malloc(3*image_size);
+	if(!counts || !line)
 	{
-		z=z*z+z0;
-		if((creal(z)*creal(z))+(cimag(z)*cimag(z))>ESCAPE_RADIUS_SQUARED)
-			break;
-  	}
+		fprintf(stderr, "Unable to allocate the master buffers\n");
+		MPI_Abort(MPI_COMM_WORLD, 1);
+	}
 
-	return i;
+	img = fopen(IMAGE_NAME, "w");
+	if(!img)
+	{
+		perror("Unable to create the image");
+		MPI_Abort(MPI_COMM_WORLD, 1);
+	}
+	hdr = fprintf(img, "P6\n%d %d 255\n", image_size, image_size);
+	w = NULL;
+	if(use_async)
+	{
+		fflush(img);
+		w = &writer;
+		writer_start(w, fileno(img), 3*image_size);
+	}
+	build_lut(lut);
+
+	for(i=0; i<nslaves; i++)
+	{
+		msg = i<nunique ? unique_row(i, m) : -1;
+		MPI_Send(&msg, 1, MPI_INT, i+1, 0, MPI_COMM_WORLD);
+	}
+
+	sent = 0;
+	for(i=0; i<nunique; i++)
+	{
+		MPI_Recv(counts, image_size, MPI_UNSIGNED_SHORT, MPI_ANY_SOURCE, MPI_ANY_TAG, MPI_COMM_WORLD, &st);
+		r = st.MPI_TAG;
+		s = st.MPI_SOURCE;
+		MPI_Get_count(&st, MPI_UNSIGNED_SHORT, &len);
+		sent += len;
+
+		k = mirror_row(r, m, image_size);
+		if(w)
+		{
+			decode_row(counts, len, image_size, lut, writer_slot(w));
+			writer_push(w, 3*image_size, hdr+(off_t)3*image_size*r,
+				k>=0 ? hdr+(off_t)3*image_size*k : -1);
+		}
+		else
+		{
+			decode_row(counts, len, image_size, lut, line);
+			fseeko(img, hdr+(off_t)3*image_size*r, SEEK_SET);
+			fwrite(line, 1, 3*image_size, img);
+			if(k>=0)
+			{
+				fseeko(img, hdr+(off_t)3*image_size*k, SEEK_SET);
+				fwrite(line, 1, 3*image_size, img);
+			}
+		}
+
+		if((i+nslaves)<nunique)
+			msg = unique_row(i+nslaves, m);
+		else
+			msg = -1;
+
+		MPI_Send(&msg, 1, MPI_INT, s, 0, MPI_COMM_WORLD);
+	}
+
+	if(w)
+		writer_stop(w);
+	fclose(img);
+	printf("Received %lld bytes of iteration counts for rows of %lld bytes as RGB\n",
+		sent*(long long)sizeof(unsigned short), (long long)nunique*3*image_size);
+
+	free(counts);
+	free(line);
 }
 
 
 /**
- * @brief Function responsible for printing usage instructions
+ * @brief Open the image and its completion bitmap
  *
- * This function is responsible for printing the usage instructions
+ * The bitmap has one bit per row of the image, set once the row (and its
+ * mirrored row) reached the image file, and is followed by the parameters
+ * of the render. A new render creates both files, a resumed one reopens
+ * them after checking they belong to an image of the same size, window
+ * and formula, and loads the finished rows into done.
  *
+ * @param image_size the resolution of the image
+ * @param params window and formula of the render, as a line of text
+ * @param resume whether the files of a previous run are reopened
+ * @param done bitmap of (image_size+7)/8 bytes
+ * @param hdr returns the size of the header
+ * @param bitmap returns the file keeping the bitmap
+ * @return img the image opened for writing
  */
-void print_instructions()
+FILE *open_checkpoint(int image_size, const char *params, int resume, unsigned char *done, int *hdr, FILE **bitmap)
 {
-	printf("usage: mpirun -np NP ./mandelbrot_mpi_ms c_x_min c_x_max c_y_min c_y_max image_size\n");
-	printf("examples with image_size = 11500:\n");
-	printf("    Full Picture: mpirun -np 4 ./mandelbrot_mpi_ms -2.5 1.5 -2.0 2.0 11500\n");
-	printf("    Seahorse Valley: mpirun -np 8 ./mandelbrot_mpi_ms -0.8 -0.7 0.05 0.15 11500\n");
-	printf("    Elephant Valley:  mpirun -np 2 ./mandelbrot_mpi_ms 0.175 0.375 -0.1 0.1 11500\n");
-	printf("    Triple Spiral Valley: mpirun -np 8 ./mandelbrot_mpi_ms -0.188 -0.012 0.554 0.754 11500\n");
+	char header[64], found[256];
+	size_t size, plen;
+	FILE *img;
+
+	*hdr = snprintf(header, sizeof(header), "P6\n%d %d 255\n", image_size, image_size);
+	size = (image_size+7)/8;
+	plen = strlen(params);
+
+	if(!resume)
+	{
+		img = fopen(IMAGE_NAME, "w");
+		*bitmap = fopen(CHECKPOINT_NAME, "w");
+		if(!img || !*bitmap)
+		{
+			perror("Unable to create the image");
+			MPI_Abort(MPI_COMM_WORLD, 1);
+		}
+		fwrite(header, 1, *hdr, img);
+		fwrite(done, 1, size, *bitmap);
+		fwrite(params, 1, plen, *bitmap);
+		fflush(*bitmap);
+		return img;
+	}
+
+	img = fopen(IMAGE_NAME, "r+");
+	*bitmap = fopen(CHECKPOINT_NAME, "r+");
+	if(!img || !*bitmap)
+	{
+		perror("Unable to reopen the image to resume");
+		MPI_Abort(MPI_COMM_WORLD, 1);
+	}
+	if(fread(found, 1, *hdr, img)!=(size_t)*hdr || memcmp(found, header, *hdr)
+		|| fread(done, 1, size, *bitmap)!=size)
+	{
+		fprintf(stderr, "%s and %s do not belong to a %dx%d image\n", IMAGE_NAME,
+			CHECKPOINT_NAME, image_size, image_size);
+		MPI_Abort(MPI_COMM_WORLD, 1);
+	}
+
+	// Rows of another window or formula must not be mixed with these ones
+	if(fread(found, 1, plen, *bitmap)!=plen || memcmp(found, params, plen))
+	{
+		fprintf(stderr, "%s was written with another window or formula, not resuming\n",
+			CHECKPOINT_NAME);
+		MPI_Abort(MPI_COMM_WORLD, 1);
+	}
+
+	return img;
+}
+
+
+/**
+ * @brief Persist the completion bitmap
+ *
+ * The image (or the write ring) is flushed first, so a row is never marked
+ * before its bytes were handed to the operating system.
+ *
+ * @param img image opened by open_checkpoint
+ * @param w asynchronous writer of the image, or NULL
+ * @param bitmap bitmap opened by open_checkpoint
+ * @param done bitmap of the finished rows
+ * @param image_size the resolution of the image
+ */
+void save_checkpoint(FILE *img, struct writer *w, FILE *bitmap, const unsigned char *done, int image_size)
+{
+	if(w)
+		writer_flush(w);
+	else
+		fflush(img);
+	rewind(bitmap);
+	fwrite(done, 1, (image_size+7)/8, bitmap);
+	fflush(bitmap);
+}
+
+
+/**
+ * @brief Stop waiting for the answer of a slave
+ *
+ * @param req receive posted for the answer
+ */
+void give_up(MPI_Request *req)
+{
+	MPI_Cancel(req);
+	MPI_Request_free(req);
+}
+
+
+/**
+ * @brief Master of the plain render with checkpoints and requeueing
+ *
+ * Each slave has one outstanding row, received with MPI_Irecv and polled
+ * with MPI_Test, so one slave that stops answering does not block the
+ * others. A row not answered within timeout seconds (or whose receive
+ * fails) is queued again for the next idle slave. Late answers are still
+ * accepted, and rows already written are ignored. A slave still silent
+ * after a second timeout is no longer counted as working (so the master
+ * gives up with a checkpoint when no slave is left) but is taken back if
+ * it answers. Polls that find no answer sleep
+ * POLL_NSEC nanoseconds so the master leaves the CPU to the slaves. The
+ * bitmap is saved
+ * every CHECKPOINT_ROWS rows and removed once the image is complete.
+ * With use_async the rows are queued to an asynchronous writer instead of
+ * being written between two polls.
+ *
+ * @param image_size the resolution of the image
+ * @param nslaves number of slaves
+ * @param m axis returned by mirror_axis
+ * @param params window and formula of the render, kept in the checkpoint
+ * @param resume whether a previous run is resumed
+ * @param timeout seconds a slave may take for one row
+ * @param use_async whether the rows go through the write ring
+ */
+void checkpoint_master(int image_size, int nslaves, int m, const char *params, int resume, double timeout, int use_async)
+{
+	int i, k, r, s, hdr, flag, head, tail, left, marks, lost, nunique, msg, len, got;
+	int *queue, *assigned, *state;
+	long long sent, rows;
+	unsigned short *counts;
+	unsigned char *done, *line, lut[3*(MAX_ITER+1)];
+	double *deadline;
+	MPI_Request *req;
+	MPI_Status st;
+	FILE *img, *bitmap;
+	struct writer writer, *w;
+	struct timespec pause;
+
+	nunique = unique_rows(m, image_size);
+	done = calloc((image_size+7)/8, 1);
+	queue = malloc(nunique*sizeof(int));
+	assigned = malloc(nslaves*sizeof(int));
+	state = calloc(nslaves, sizeof(int));
+	deadline = malloc(nslaves*sizeof(double));
+	req = malloc(nslaves*sizeof(MPI_Request));
+	counts = malloc((size_t)nslaves*image_size*sizeof(unsigned short));
+	line = malloc(3*image_size);
+	if(!done || !queue || !assigned || !state || !deadline || !req || !counts || !line)
+	{
+		fprintf(stderr, "Unable to allocate the master buffers\n");
+		MPI_Abort(MPI_COMM_WORLD, 1);
+	}
+
+	img = open_checkpoint(image_size, params, resume, done, &hdr, &bitmap);
+	w = NULL;
+	if(use_async)
+	{
+		fflush(img);
+		w = &writer;
+		writer_start(w, fileno(img), 3*image_size);
+	}
+	build_lut(lut);
+	sent = rows = 0;
+	pause.tv_sec = 0;
+	pause.tv_nsec = POLL_NSEC;
+
+	// Only the unique rows missing from the bitmap are handed out, every
+	// row is at most once in the queue
+	head = tail = 0;
+	for(k=0; k<nunique; k++)
+		if(!(done[unique_row(k, m)/8]&(1<<(unique_row(k, m)%8))))
+			queue[tail++] = unique_row(k, m);
+	left = tail;
+	if(resume)
+		printf("Resuming with %d of %d rows left\n", left, nunique);
+
+	marks = 0;
+	while(left>0)
+	{
+		for(s=0; s<nslaves; s++)
+		{
+			while(state[s]==SLAVE_IDLE && head!=tail)
+			{
+				i = queue[head%nunique];
+				head++;
+				if(done[i/8]&(1<<(i%8)))
+					continue;
+
+				MPI_Send(&i, 1, MPI_INT, s+1, 0, MPI_COMM_WORLD);
+				MPI_Irecv(counts+(size_t)image_size*s, image_size, MPI_UNSIGNED_SHORT, s+1, MPI_ANY_TAG, MPI_COMM_WORLD, &req[s]);
+				assigned[s] = i;
+				state[s] = SLAVE_BUSY;
+				deadline[s] = MPI_Wtime()+timeout;
+			}
+		}
+
+		for(s=0, k=0; s<nslaves; s++)
+			if(state[s]==SLAVE_BUSY || state[s]==SLAVE_LATE)
+				k++;
+		if(k==0)
+		{
+			save_checkpoint(img, w, bitmap, done, image_size);
+			fprintf(stderr, "No slave left with %d rows missing, rerun with --resume\n", left);
+			MPI_Abort(MPI_COMM_WORLD, 1);
+		}
+
+		for(s=0, got=0; s<nslaves; s++)
+		{
+			if(state[s]!=SLAVE_BUSY && state[s]!=SLAVE_LATE && state[s]!=SLAVE_SILENT)
+				continue;
+
+			if(MPI_Test(&req[s], &flag, &st)!=MPI_SUCCESS)
+			{
+				fprintf(stderr, "Slave %d failed, row %d queued again\n", s+1, assigned[s]);
+				if(state[s]==SLAVE_BUSY)
+					queue[(tail++)%nunique] = assigned[s];
+				state[s] = SLAVE_DEAD;
+			}
+			else if(flag)
+			{
+				got++;
+				state[s] = SLAVE_IDLE;
+				r = st.MPI_TAG;
+				MPI_Get_count(&st, MPI_UNSIGNED_SHORT, &len);
+				sent += len;
+				rows++;
+				if(done[r/8]&(1<<(r%8)))
+					continue;
+
+				k = mirror_row(r, m, image_size);
+				if(w)
+				{
+					decode_row(counts+(size_t)image_size*s, len, image_size, lut, writer_slot(w));
+					writer_push(w, 3*image_size, hdr+(off_t)3*image_size*r,
+						k>=0 ? hdr+(off_t)3*image_size*k : -1);
+				}
+				else
+				{
+					decode_row(counts+(size_t)image_size*s, len, image_size, lut, line);
+					fseeko(img, hdr+(off_t)3*image_size*r, SEEK_SET);
+					fwrite(line, 1, 3*image_size, img);
+					if(k>=0)
+					{
+						fseeko(img, hdr+(off_t)3*image_size*k, SEEK_SET);
+						fwrite(line, 1, 3*image_size, img);
+					}
+				}
+				done[r/8] |= 1<<(r%8);
+				if(k>=0)
+					done[k/8] |= 1<<(k%8);
+				left--;
+
+				if(++marks==CHECKPOINT_ROWS)
+				{
+					save_checkpoint(img, w, bitmap, done, image_size);
+					marks = 0;
+				}
+			}
+			else if(state[s]==SLAVE_BUSY && MPI_Wtime()>deadline[s])
+			{
+				fprintf(stderr, "Slave %d timed out, row %d queued again\n", s+1, assigned[s]);
+				queue[(tail++)%nunique] = assigned[s];
+				state[s] = SLAVE_LATE;
+				deadline[s] += timeout;
+			}
+			else if(state[s]==SLAVE_LATE && MPI_Wtime()>deadline[s])
+			{
+				fprintf(stderr, "Slave %d is silent, no longer waited for\n", s+1);
+				state[s] = SLAVE_SILENT;
+			}
+		}
+
+		if(!got)
+			nanosleep(&pause, NULL);
+	}
+
+	save_checkpoint(img, w, bitmap, done, image_size);
+	if(w)
+		writer_stop(w);
+	fclose(bitmap);
+	fclose(img);
+	remove(CHECKPOINT_NAME);
+	printf("Received %lld bytes of iteration counts for rows of %lld bytes as RGB\n",
+		sent*(long long)sizeof(unsigned short), rows*3*image_size);
+
+	// Slaves still on a row (late or silent ones, or ones computing a
+	// requeued row that another slave finished) get one more timeout to
+	// answer before they are given up
+	for(s=0; s<nslaves; s++)
+		deadline[s] = MPI_Wtime()+timeout;
+	do
+	{
+		for(s=0, k=0; s<nslaves; s++)
+		{
+			if(state[s]!=SLAVE_BUSY && state[s]!=SLAVE_LATE && state[s]!=SLAVE_SILENT)
+				continue;
+
+			if(MPI_Test(&req[s], &flag, &st)!=MPI_SUCCESS)
+				state[s] = SLAVE_DEAD;
+			else if(flag)
+				state[s] = SLAVE_IDLE;
+			else if(MPI_Wtime()>deadline[s])
+			{
+				give_up(&req[s]);
+				state[s] = SLAVE_DEAD;
+			}
+			else
+				k++;
+		}
+		if(k>0)
+			nanosleep(&pause, NULL);
+	}
+	while(k>0);
+
+	msg = -1;
+	lost = 0;
+	for(s=0; s<nslaves; s++)
+	{
+		if(state[s]==SLAVE_IDLE)
+			MPI_Send(&msg, 1, MPI_INT, s+1, 0, MPI_COMM_WORLD);
+		else
+			lost++;
+	}
+
+	free(done);
+	free(queue);
+	free(assigned);
+	free(state);
+	free(deadline);
+	free(req);
+	free(counts);
+	free(line);
+
+	// Slaves that never answered cannot take part in MPI_Finalize
+	if(lost)
+	{
+		fprintf(stderr, "The image is complete but %d slaves did not answer\n", lost);
+		MPI_Abort(MPI_COMM_WORLD, 1);
+	}
 }
 
 
 int main(int argc, char** argv)
 {
 	double c_x_min, c_x_max, c_y_min, c_y_max, pixel_width, pixel_height;
-	int i, j, image_size, i_x_max, i_y_max, rank, nproc, hdr, r, s, nslaves;
-	int msg, *row;
-	unsigned char *line;
+	int i, j, image_size, i_x_max, i_y_max, rank, nproc, r, s, nslaves;
+	int msg, progressive, use_shm, aa, m, k, nunique, resume, use_async, use_rle, len, provided, *row;
+	int plain_only, checkpoint;
+	double timeout;
+	char params[256];
+	unsigned short *counts;
+	unsigned char *line, *image, lut[3*(MAX_ITER+1)];
 	complex z;
+	struct formula formula;
 	FILE *img;
 	MPI_Status st;
+	MPI_Win win;
 
-	MPI_Init(NULL, NULL);
+	// The writer threads of --async never call MPI
+	MPI_Init_thread(NULL, NULL, MPI_THREAD_FUNNELED, &provided);
 	MPI_Comm_size(MPI_COMM_WORLD, &nproc);
 	MPI_Comm_rank(MPI_COMM_WORLD, &rank);
 	nslaves=nproc-1;
@@ -129,35 +1787,181 @@ int main(int argc, char** argv)
         pixel_height      = (c_y_max - c_y_min) / i_y_max;
     }
 
+	progressive = 0;
+	use_shm = 0;
+	aa = 1;
+	resume = 0;
+	use_async = 0;
+	use_rle = 0;
+	timeout = 0;
+	plain_only = 0;
+	checkpoint = 0;
+	formula.power = 2;
+	formula.julia = 0;
+	formula.c = 0;
+	for(i=6; i<argc; i++)
+	{
+		if(strcmp(argv[i], "--progressive")==0)
+			progressive = 1;
+		else if(strcmp(argv[i], "--shm")==0)
+			use_shm = 1;
+		else if(strcmp(argv[i], "--checkpoint")==0)
+			checkpoint = plain_only = 1;
+		else if(strcmp(argv[i], "--resume")==0)
+			resume = checkpoint = plain_only = 1;
+		else if(strcmp(argv[i], "--async")==0)
+			use_async = plain_only = 1;
+		else if(strcmp(argv[i], "--rle")==0)
+			use_rle = plain_only = 1;
+		else if(strncmp(argv[i], "--timeout=", 10)==0 && sscanf(argv[i]+10, "%lf", &timeout)==1 && timeout>0)
+			plain_only = 1;
+		else if(strncmp(argv[i], "--aa=", 5)==0 && sscanf(argv[i]+5, "%d", &aa)==1 && aa>=1)
+			continue;
+		else if(parse_formula(argv[i], &formula))
+			continue;
+		else
+		{
+			if(rank==0)
+				print_instructions();
+			MPI_Finalize();
+			exit(1);
+		}
+	}
+
+	// --checkpoint, --resume, --async, --rle and --timeout only apply to
+	// the plain render, and --timeout only to a checkpointed one
+	if((progressive && aa>1) || ((progressive || aa>1) && plain_only) || (timeout>0 && !checkpoint))
+	{
+		if(rank==0)
+			print_instructions();
+		MPI_Finalize();
+		exit(1);
+	}
+
+	// The writer threads need at least MPI_THREAD_FUNNELED
+	if(use_async && provided<MPI_THREAD_FUNNELED)
+	{
+		use_async = 0;
+		if(rank==0)
+			fprintf(stderr, "The MPI library does not support threads, ignoring --async\n");
+	}
+
+	select_formula(&formula);
+
+	if(progressive)
+	{
+		if(rank==0)
+		{
+			img=fopen(IMAGE_NAME, "w");
+			if(!img)
+			{
+				perror("Unable to create the image");
+				MPI_Abort(MPI_COMM_WORLD, 1);
+			}
+			progressive_master(image_size, nslaves, img);
+			fclose(img);
+		}
+		else
+			progressive_slave(c_x_min, c_y_max, pixel_width, pixel_height, image_size, &formula);
+
+		MPI_Finalize();
+		return 0;
+	}
+
+	if(aa>1)
+	{
+		if(rank==0)
+		{
+			img=fopen(IMAGE_NAME, "w");
+			if(!img)
+			{
+				perror("Unable to create the image");
+				MPI_Abort(MPI_COMM_WORLD, 1);
+			}
+			aa_master(image_size, nslaves, img);
+			fclose(img);
+		}
+		else
+			aa_slave(c_x_min, c_y_max, pixel_width, pixel_height, image_size, aa, &formula);
+
+		MPI_Finalize();
+		return 0;
+	}
+
+	if(timeout==0)
+		timeout = SLAVE_TIMEOUT;
+
+	if(use_shm && checkpoint)
+	{
+		use_shm = 0;
+		if(rank==0)
+			fprintf(stderr, "The shared image cannot be checkpointed, ignoring --shm\n");
+	}
+
+	if(use_shm)
+	{
+		image = alloc_shared_image(image_size, rank, &win);
+		if(!image)
+		{
+			use_shm = 0;
+			if(rank==0)
+				fprintf(stderr, "Processes span more than one node, ignoring --shm\n");
+		}
+	}
+
+	m=formula_symmetric(&formula) ? mirror_axis(c_y_min, c_y_max, pixel_height) : -1;
+	nunique=unique_rows(m, image_size);
+
 	row=malloc(image_size*sizeof(int));
-	line=malloc(3*image_size*sizeof(unsigned char));
-	img=fopen("mandelbrot_mpi_ms.ppm", "w");
+	counts=malloc(image_size*sizeof(unsigned short));
+	build_lut(lut);
 
 	// Master code
-	if(rank==0)
+	if(rank==0 && !use_shm && !checkpoint)
+		plain_master(image_size, nslaves, m, use_async);
+	// Master code with --checkpoint
+	else if(rank==0 && !use_shm)
 	{
-		img=fopen("mandelbrot_mpi_ms.ppm", "w");
-    	hdr=fprintf(img, "P6\n%d %d 255\n", image_size, image_size);
+		// Failed receives are reported to the master instead of aborting
+		MPI_Comm_set_errhandler(MPI_COMM_WORLD, MPI_ERRORS_RETURN);
+		snprintf(params, sizeof(params), "window %a %a %a %a power %d julia %d %a %a\n",
+			c_x_min, c_x_max, c_y_min, c_y_max, formula.power, formula.julia,
+			creal(formula.c), cimag(formula.c));
+		checkpoint_master(image_size, nslaves, m, params, resume, timeout, use_async);
+	}
+	// Master code with --shm, the rows are already in the image and only
+	// their numbers come
+	else if(rank==0)
+	{
+		img=fopen(IMAGE_NAME, "w");
+		if(!img)
+		{
+			perror("Unable to create the image");
+			MPI_Abort(MPI_COMM_WORLD, 1);
+		}
+    	fprintf(img, "P6\n%d %d 255\n", image_size, image_size);
 
 		for(i=0; i<nslaves; i++)
-			MPI_Send(&i, 1, MPI_INT, i+1, 0, MPI_COMM_WORLD);
-
-		for(i=0; i<image_size; i++)
 		{
-			MPI_Recv(line, 3*image_size, MPI_CHAR, MPI_ANY_SOURCE, MPI_ANY_TAG, MPI_COMM_WORLD, &st);
+			msg = i<nunique ? unique_row(i, m) : -1;
+			MPI_Send(&msg, 1, MPI_INT, i+1, 0, MPI_COMM_WORLD);
+		}
 
-			r=st.MPI_TAG;
+		for(i=0; i<nunique; i++)
+		{
+			MPI_Recv(&r, 1, MPI_INT, MPI_ANY_SOURCE, MPI_ANY_TAG, MPI_COMM_WORLD, &st);
 			s=st.MPI_SOURCE;
-			fseek(img, hdr+3*image_size*r, SEEK_SET);
-			fwrite(line, 1, 3*image_size, img);
 
-			if((i+nslaves)<image_size)
-				msg=i+nslaves;
+			if((i+nslaves)<nunique)
+				msg=unique_row(i+nslaves, m);
 			else
 				msg=-1;
 
 			MPI_Send(&msg, 1, MPI_INT, s, 0, MPI_COMM_WORLD);
 		}
+
+		MPI_Win_sync(win);
+		fwrite(image, 1, (size_t)3*image_size*image_size, img);
 	}
 	// Slave
 	else
@@ -173,35 +1977,32 @@ int main(int argc, char** argv)
 			for(j=0; j<i_x_max; j++)
 			{
 				z=c_x_min+j*(pixel_width)+(c_y_max-i*(pixel_height))*I;
-				row[j]=mandelbrot(z);
+				row[j]=formula_point(&formula, z);
 			}
 
-			for(j=0; j<image_size; j++)
+			// With --shm the slave colorizes its row into the window,
+			// otherwise the master does it from the iteration counts
+			if(use_shm)
 			{
-				if(row[j]<=63)
-				{
-					line[3*j]=255;
-					line[3*j+1]=255-4*row[j];
-					line[3*j+2]=255-4*row[j];
-				}
-				else
-				{
-					line[3*j]=255;
-					line[3*j+1]=row[j]-63;
-					line[3*j+2]=0;
-				}
-				if(row[j]==MAX_ITER)
-				{
-					line[3*j]=255;
-					line[3*j+1]=255;
-					line[3*j+2]=255;
-				}
+				line=image+(size_t)3*image_size*i;
+				for(j=0; j<image_size; j++)
+					memcpy(line+3*j, lut+3*row[j], 3);
+				k=mirror_row(i, m, image_size);
+				if(k>=0)
+					memcpy(image+(size_t)3*image_size*k, line, 3*image_size);
+				MPI_Win_sync(win);
+				MPI_Send(&i, 1, MPI_INT, 0, i, MPI_COMM_WORLD);
+			}
+			else
+			{
+				len=encode_row(row, image_size, use_rle, counts);
+				MPI_Send(counts, len, MPI_UNSIGNED_SHORT, 0, i, MPI_COMM_WORLD);
 			}
-
-			MPI_Send(line, 3*image_size, MPI_CHAR, 0, i, MPI_COMM_WORLD);
 		}
 	}
 
+	if(use_shm)
+		free_shared_image(&win);
 	MPI_Finalize();
 	return 0;
 }
@@ -8,13 +8,32 @@
  *  optimizations in the load balance
  *
  *	Usage:
- *    mpirun -np NP ./mandelbrot_mpi_op c_x_min c_x_max c_y_min c_y_max image_size
+ *    mpirun -np NP ./mandelbrot_mpi_op c_x_min c_x_max c_y_min c_y_max image_size [options]
  *		- NP: Number of Open MPI processes
  *		- c_x_min: Lowest x boundary for the figure to be computed
  *		- c_x_max: Highest x boundary for the figure to be computed
  *		- c_y_mix: Lowest y boundary for the figure to be computed
  *		- c_y_max: Highest y boundary for the figure to be computed
  *		- image_size: The resolution of the resulting image
+ *	Options:
+ *		- --fallocate: Reserve the blocks of the whole image with
+ *		  posix_fallocate before any row is written
+ *		- --mmap: Map the image in memory (shared), so every process writes
+ *		  the RGB bytes of its rows straight into the file pages, with no row
+ *		  buffer and no write calls
+ *		- --power=d: Iterate z^d+c (Multibrot set) instead of z^2+c
+ *		- --julia=re,im: Render the Julia set of the constant re+im*i (with
+ *		  the power of --power) instead of the Mandelbrot set
+ *		- --costmap: Also write mandelbrot_mpi_op_cost.ppm, the iterations
+ *		  spent on every pixel (black to red, yellow and white for MAX_ITER,
+ *		  with the mirrored rows left black), and mandelbrot_mpi_op_owner.ppm,
+ *		  every row colored by the rank that computed it (its mirrored row at
+ *		  half brightness). Process zero prints the rows, iterations and
+ *		  compute time of every rank and their imbalance
+ *
+ *	When the window straddles the real axis on mirrored row positions (as
+ *	the Full Picture does) only the unique rows are distributed cyclically
+ *	among the processes and each of them is also written to its mirrored row.
  *  Usage examples:
  *      Full Picture: mpirun -np 4 ./mandelbrot_mpi_op -2.5 1.5 -2.0 2.0 11500
  *      Seahorse Valley: mpirun -np 4 ./mandelbrot_mpi_op -0.8 -0.7 0.05 0.15 8192
@@ -37,7 +56,12 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
 #include <complex.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #include <mpi.h>
 
 #define MAX_ITER 300
@@ -45,33 +69,151 @@
 
 
 /**
- * @brief Perform the calculations for the set until divergence or MAX_ITER 
+ * @brief Generate an escape time kernel for one fixed formula
+ *
+ * Every kernel iterates z from the given point adding the constant c,
+ * which is the point itself for the Multibrot sets and a fixed constant
+ * for the Julia sets. The step is pasted into the loop, so each power is
+ * compiled on its own with no branch on the formula while iterating.
  *
- * For the complex number z0, it performs the Mandelbrot calculation until it
- * reaches divergence or it reaches the maximum number of iterations,
- * whichever happens first, returning the number of iterations until divergence
- * or MAX_ITER
+ * @param name name of the generated function
+ * @param step update of z (and temporaries) for one iteration
+ */
+#define FORMULA_KERNEL(name, step) \
+int name(complex z, complex c, int power) \
+{ \
+	int i; \
+	complex w; \
+ \
+	(void)power; \
+	(void)w; \
+	for(i=1; i<MAX_ITER; i++) \
+	{ \
+		step; \
+		if((creal(z)*creal(z))+(cimag(z)*cimag(z))>ESCAPE_RADIUS_SQUARED) \
+			break; \
+	} \
+ \
+	return i; \
+}
+
+FORMULA_KERNEL(formula_power2, z=z*z+c)
+FORMULA_KERNEL(formula_power3, z=z*z*z+c)
+FORMULA_KERNEL(formula_power4, w=z*z; z=w*w+c)
+FORMULA_KERNEL(formula_power5, w=z*z; z=w*w*z+c)
+FORMULA_KERNEL(formula_power6, w=z*z*z; z=w*w+c)
+
+
+/**
+ * @brief Escape time kernel of z^power+c for the powers without a
+ * specialized kernel
  *
- * @param z0 complex number to perform the Mandelbrot calculations
+ * @param z starting point of the orbit
+ * @param c constant added at every iteration
+ * @param power exponent of z
  * @return i integer with the number of iterations until divergerce or MAX_ITER
  */
-int mandelbrot(complex z0)
+int formula_generic(complex z, complex c, int power)
 {
-	int i;
-	complex z;
+	int i, k;
+	complex w;
 
-	z = z0;
 	for(i=1; i<MAX_ITER; i++)
 	{
-		z=z*z+z0;
+		w = z;
+		for(k=1; k<power; k++)
+			w *= z;
+		z = w+c;
 		if((creal(z)*creal(z))+(cimag(z)*cimag(z))>ESCAPE_RADIUS_SQUARED)
 			break;
-  	}
+	}
 
 	return i;
 }
 
 
+/**
+ * @brief Formula selected on the command line
+ */
+struct formula
+{
+	int (*kernel)(complex z, complex c, int power);
+	int power;
+	int julia;
+	complex c;
+};
+
+
+/**
+ * @brief Parse the --power=d and --julia=re,im options
+ *
+ * @param arg command line argument
+ * @param f formula updated with the option
+ * @return 1 if arg was a formula option, 0 otherwise
+ */
+int parse_formula(const char *arg, struct formula *f)
+{
+	double re, im;
+
+	if(strncmp(arg, "--power=", 8)==0 && sscanf(arg+8, "%d", &f->power)==1 && f->power>=2)
+		return 1;
+	if(strncmp(arg, "--julia=", 8)==0 && sscanf(arg+8, "%lf,%lf", &re, &im)==2)
+	{
+		f->julia = 1;
+		f->c = re+im*I;
+		return 1;
+	}
+	return 0;
+}
+
+
+/**
+ * @brief Pick the kernel for the power of the formula
+ *
+ * @param f formula whose kernel is set
+ */
+void select_formula(struct formula *f)
+{
+	switch(f->power)
+	{
+		case 2: f->kernel = formula_power2; break;
+		case 3: f->kernel = formula_power3; break;
+		case 4: f->kernel = formula_power4; break;
+		case 5: f->kernel = formula_power5; break;
+		case 6: f->kernel = formula_power6; break;
+		default: f->kernel = formula_generic;
+	}
+}
+
+
+/**
+ * @brief Number of iterations of one point with the selected formula
+ *
+ * @param f formula selected by select_formula
+ * @param z point of the complex plane
+ * @return i integer with the number of iterations until divergerce or MAX_ITER
+ */
+int formula_point(const struct formula *f, complex z)
+{
+	return f->kernel(z, f->julia ? f->c : z, f->power);
+}
+
+
+/**
+ * @brief Whether the image of the formula is symmetric about the real axis
+ *
+ * The Multibrot sets and the Julia sets of a real constant are their own
+ * complex conjugate, the other Julia sets are not.
+ *
+ * @param f formula selected on the command line
+ * @return 1 if the rows mirrored about the real axis are equal
+ */
+int formula_symmetric(const struct formula *f)
+{
+	return !f->julia || cimag(f->c)==0;
+}
+
+
 /**
  * @brief Function responsible for printing usage instructions
  *
@@ -80,7 +222,8 @@ int mandelbrot(complex z0)
  */
 void print_instructions()
 {
-	printf("usage: mpirun -np NP ./mandelbrot_mpi_op c_x_min c_x_max c_y_min c_y_max image_size\n");
+	printf("usage: mpirun -np NP ./mandelbrot_mpi_op c_x_min c_x_max c_y_min c_y_max image_size [--fallocate] [--mmap]\n");
+	printf("    [--power=d] [--julia=re,im] [--costmap]\n");
 	printf("examples with image_size = 11500:\n");
 	printf("    Full Picture: mpirun -np 4 ./mandelbrot_mpi_op -2.5 1.5 -2.0 2.0 11500\n");
 	printf("    Seahorse Valley: mpirun -np 8 ./mandelbrot_mpi_op -0.8 -0.7 0.05 0.15 11500\n");
@@ -89,13 +232,404 @@ void print_instructions()
 }
 
 
+/**
+ * @brief Find the axis of the conjugate symmetry of the image
+ *
+ * The set is symmetric about the real axis, so when the window straddles it
+ * and the rows fall on mirrored positions, row i and row m-i have the same
+ * pixels. Such rows are computed once and written twice.
+ *
+ * @param c_y_min lowest y boundary of the figure
+ * @param c_y_max highest y boundary of the figure
+ * @param pixel_height height of one pixel
+ * @return m the sum of the indexes of two mirrored rows, or -1 if the
+ *		   window has no usable symmetry
+ */
+int mirror_axis(double c_y_min, double c_y_max, double pixel_height)
+{
+	double m;
+	int r;
+
+	if(c_y_min>=0 || c_y_max<=0)
+		return -1;
+
+	m = 2*c_y_max/pixel_height;
+	r = (int)(m+0.5);
+	if(m-r>1e-6 || r-m>1e-6)
+		return -1;
+
+	return r;
+}
+
+
+/**
+ * @brief Count the rows that must really be computed
+ *
+ * Rows in (m/2, m] are copies of rows [0, m/2), everything else is unique.
+ *
+ * @param m axis returned by mirror_axis
+ * @param image_size the resolution of the image
+ * @return the number of unique rows
+ */
+int unique_rows(int m, int image_size)
+{
+	int last;
+
+	if(m<0)
+		return image_size;
+
+	last = m<image_size-1 ? m : image_size-1;
+	return last>m/2 ? image_size-(last-m/2) : image_size;
+}
+
+
+/**
+ * @brief Map the k-th unique row to its row in the image
+ *
+ * @param k index among the unique rows
+ * @param m axis returned by mirror_axis
+ * @return the row of the image
+ */
+int unique_row(int k, int m)
+{
+	if(m<0 || k<=m/2)
+		return k;
+	return k+m-m/2;
+}
+
+
+/**
+ * @brief Find the row that is a copy of row i
+ *
+ * @param i row of the image
+ * @param m axis returned by mirror_axis
+ * @param image_size the resolution of the image
+ * @return the mirrored row, or -1 if row i has no distinct mirror
+ */
+int mirror_row(int i, int m, int image_size)
+{
+	if(m<0 || 2*i>=m || m-i>=image_size)
+		return -1;
+	return m-i;
+}
+
+
+/**
+ * @brief Write the whole buffer at the given file offset
+ *
+ * Uses pwrite on the raw file descriptor, so there is no stdio buffering
+ * and no shared file position between the processes. Aborts every process
+ * if the write fails.
+ *
+ * @param fd destination file descriptor
+ * @param buf data to be written
+ * @param len number of bytes to be written
+ * @param off offset of the first byte in the file
+ */
+void pwrite_all(int fd, const unsigned char *buf, size_t len, off_t off)
+{
+	ssize_t n;
+
+	while(len>0)
+	{
+		n = pwrite(fd, buf, len, off);
+		if(n<=0)
+		{
+			perror("Unable to write the image");
+			MPI_Abort(MPI_COMM_WORLD, 1);
+		}
+		buf += n;
+		len -= n;
+		off += n;
+	}
+}
+
+
+/**
+ * @brief Create the image file shared by every process
+ *
+ * Process zero creates (truncating) the file, writes the header and sets
+ * the final size, optionally reserving its blocks. Only after that the
+ * other processes open it, so no truncation can race with a row write.
+ *
+ * @param name path of the image
+ * @param image_size the resolution of the image
+ * @param rank rank of the calling process
+ * @param reserve whether posix_fallocate should be used
+ * @param hdr returns the size of the header
+ * @return fd the file descriptor opened for reading and writing
+ */
+int open_image(const char *name, int image_size, int rank, int reserve, int *hdr)
+{
+	char header[64];
+	off_t total;
+	int fd, err;
+
+	*hdr = snprintf(header, sizeof(header), "P6\n%d %d 255\n", image_size, image_size);
+	total = *hdr+(off_t)3*image_size*image_size;
+	err = 0;
+
+	if(rank==0)
+	{
+		// posix_fallocate returns its error instead of setting errno, and
+		// the error is reported before MPI_Bcast can change errno
+		fd = open(name, O_RDWR|O_CREAT|O_TRUNC, 0644);
+		if(fd<0)
+			err = errno;
+		else if(reserve)
+			err = posix_fallocate(fd, 0, total);
+		if(!err && ftruncate(fd, total))
+			err = errno;
+
+		if(err)
+			fprintf(stderr, "Unable to create the image: %s\n", strerror(err));
+		else
+			pwrite_all(fd, (unsigned char *)header, *hdr, 0);
+	}
+
+	MPI_Bcast(&err, 1, MPI_INT, 0, MPI_COMM_WORLD);
+	if(err)
+	{
+		MPI_Finalize();
+		exit(1);
+	}
+
+	if(rank!=0)
+		fd = open(name, O_RDWR);
+	if(fd<0)
+	{
+		perror("Unable to open the image");
+		MPI_Abort(MPI_COMM_WORLD, 1);
+	}
+
+	return fd;
+}
+
+
+/**
+ * @brief Map the whole image file (shared) in memory
+ *
+ * The rows of the processes are interleaved, so no read ahead is wanted.
+ *
+ * @param fd descriptor returned by open_image
+ * @param total size of the whole file
+ * @return map pointer to the first byte of the file
+ */
+unsigned char *map_image(int fd, size_t total)
+{
+	unsigned char *map;
+
+	map = mmap(NULL, total, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	if(map==MAP_FAILED)
+	{
+		perror("Unable to map the image");
+		MPI_Abort(MPI_COMM_WORLD, 1);
+	}
+
+	// Rows of the process are interleaved with the others' ones
+	madvise(map, total, MADV_RANDOM);
+
+	return map;
+}
+
+
+/**
+ * @brief Schedule the write back of the image and unmap it
+ *
+ * @param map pointer returned by map_image
+ * @param total size of the whole file
+ */
+void unmap_image(unsigned char *map, size_t total)
+{
+	msync(map, total, MS_ASYNC);
+	munmap(map, total);
+}
+
+
+/**
+ * @brief Files and counters of the --costmap instrumentation
+ */
+struct costmap
+{
+	int cost_fd;
+	int owner_fd;
+	int hdr;
+	unsigned char *line;
+	double totals[3];
+};
+
+
+/**
+ * @brief Create the cost and ownership images of --costmap
+ *
+ * @param cm costmap to initialize
+ * @param cost_name path of the cost image
+ * @param owner_name path of the ownership image
+ * @param image_size the resolution of the image
+ * @param rank rank of the calling process
+ */
+void costmap_open(struct costmap *cm, const char *cost_name, const char *owner_name, int image_size, int rank)
+{
+	cm->cost_fd = open_image(cost_name, image_size, rank, 0, &cm->hdr);
+	cm->owner_fd = open_image(owner_name, image_size, rank, 0, &cm->hdr);
+	cm->line = malloc(3*image_size*sizeof(unsigned char));
+	cm->totals[0] = cm->totals[1] = cm->totals[2] = 0;
+}
+
+
+/**
+ * @brief Heat color of the iterations spent on one pixel
+ *
+ * Black for no iteration, then red, yellow and white for MAX_ITER.
+ *
+ * @param px pointer to the 3 bytes (RGB) of the pixel
+ * @param iter number of iterations computed for the pixel
+ */
+void cost_color(unsigned char *px, int iter)
+{
+	int v;
+
+	v = 765*iter/MAX_ITER;
+	px[0] = v>255 ? 255 : v;
+	px[1] = v>510 ? 255 : (v>255 ? v-255 : 0);
+	px[2] = v>510 ? v-510 : 0;
+}
+
+
+/**
+ * @brief Color of a rank in the ownership image
+ *
+ * The ranks are spread over the hue circle, mirrored rows (written but not
+ * computed by the rank) are drawn at half brightness.
+ *
+ * @param px pointer to the 3 bytes (RGB) of the pixel
+ * @param rank rank that owns the row
+ * @param nproc number of processes
+ * @param mirrored whether the row is a mirrored copy
+ */
+void owner_color(unsigned char *px, int rank, int nproc, int mirrored)
+{
+	int h, f, v, k;
+
+	h = 6*255*rank/nproc;
+	f = h%255;
+	v = mirrored ? 127 : 255;
+	for(k=0; k<3; k++)
+	{
+		// Sector of the hue for each channel, red leading
+		switch((h/255+6-2*k)%6)
+		{
+			case 0: case 5: px[k] = v; break;
+			case 1: px[k] = v*(255-f)/255; break;
+			case 4: px[k] = v*f/255; break;
+			default: px[k] = 0;
+		}
+	}
+}
+
+
+/**
+ * @brief Record one computed row in the cost and ownership images
+ *
+ * @param cm costmap opened by costmap_open
+ * @param row iterations of every pixel of the row
+ * @param image_size the resolution of the image
+ * @param i row of the image
+ * @param r mirrored row of i, -1 if none
+ * @param rank rank of the calling process
+ * @param nproc number of processes
+ * @param seconds time spent computing the row
+ */
+void costmap_row(struct costmap *cm, const int *row, int image_size, int i, int r,
+	int rank, int nproc, double seconds)
+{
+	int j;
+	long iters;
+
+	iters = 0;
+	for(j=0; j<image_size; j++)
+	{
+		cost_color(cm->line+3*j, row[j]);
+		iters += row[j];
+	}
+	pwrite_all(cm->cost_fd, cm->line, 3*image_size, cm->hdr+(off_t)3*image_size*i);
+
+	// A mirrored row costs nothing, it stays black in the cost image
+	if(r>=0)
+	{
+		memset(cm->line, 0, 3*image_size);
+		pwrite_all(cm->cost_fd, cm->line, 3*image_size, cm->hdr+(off_t)3*image_size*r);
+		for(j=0; j<image_size; j++)
+			owner_color(cm->line+3*j, rank, nproc, 1);
+		pwrite_all(cm->owner_fd, cm->line, 3*image_size, cm->hdr+(off_t)3*image_size*r);
+	}
+
+	for(j=0; j<image_size; j++)
+		owner_color(cm->line+3*j, rank, nproc, 0);
+	pwrite_all(cm->owner_fd, cm->line, 3*image_size, cm->hdr+(off_t)3*image_size*i);
+
+	cm->totals[0] += 1;
+	cm->totals[1] += iters;
+	cm->totals[2] += seconds;
+}
+
+
+/**
+ * @brief Close the images of --costmap and report the totals of every rank
+ *
+ * The rows, iterations and compute time of every rank are gathered on
+ * process zero, which prints them with the imbalance (slowest rank over
+ * the mean) of the iterations and of the time.
+ *
+ * @param cm costmap opened by costmap_open
+ * @param rank rank of the calling process
+ * @param nproc number of processes
+ */
+void costmap_close(struct costmap *cm, int rank, int nproc)
+{
+	int p;
+	double *all, top[2], sum[2];
+
+	close(cm->cost_fd);
+	close(cm->owner_fd);
+	free(cm->line);
+
+	all = NULL;
+	if(rank==0)
+		all = malloc(3*nproc*sizeof(double));
+	MPI_Gather(cm->totals, 3, MPI_DOUBLE, all, 3, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+	if(rank!=0)
+		return;
+
+	top[0] = top[1] = sum[0] = sum[1] = 0;
+	printf("rank       rows      iterations     seconds\n");
+	for(p=0; p<nproc; p++)
+	{
+		printf("%4d %10.0f %15.0f %11.4f\n", p, all[3*p], all[3*p+1], all[3*p+2]);
+		sum[0] += all[3*p+1];
+		sum[1] += all[3*p+2];
+		if(all[3*p+1]>top[0])
+			top[0] = all[3*p+1];
+		if(all[3*p+2]>top[1])
+			top[1] = all[3*p+2];
+	}
+	printf("imbalance (max/mean): iterations %.3f, seconds %.3f\n",
+		sum[0]>0 ? top[0]*nproc/sum[0] : 1.0, sum[1]>0 ? top[1]*nproc/sum[1] : 1.0);
+	free(all);
+}
+
+
 int main(int argc, char** argv)
 {
 	double c_x_min, c_x_max, c_y_min, c_y_max, pixel_width, pixel_height;
-	int i, j, image_size, i_x_max, i_y_max, rank, nproc, hdr, *row;
-	unsigned char *line;
+	int i, j, image_size, i_x_max, i_y_max, rank, nproc, hdr, reserve, use_mmap, fd, *row;
+	int k, m, r, nunique, use_costmap;
+	double t0;
+	unsigned char *line, *buffer, *map;
+	size_t total;
 	complex z;
-	FILE *img;
+	struct formula formula;
+	struct costmap cm;
 
 	MPI_Init(NULL, NULL);
 	MPI_Comm_size(MPI_COMM_WORLD, &nproc);
@@ -122,25 +656,62 @@ int main(int argc, char** argv)
         pixel_height      = (c_y_max - c_y_min) / i_y_max;
     }
 
-	row = malloc(image_size*sizeof(int));
-	line = malloc(3*image_size*sizeof(unsigned char));
-	img=fopen("mandelbrot_mpi_op.ppm","w");
-
-	MPI_Barrier(MPI_COMM_WORLD);
+	reserve = 0;
+	use_mmap = 0;
+	use_costmap = 0;
+	formula.power = 2;
+	formula.julia = 0;
+	formula.c = 0;
+	for(i=6; i<argc; i++)
+	{
+		if(strcmp(argv[i], "--fallocate")==0)
+			reserve = 1;
+		else if(strcmp(argv[i], "--mmap")==0)
+			use_mmap = 1;
+		else if(strcmp(argv[i], "--costmap")==0)
+			use_costmap = 1;
+		else if(parse_formula(argv[i], &formula))
+			continue;
+		else
+		{
+			if(rank==0)
+				print_instructions();
+			MPI_Finalize();
+			exit(1);
+		}
+	}
 
-	if(rank==0)
-		hdr = fprintf(img, "P6\n%d %d 255\n", image_size, image_size);
+	row = malloc(image_size*sizeof(int));
+	buffer = malloc(3*image_size*sizeof(unsigned char));
+	fd = open_image("mandelbrot_mpi_op.ppm", image_size, rank, reserve, &hdr);
+	total = hdr+(size_t)3*image_size*image_size;
+	if(use_mmap)
+		map = map_image(fd, total);
+	if(use_costmap)
+		costmap_open(&cm, "mandelbrot_mpi_op_cost.ppm", "mandelbrot_mpi_op_owner.ppm", image_size, rank);
 
-	MPI_Bcast(&hdr, 1, MPI_INT, 0, MPI_COMM_WORLD);
+	select_formula(&formula);
+	m = formula_symmetric(&formula) ? mirror_axis(c_y_min, c_y_max, pixel_height) : -1;
+	nunique = unique_rows(m, image_size);
 
-	for(i=rank; i<image_size; i+=nproc)
+	for(k=rank; k<nunique; k+=nproc)
 	{
+		i = unique_row(k, m);
+
+		t0 = MPI_Wtime();
 		for(j=0; j<i_x_max; j++)
 		{
 			z=c_x_min+j*(pixel_width)+(c_y_max-i*(pixel_height))*I;
-			row[j]=mandelbrot(z);
+			row[j]=formula_point(&formula, z);
 		}
+		if(use_costmap)
+			costmap_row(&cm, row, image_size, i, mirror_row(i, m, image_size), rank, nproc, MPI_Wtime()-t0);
 
+		// With --mmap the colors go straight to the row in the file
+		if(use_mmap)
+			line = map+hdr+(size_t)3*image_size*i;
+		else
+			line = buffer;
 		for(j=0; j<image_size; j++)
 		{
 			if(row[j]<=63)
@@ -163,10 +734,25 @@ int main(int argc, char** argv)
 			}
 		}
 
-		fseek(img, hdr+3*image_size*i, SEEK_SET);
-		fwrite(line, 1, 3*image_size, img);
+		r = mirror_row(i, m, image_size);
+		if(use_mmap)
+		{
+			if(r>=0)
+				memcpy(map+hdr+(size_t)3*image_size*r, line, 3*image_size);
+		}
+		else
+		{
+			pwrite_all(fd, line, 3*image_size, hdr+(off_t)3*image_size*i);
+			if(r>=0)
+				pwrite_all(fd, line, 3*image_size, hdr+(off_t)3*image_size*r);
+		}
 	}
 
+	if(use_mmap)
+		unmap_image(map, total);
+	close(fd);
+	if(use_costmap)
+		costmap_close(&cm, rank, nproc);
 	MPI_Finalize();
 	return 0;
 }
@@ -6,12 +6,45 @@
  *  MJ Rutter (https://www.tcm.phy.cam.ac.uk/~mjr/courses/MPI/MPI.pdf)
  *
  *	Usage:
- *    ./mandelbrot_seq c_x_min c_x_max c_y_min c_y_max image_size
+ *    ./mandelbrot_seq c_x_min c_x_max c_y_min c_y_max image_size [options]
  *		- c_x_min: Lowest x boundary for the figure to be computed
  *		- c_x_max: Highest x boundary for the figure to be computed
  *		- c_y_mix: Lowest y boundary for the figure to be computed
  *		- c_y_max: Highest y boundary for the figure to be computed
  *		- image_size: The resolution of the resulting image
+ *	Options:
+ *		- --progressive: Render coarse-to-fine (1/8, 1/4, 1/2 and full
+ *		  resolution), writing mandelbrot_seq_preview_N.ppm (1/N of the
+ *		  resolution) as soon as each level is done. Finer levels only
+ *		  compute the samples that were not computed by coarser ones
+ *		- --mmap: Size the image up front and map it in memory, so the color
+ *		  stage writes the RGB bytes straight into the file pages (no row
+ *		  buffer and no stdio copies). Ignored with --progressive or --aa
+ *		- --aa=N: Adaptive anti-aliasing. The image is rendered at 1x in
+ *		  blocks of AA_TILE_ROWS rows and only the pixels whose neighbors are
+ *		  in a different iteration band are refined with NxN samples. The
+ *		  fraction of refined pixels is reported at the end
+ *		- --histogram: Smooth coloring with a histogram-equalized palette. A
+ *		  first pass keeps the fractional escape time of every pixel in 16
+ *		  bits and builds their histogram, a second pass colors the pixels
+ *		  from its cumulative distribution without recomputing the fractal
+ *		- --precision=auto|float|double|long: Arithmetic of the kernel
+ *		  (default double). auto takes single precision while the pixel
+ *		  spacing is well above float epsilon, then double, then long double
+ *		  as the window narrows. Only used by the plain render
+ *		- --validate: Compute the window with both the float and the double
+ *		  kernels and report how many pixels differ and the time of each
+ *		  (e.g. ./mandelbrot_seq -0.8 -0.7 0.05 0.15 4096 --validate). On the
+ *		  four example regions below float differs on less than 1% of the
+ *		  pixels, all of them on the boundary of the set
+ *		- --power=d: Iterate z^d+c (Multibrot set) instead of z^2+c
+ *		- --julia=re,im: Render the Julia set of the constant re+im*i (with
+ *		  the power of --power) instead of the Mandelbrot set
+ *
+ *	When the window straddles the real axis on mirrored row positions (as
+ *	the Full Picture does) only the unique rows are computed and each of
+ *	them is also written to its mirrored row (except with --progressive,
+ *	--aa or --histogram).
  *  Usage examples:
  *      Full Picture:         ./mandelbrot_seq -2.5 1.5 -2.0 2.0 11500
  *      Seahorse Valley:      ./mandelbrot_seq -0.8 -0.7 0.05 0.15 11500
@@ -32,42 +65,460 @@
  * 	@copyright	GNU Public License v3
  */
 
+#define _DEFAULT_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <float.h>
 #include <complex.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
 
 #define MAX_ITER 300
 #define ESCAPE_RADIUS_SQUARED 4
+#define PROGRESSIVE_STEP 8
+#define AA_TILE_ROWS 32
+#define AA_BAND 8
+#define SMOOTH_RADIUS_SQUARED 256
+#define SMOOTH_SCALE 64
+#define SMOOTH_INSIDE 0xFFFF
+#define PRECISION_AUTO -1
+#define PRECISION_FLOAT 0
+#define PRECISION_DOUBLE 1
+#define PRECISION_LONG 2
+#define PRECISION_MARGIN 1024
 
 
 /**
- * @brief Perform the calculations for the set until divergence or MAX_ITER 
+ * @brief Generate an escape time kernel for one fixed formula
  *
- * For the complex number z0, it performs the Mandelbrot calculation until it
- * reaches divergence or it reaches the maximum number of iterations,
- * whichever happens first, returning the number of iterations until divergence
- * or MAX_ITER
+ * Every kernel iterates z from the given point adding the constant c,
+ * which is the point itself for the Multibrot sets and a fixed constant
+ * for the Julia sets. The step is pasted into the loop, so each power is
+ * compiled on its own with no branch on the formula while iterating.
  *
- * @param z0 complex number to perform the Mandelbrot calculations
+ * @param name name of the generated function
+ * @param step update of z (and temporaries) for one iteration
+ */
+#define FORMULA_KERNEL(name, step) \
+int name(complex z, complex c, int power) \
+{ \
+	int i; \
+	complex w; \
+ \
+	(void)power; \
+	(void)w; \
+	for(i=1; i<MAX_ITER; i++) \
+	{ \
+		step; \
+		if((creal(z)*creal(z))+(cimag(z)*cimag(z))>ESCAPE_RADIUS_SQUARED) \
+			break; \
+	} \
+ \
+	return i; \
+}
+
+FORMULA_KERNEL(formula_power2, z=z*z+c)
+FORMULA_KERNEL(formula_power3, z=z*z*z+c)
+FORMULA_KERNEL(formula_power4, w=z*z; z=w*w+c)
+FORMULA_KERNEL(formula_power5, w=z*z; z=w*w*z+c)
+FORMULA_KERNEL(formula_power6, w=z*z*z; z=w*w+c)
+
+
+/**
+ * @brief Escape time kernel of z^power+c for the powers without a
+ * specialized kernel
+ *
+ * @param z starting point of the orbit
+ * @param c constant added at every iteration
+ * @param power exponent of z
  * @return i integer with the number of iterations until divergerce or MAX_ITER
  */
-int mandelbrot(complex z0)
+int formula_generic(complex z, complex c, int power)
 {
-	int i;
-	complex z;
+	int i, k;
+	complex w;
 
-	z = z0;
 	for(i=1; i<MAX_ITER; i++)
 	{
-		z=z*z+z0;
+		w = z;
+		for(k=1; k<power; k++)
+			w *= z;
+		z = w+c;
 		if((creal(z)*creal(z))+(cimag(z)*cimag(z))>ESCAPE_RADIUS_SQUARED)
 			break;
-  	}
+	}
 
 	return i;
 }
 
 
+/**
+ * @brief Formula selected on the command line
+ */
+struct formula
+{
+	int (*kernel)(complex z, complex c, int power);
+	int power;
+	int julia;
+	complex c;
+};
+
+
+/**
+ * @brief Parse the --power=d and --julia=re,im options
+ *
+ * @param arg command line argument
+ * @param f formula updated with the option
+ * @return 1 if arg was a formula option, 0 otherwise
+ */
+int parse_formula(const char *arg, struct formula *f)
+{
+	double re, im;
+
+	if(strncmp(arg, "--power=", 8)==0 && sscanf(arg+8, "%d", &f->power)==1 && f->power>=2)
+		return 1;
+	if(strncmp(arg, "--julia=", 8)==0 && sscanf(arg+8, "%lf,%lf", &re, &im)==2)
+	{
+		f->julia = 1;
+		f->c = re+im*I;
+		return 1;
+	}
+	return 0;
+}
+
+
+/**
+ * @brief Pick the kernel for the power of the formula
+ *
+ * @param f formula whose kernel is set
+ */
+void select_formula(struct formula *f)
+{
+	switch(f->power)
+	{
+		case 2: f->kernel = formula_power2; break;
+		case 3: f->kernel = formula_power3; break;
+		case 4: f->kernel = formula_power4; break;
+		case 5: f->kernel = formula_power5; break;
+		case 6: f->kernel = formula_power6; break;
+		default: f->kernel = formula_generic;
+	}
+}
+
+
+/**
+ * @brief Number of iterations of one point with the selected formula
+ *
+ * @param f formula selected by select_formula
+ * @param z point of the complex plane
+ * @return i integer with the number of iterations until divergerce or MAX_ITER
+ */
+int formula_point(const struct formula *f, complex z)
+{
+	return f->kernel(z, f->julia ? f->c : z, f->power);
+}
+
+
+/**
+ * @brief Whether the image of the formula is symmetric about the real axis
+ *
+ * The Multibrot sets and the Julia sets of a real constant are their own
+ * complex conjugate, the other Julia sets are not.
+ *
+ * @param f formula selected on the command line
+ * @return 1 if the rows mirrored about the real axis are equal
+ */
+int formula_symmetric(const struct formula *f)
+{
+	return !f->julia || cimag(f->c)==0;
+}
+
+
+/**
+ * @brief Fractional escape time of a point (smooth coloring)
+ *
+ * Same iteration of formula_point(), but with a larger escape radius so
+ * that the continuous count n+1-log_d(log|z|) (d the power of the formula)
+ * is free of visible steps.
+ *
+ * @param f formula selected by select_formula
+ * @param z point of the complex plane
+ * @return the fractional number of iterations or MAX_ITER for points of
+ *		   the set
+ */
+double formula_smooth(const struct formula *f, complex z)
+{
+	int i, k;
+	double mu;
+	complex c, w;
+
+	c = f->julia ? f->c : z;
+	for(i=1; i<MAX_ITER; i++)
+	{
+		w = z;
+		for(k=1; k<f->power; k++)
+			w *= z;
+		z = w+c;
+		if((creal(z)*creal(z))+(cimag(z)*cimag(z))>SMOOTH_RADIUS_SQUARED)
+			break;
+	}
+
+	if(i==MAX_ITER)
+		return MAX_ITER;
+
+	mu = i+1-log2(log(cabs(z)))/log2(f->power);
+	return mu<0 ? 0 : (mu>=MAX_ITER ? MAX_ITER-1e-3 : mu);
+}
+
+
+/**
+ * @brief Pack a fractional escape time in 16 bits
+ *
+ * @param mu value returned by formula_smooth
+ * @return mu in fixed point with SMOOTH_SCALE steps per iteration, or
+ *		   SMOOTH_INSIDE for points of the set
+ */
+unsigned short pack_smooth(double mu)
+{
+	if(mu>=MAX_ITER)
+		return SMOOTH_INSIDE;
+	return (unsigned short)(mu*SMOOTH_SCALE);
+}
+
+
+/**
+ * @brief Color one pixel from the cumulative distribution of escape times
+ *
+ * The integer part of the escape time selects the bin of the histogram and
+ * the fractional part interpolates to the next bin, so the palette is used
+ * evenly (histogram equalization) and without bands.
+ *
+ * @param px pointer to the 3 bytes (RGB) of the pixel
+ * @param v packed escape time of the pixel
+ * @param cdf fraction of the escaping pixels below each bin (MAX_ITER+1)
+ */
+void set_smooth_color(unsigned char *px, unsigned short v, const double *cdf)
+{
+	int n;
+	double t;
+
+	if(v==SMOOTH_INSIDE)
+	{
+		px[0]=255;
+		px[1]=255;
+		px[2]=255;
+		return;
+	}
+
+	n = v/SMOOTH_SCALE;
+	t = cdf[n]+(cdf[n+1]-cdf[n])*(v%SMOOTH_SCALE)/SMOOTH_SCALE;
+
+	// Same hues of the fixed color scheme: white to red to yellow
+	px[0]=255;
+	if(t<0.5)
+	{
+		px[1]=(unsigned char)(255*(1-2*t));
+		px[2]=px[1];
+	}
+	else
+	{
+		px[1]=(unsigned char)(255*(2*t-1));
+		px[2]=0;
+	}
+}
+
+
+/**
+ * @brief Turn a histogram of escape times into its cumulative distribution
+ *
+ * @param hist number of escaping pixels in each bin (MAX_ITER bins)
+ * @param cdf output with MAX_ITER+1 entries, from 0 to 1
+ */
+void histogram_cdf(const long *hist, double *cdf)
+{
+	long total, acc;
+	int n;
+
+	for(n=0, total=0; n<MAX_ITER; n++)
+		total += hist[n];
+
+	cdf[0] = 0;
+	for(n=0, acc=0; n<MAX_ITER; n++)
+	{
+		acc += hist[n];
+		cdf[n+1] = total ? (double)acc/total : 0;
+	}
+}
+
+
+/**
+ * @brief Single precision version of formula_power2() for wide windows
+ *
+ * @param x0 real part of the point
+ * @param y0 imaginary part of the point
+ * @return i integer with the number of iterations until divergerce or MAX_ITER
+ */
+int mandelbrot_float(float x0, float y0)
+{
+	int i;
+	float x, y, xx, yy;
+
+	x = x0;
+	y = y0;
+	for(i=1; i<MAX_ITER; i++)
+	{
+		xx = x*x;
+		yy = y*y;
+		y = 2*x*y+y0;
+		x = xx-yy+x0;
+		if(x*x+y*y>ESCAPE_RADIUS_SQUARED)
+			break;
+	}
+
+	return i;
+}
+
+
+/**
+ * @brief Extended precision version of formula_power2() for deep zooms
+ *
+ * @param x0 real part of the point
+ * @param y0 imaginary part of the point
+ * @return i integer with the number of iterations until divergerce or MAX_ITER
+ */
+int mandelbrot_long(long double x0, long double y0)
+{
+	int i;
+	long double x, y, xx, yy;
+
+	x = x0;
+	y = y0;
+	for(i=1; i<MAX_ITER; i++)
+	{
+		xx = x*x;
+		yy = y*y;
+		y = 2*x*y+y0;
+		x = xx-yy+x0;
+		if(x*x+y*y>ESCAPE_RADIUS_SQUARED)
+			break;
+	}
+
+	return i;
+}
+
+
+/**
+ * @brief Choose the cheapest precision able to resolve the pixels
+ *
+ * A precision is used when the pixel spacing is at least PRECISION_MARGIN
+ * times its epsilon relative to the magnitude of the points (never less
+ * than the escape radius, which every escaping orbit reaches).
+ *
+ * @param c_x_min lowest x boundary of the figure
+ * @param c_x_max highest x boundary of the figure
+ * @param c_y_min lowest y boundary of the figure
+ * @param c_y_max highest y boundary of the figure
+ * @param pixel_width width of one pixel
+ * @param pixel_height height of one pixel
+ * @return PRECISION_FLOAT, PRECISION_DOUBLE or PRECISION_LONG
+ */
+int select_precision(double c_x_min, double c_x_max, double c_y_min,
+	double c_y_max, double pixel_width, double pixel_height)
+{
+	double scale, spacing;
+
+	scale = 2;
+	if(fabs(c_x_min)>scale)
+		scale = fabs(c_x_min);
+	if(fabs(c_x_max)>scale)
+		scale = fabs(c_x_max);
+	if(fabs(c_y_min)>scale)
+		scale = fabs(c_y_min);
+	if(fabs(c_y_max)>scale)
+		scale = fabs(c_y_max);
+
+	spacing = fabs(pixel_width)<fabs(pixel_height) ? fabs(pixel_width) : fabs(pixel_height);
+
+	if(spacing>scale*FLT_EPSILON*PRECISION_MARGIN)
+		return PRECISION_FLOAT;
+	if(spacing>scale*DBL_EPSILON*PRECISION_MARGIN)
+		return PRECISION_DOUBLE;
+	return PRECISION_LONG;
+}
+
+
+/**
+ * @brief Parse the window again in extended precision
+ *
+ * @param argv command line arguments (window and image_size)
+ * @param lwin output with c_x_min, c_y_max, pixel_width and pixel_height
+ */
+void parse_long_window(char **argv, long double *lwin)
+{
+	long double c_x_min, c_x_max, c_y_min, c_y_max;
+	int image_size;
+
+	sscanf(argv[1], "%Lf", &c_x_min);
+	sscanf(argv[2], "%Lf", &c_x_max);
+	sscanf(argv[3], "%Lf", &c_y_min);
+	sscanf(argv[4], "%Lf", &c_y_max);
+	sscanf(argv[5], "%d", &image_size);
+
+	lwin[0] = c_x_min;
+	lwin[1] = c_y_max;
+	lwin[2] = (c_x_max-c_x_min)/image_size;
+	lwin[3] = (c_y_max-c_y_min)/image_size;
+}
+
+
+/**
+ * @brief Compute the iterations of one row with the chosen precision
+ *
+ * @param precision PRECISION_FLOAT, PRECISION_DOUBLE or PRECISION_LONG
+ * @param i row of the image
+ * @param image_size the resolution of the image
+ * @param c_x_min lowest x boundary of the figure
+ * @param c_y_max highest y boundary of the figure
+ * @param pixel_width width of one pixel
+ * @param pixel_height height of one pixel
+ * @param lwin window parsed by parse_long_window (used by PRECISION_LONG)
+ * @param formula formula iterated by the double precision kernel
+ * @param row output with the iterations of every pixel of the row
+ */
+void compute_row(int precision, int i, int image_size, double c_x_min,
+	double c_y_max, double pixel_width, double pixel_height,
+	const long double *lwin, const struct formula *formula, int *row)
+{
+	int j;
+	float y;
+	complex z;
+
+	switch(precision)
+	{
+		case PRECISION_FLOAT:
+			y = c_y_max-i*pixel_height;
+			for(j=0; j<image_size; j++)
+				row[j]=mandelbrot_float(c_x_min+j*pixel_width, y);
+			break;
+		case PRECISION_LONG:
+			for(j=0; j<image_size; j++)
+				row[j]=mandelbrot_long(lwin[0]+j*lwin[2], lwin[1]-i*lwin[3]);
+			break;
+		default:
+			for(j=0; j<image_size; j++)
+			{
+				z=c_x_min+j*(pixel_width)+(c_y_max-i*(pixel_height))*I;
+				row[j]=formula_point(formula, z);
+			}
+	}
+}
+
+
 /**
  * @brief Function responsible for printing usage instructions
  *
@@ -76,7 +527,8 @@ int mandelbrot(complex z0)
  */
 void print_instructions()
 {
-	printf("usage: ./mandelbrot_seq c_x_min c_x_max c_y_min c_y_max image_size\n");
+	printf("usage: ./mandelbrot_seq c_x_min c_x_max c_y_min c_y_max image_size [--progressive] [--mmap] [--aa=N] [--histogram]\n");
+	printf("    [--precision=auto|float|double|long] [--validate] [--power=d] [--julia=re,im]\n");
 	printf("examples with image_size = 11500:\n");
 	printf("    Full Picture:         ./mandelbrot_seq -2.5 1.5 -2.0 2.0 11500\n");
 	printf("    Seahorse Valley:      ./mandelbrot_seq -0.8 -0.7 0.05 0.15 11500\n");
@@ -85,12 +537,525 @@ void print_instructions()
 }
 
 
-int main(int argc, char** argv)
+/**
+ * @brief Find the axis of the conjugate symmetry of the image
+ *
+ * The set is symmetric about the real axis, so when the window straddles it
+ * and the rows fall on mirrored positions, row i and row m-i have the same
+ * pixels. Such rows are computed once and written twice.
+ *
+ * @param c_y_min lowest y boundary of the figure
+ * @param c_y_max highest y boundary of the figure
+ * @param pixel_height height of one pixel
+ * @return m the sum of the indexes of two mirrored rows, or -1 if the
+ *		   window has no usable symmetry
+ */
+int mirror_axis(double c_y_min, double c_y_max, double pixel_height)
 {
-	double c_x_min, c_x_max, c_y_min, c_y_max, pixel_width, pixel_height;
-	int i, j, image_size, i_x_max, i_y_max, *row;
+	double m;
+	int r;
+
+	if(c_y_min>=0 || c_y_max<=0)
+		return -1;
+
+	m = 2*c_y_max/pixel_height;
+	r = (int)(m+0.5);
+	if(m-r>1e-6 || r-m>1e-6)
+		return -1;
+
+	return r;
+}
+
+
+/**
+ * @brief Count the rows that must really be computed
+ *
+ * Rows in (m/2, m] are copies of rows [0, m/2), everything else is unique.
+ *
+ * @param m axis returned by mirror_axis
+ * @param image_size the resolution of the image
+ * @return the number of unique rows
+ */
+int unique_rows(int m, int image_size)
+{
+	int last;
+
+	if(m<0)
+		return image_size;
+
+	last = m<image_size-1 ? m : image_size-1;
+	return last>m/2 ? image_size-(last-m/2) : image_size;
+}
+
+
+/**
+ * @brief Map the k-th unique row to its row in the image
+ *
+ * @param k index among the unique rows
+ * @param m axis returned by mirror_axis
+ * @return the row of the image
+ */
+int unique_row(int k, int m)
+{
+	if(m<0 || k<=m/2)
+		return k;
+	return k+m-m/2;
+}
+
+
+/**
+ * @brief Find the row that is a copy of row i
+ *
+ * @param i row of the image
+ * @param m axis returned by mirror_axis
+ * @param image_size the resolution of the image
+ * @return the mirrored row, or -1 if row i has no distinct mirror
+ */
+int mirror_row(int i, int m, int image_size)
+{
+	if(m<0 || 2*i>=m || m-i>=image_size)
+		return -1;
+	return m-i;
+}
+
+
+/**
+ * @brief Apply the fixed color scheme to one pixel
+ *
+ * @param px pointer to the 3 bytes (RGB) of the pixel
+ * @param iter number of iterations computed for the pixel
+ */
+void set_color(unsigned char *px, int iter)
+{
+	if(iter==MAX_ITER)
+	{
+		px[0]=255;
+		px[1]=255;
+		px[2]=255;
+	}
+	else if(iter<=63)
+	{
+		px[0]=255;
+		px[1]=255-4*iter;
+		px[2]=255-4*iter;
+	}
+	else
+	{
+		px[0]=255;
+		px[1]=iter-63;
+		px[2]=0;
+	}
+}
+
+
+/**
+ * @brief Iteration band used to detect the pixels that need supersampling
+ *
+ * @param iter number of iterations computed for the pixel
+ * @return the band of the pixel (points of the set have their own band)
+ */
+int aa_band(int iter)
+{
+	return iter==MAX_ITER ? -1 : iter/AA_BAND;
+}
+
+
+/**
+ * @brief Render a block of pixels with adaptive supersampling
+ *
+ * The block and a one pixel halo around it are computed at 1x. Only the
+ * pixels with a 4-neighbor in a different iteration band are refined with
+ * aa x aa samples, whose colors are averaged, so the extra cost follows the
+ * length of the boundaries inside the block instead of its area.
+ *
+ * @param c_x_min x of the sample of column 0
+ * @param c_y_max y of the sample of row 0
+ * @param pixel_width width of one pixel
+ * @param pixel_height height of one pixel
+ * @param r0 first row of the block
+ * @param c0 first column of the block
+ * @param h number of rows of the block
+ * @param w number of columns of the block
+ * @param aa number of samples per side of a refined pixel
+ * @param formula formula selected on the command line
+ * @param iters scratch buffer of (h+2)*(w+2) integers
+ * @param rgb output buffer of 3*w*h bytes
+ * @return the number of refined pixels
+ */
+long render_aa_block(double c_x_min, double c_y_max, double pixel_width,
+	double pixel_height, int r0, int c0, int h, int w, int aa,
+	const struct formula *formula, int *iters, unsigned char *rgb)
+{
+	int i, j, a, b, band, sum[3];
+	unsigned char px[3];
+	long refined;
+	complex z;
+
+	for(i=-1; i<=h; i++)
+		for(j=-1; j<=w; j++)
+		{
+			z=c_x_min+(c0+j)*(pixel_width)+(c_y_max-(r0+i)*(pixel_height))*I;
+			iters[(i+1)*(w+2)+j+1]=formula_point(formula, z);
+		}
+
+	refined = 0;
+	for(i=0; i<h; i++)
+		for(j=0; j<w; j++)
+		{
+			band = aa_band(iters[(i+1)*(w+2)+j+1]);
+			if(band==aa_band(iters[i*(w+2)+j+1]) && band==aa_band(iters[(i+2)*(w+2)+j+1])
+				&& band==aa_band(iters[(i+1)*(w+2)+j]) && band==aa_band(iters[(i+1)*(w+2)+j+2]))
+			{
+				set_color(&rgb[3*((size_t)i*w+j)], iters[(i+1)*(w+2)+j+1]);
+				continue;
+			}
+
+			// Edge pixel: average aa x aa samples centered on the pixel
+			sum[0] = sum[1] = sum[2] = 0;
+			for(a=0; a<aa; a++)
+				for(b=0; b<aa; b++)
+				{
+					z=c_x_min+(c0+j+(b+0.5)/aa-0.5)*(pixel_width)
+						+(c_y_max-(r0+i+(a+0.5)/aa-0.5)*(pixel_height))*I;
+					set_color(px, formula_point(formula, z));
+					sum[0] += px[0];
+					sum[1] += px[1];
+					sum[2] += px[2];
+				}
+			rgb[3*((size_t)i*w+j)] = sum[0]/(aa*aa);
+			rgb[3*((size_t)i*w+j)+1] = sum[1]/(aa*aa);
+			rgb[3*((size_t)i*w+j)+2] = sum[2]/(aa*aa);
+			refined++;
+		}
+
+	return refined;
+}
+
+
+/**
+ * @brief Render the image with adaptive anti-aliasing
+ *
+ * The image is processed in blocks of AA_TILE_ROWS rows, the same unit the
+ * Master/Slave version hands out to its slaves.
+ *
+ * @param c_x_min lowest x boundary of the figure
+ * @param c_y_max highest y boundary of the figure
+ * @param pixel_width width of one pixel
+ * @param pixel_height height of one pixel
+ * @param image_size the resolution of the resulting image
+ * @param aa number of samples per side of a refined pixel
+ * @param formula formula selected on the command line
+ * @param img destination of the image
+ */
+void render_antialiased(double c_x_min, double c_y_max, double pixel_width,
+	double pixel_height, int image_size, int aa, const struct formula *formula, FILE *img)
+{
+	int r0, h, *iters;
+	unsigned char *rgb;
+	long refined;
+
+	iters = malloc((size_t)(AA_TILE_ROWS+2)*(image_size+2)*sizeof(int));
+	rgb = malloc((size_t)3*AA_TILE_ROWS*image_size*sizeof(unsigned char));
+	if(!iters || !rgb)
+	{
+		fprintf(stderr, "Unable to allocate the anti-aliasing buffers\n");
+		exit(1);
+	}
+
+	fprintf(img, "P6\n%d %d 255\n", image_size, image_size);
+
+	refined = 0;
+	for(r0=0; r0<image_size; r0+=AA_TILE_ROWS)
+	{
+		h = image_size-r0<AA_TILE_ROWS ? image_size-r0 : AA_TILE_ROWS;
+		refined += render_aa_block(c_x_min, c_y_max, pixel_width, pixel_height,
+			r0, 0, h, image_size, aa, formula, iters, rgb);
+		fwrite(rgb, 1, (size_t)3*h*image_size, img);
+	}
+
+	printf("Refined pixels: %ld of %ld (%.2f%%)\n", refined, (long)image_size*image_size,
+		100.0*refined/((double)image_size*image_size));
+
+	free(iters);
+	free(rgb);
+}
+
+
+/**
+ * @brief Write the samples of one progressive level as a PPM image
+ *
+ * Only the samples whose row and column are multiples of step are used,
+ * resulting in an image with 1/step of the full resolution.
+ *
+ * @param img destination file
+ * @param iters iteration counts of the full resolution image
+ * @param image_size the full resolution of the image
+ * @param step distance between the samples of the level
+ */
+void write_level(FILE *img, unsigned short *iters, int image_size, int step)
+{
+	int i, j, side;
 	unsigned char *line;
+
+	side = (image_size+step-1)/step;
+	line = malloc(3*side*sizeof(unsigned char));
+
+	fprintf(img, "P6\n%d %d 255\n", side, side);
+	for(i=0; i<image_size; i+=step)
+	{
+		for(j=0; j<image_size; j+=step)
+			set_color(&line[3*(j/step)], iters[(size_t)i*image_size+j]);
+		fwrite(line, 1, 3*side, img);
+	}
+
+	free(line);
+}
+
+
+/**
+ * @brief Render the image coarse-to-fine, writing a preview for each level
+ *
+ * Levels are computed with a distance of PROGRESSIVE_STEP, PROGRESSIVE_STEP/2,
+ * ..., 1 between the samples. A level skips every sample already computed
+ * by the coarser one (even row and even column in its own grid), so the
+ * total number of calls to formula_point() is the same of a plain render.
+ *
+ * @param c_x_min lowest x boundary of the figure
+ * @param c_y_max highest y boundary of the figure
+ * @param pixel_width width of one pixel
+ * @param pixel_height height of one pixel
+ * @param image_size the resolution of the resulting image
+ * @param formula formula selected on the command line
+ * @param img destination of the full resolution image
+ */
+void render_progressive(double c_x_min, double c_y_max, double pixel_width,
+	double pixel_height, int image_size, const struct formula *formula, FILE *img)
+{
+	int i, j, step;
+	unsigned short *iters;
+	char name[64];
 	complex z;
+	FILE *preview;
+
+	iters = malloc((size_t)image_size*image_size*sizeof(unsigned short));
+	if(!iters)
+	{
+		fprintf(stderr, "Unable to allocate the progressive buffer\n");
+		exit(1);
+	}
+
+	for(step=PROGRESSIVE_STEP; step>=1; step/=2)
+	{
+		for(i=0; i<image_size; i+=step)
+		{
+			for(j=0; j<image_size; j+=step)
+			{
+				// Already computed by the coarser level
+				if(step<PROGRESSIVE_STEP && i%(2*step)==0 && j%(2*step)==0)
+					continue;
+				z=c_x_min+j*(pixel_width)+(c_y_max-i*(pixel_height))*I;
+				iters[(size_t)i*image_size+j]=formula_point(formula, z);
+			}
+		}
+
+		if(step>1)
+		{
+			snprintf(name, sizeof(name), "mandelbrot_seq_preview_%d.ppm", step);
+			preview=fopen(name, "w");
+			write_level(preview, iters, image_size, step);
+			fclose(preview);
+		}
+	}
+
+	write_level(img, iters, image_size, 1);
+	free(iters);
+}
+
+
+/**
+ * @brief Render the image with smooth histogram-equalized colors
+ *
+ * The escape times of the whole image stay resident in 16 bits per pixel
+ * between the two passes, so the fractal is computed only once.
+ *
+ * @param c_x_min lowest x boundary of the figure
+ * @param c_y_max highest y boundary of the figure
+ * @param pixel_width width of one pixel
+ * @param pixel_height height of one pixel
+ * @param image_size the resolution of the resulting image
+ * @param formula formula selected on the command line
+ * @param img destination of the image
+ */
+void render_histogram(double c_x_min, double c_y_max, double pixel_width,
+	double pixel_height, int image_size, const struct formula *formula, FILE *img)
+{
+	int i, j;
+	unsigned short *values, v;
+	unsigned char *line;
+	long hist[MAX_ITER];
+	double cdf[MAX_ITER+1];
+	complex z;
+
+	values = malloc((size_t)image_size*image_size*sizeof(unsigned short));
+	line = malloc(3*image_size*sizeof(unsigned char));
+	if(!values || !line)
+	{
+		fprintf(stderr, "Unable to allocate the histogram buffers\n");
+		exit(1);
+	}
+
+	// First pass: escape times and their histogram
+	memset(hist, 0, sizeof(hist));
+	for(i=0; i<image_size; i++)
+	{
+		for(j=0; j<image_size; j++)
+		{
+			z=c_x_min+j*(pixel_width)+(c_y_max-i*(pixel_height))*I;
+			v=pack_smooth(formula_smooth(formula, z));
+			values[(size_t)i*image_size+j]=v;
+			if(v!=SMOOTH_INSIDE)
+				hist[v/SMOOTH_SCALE]++;
+		}
+	}
+
+	histogram_cdf(hist, cdf);
+
+	// Second pass: colors
+	fprintf(img, "P6\n%d %d 255\n", image_size, image_size);
+	for(i=0; i<image_size; i++)
+	{
+		for(j=0; j<image_size; j++)
+			set_smooth_color(&line[3*j], values[(size_t)i*image_size+j], cdf);
+		fwrite(line, 1, 3*image_size, img);
+	}
+
+	free(values);
+	free(line);
+}
+
+
+/**
+ * @brief Compare the float and the double kernels on the given window
+ *
+ * @param c_x_min lowest x boundary of the figure
+ * @param c_y_max highest y boundary of the figure
+ * @param pixel_width width of one pixel
+ * @param pixel_height height of one pixel
+ * @param image_size the resolution of the image
+ * @param automatic precision chosen by select_precision for the window
+ */
+void validate_precision(double c_x_min, double c_y_max, double pixel_width,
+	double pixel_height, int image_size, int automatic)
+{
+	const char *names[] = {"float", "double", "long double"};
+	int i, j, d, max_diff, *row_float, *row_double;
+	long differ;
+	clock_t start, t_float, t_double;
+	struct formula mandel = {formula_power2, 2, 0, 0};
+
+	row_float = malloc(image_size*sizeof(int));
+	row_double = malloc(image_size*sizeof(int));
+
+	differ = 0;
+	max_diff = 0;
+	t_float = t_double = 0;
+	for(i=0; i<image_size; i++)
+	{
+		start = clock();
+		compute_row(PRECISION_FLOAT, i, image_size, c_x_min, c_y_max, pixel_width, pixel_height, NULL, &mandel, row_float);
+		t_float += clock()-start;
+
+		start = clock();
+		compute_row(PRECISION_DOUBLE, i, image_size, c_x_min, c_y_max, pixel_width, pixel_height, NULL, &mandel, row_double);
+		t_double += clock()-start;
+
+		for(j=0; j<image_size; j++)
+		{
+			d = abs(row_float[j]-row_double[j]);
+			if(d)
+				differ++;
+			if(d>max_diff)
+				max_diff = d;
+		}
+	}
+
+	printf("Automatic precision: %s\n", names[automatic]);
+	printf("Pixels differing between float and double: %ld of %ld (%.4f%%)\n", differ,
+		(long)image_size*image_size, 100.0*differ/((double)image_size*image_size));
+	printf("Largest difference: %d iterations\n", max_diff);
+	printf("Kernel time: float %.3fs, double %.3fs\n", (double)t_float/CLOCKS_PER_SEC,
+		(double)t_double/CLOCKS_PER_SEC);
+
+	free(row_float);
+	free(row_double);
+}
+
+
+/**
+ * @brief Create the image file with its final size and map it in memory
+ *
+ * The header is written through the mapping and the kernel is told the
+ * pages will be written sequentially.
+ *
+ * @param name path of the image
+ * @param image_size the resolution of the image
+ * @param hdr returns the size of the header
+ * @param total returns the size of the whole file (and mapping)
+ * @return map pointer to the first byte of the file
+ */
+unsigned char *map_image(const char *name, int image_size, int *hdr, size_t *total)
+{
+	char header[64];
+	unsigned char *map;
+	int fd;
+
+	*hdr = snprintf(header, sizeof(header), "P6\n%d %d 255\n", image_size, image_size);
+	*total = *hdr+(size_t)3*image_size*image_size;
+
+	fd = open(name, O_RDWR|O_CREAT|O_TRUNC, 0644);
+	if(fd<0 || ftruncate(fd, *total))
+	{
+		perror("Unable to create the image");
+		exit(1);
+	}
+
+	map = mmap(NULL, *total, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(map==MAP_FAILED)
+	{
+		perror("Unable to map the image");
+		exit(1);
+	}
+
+	madvise(map, *total, MADV_SEQUENTIAL);
+	memcpy(map, header, *hdr);
+
+	return map;
+}
+
+
+/**
+ * @brief Schedule the write back of a mapped image and unmap it
+ *
+ * @param map pointer returned by map_image
+ * @param total size of the mapping
+ */
+void unmap_image(unsigned char *map, size_t total)
+{
+	msync(map, total, MS_ASYNC);
+	munmap(map, total);
+}
+
+
+int main(int argc, char** argv)
+{
+	double c_x_min, c_x_max, c_y_min, c_y_max, pixel_width, pixel_height;
+	int i, j, k, m, r, image_size, i_x_max, i_y_max, progressive, use_mmap, hdr, aa, *row;
+	int histogram, precision, validate;
+	unsigned char *line, *buffer, *map;
+	size_t total;
+	long double lwin[4];
+	struct formula formula;
 	FILE *img;
 
 	if(argc < 6)
@@ -113,18 +1078,111 @@ int main(int argc, char** argv)
         pixel_height      = (c_y_max - c_y_min) / i_y_max;
     }
 
+	progressive = 0;
+	use_mmap = 0;
+	aa = 1;
+	histogram = 0;
+	precision = PRECISION_DOUBLE;
+	validate = 0;
+	formula.power = 2;
+	formula.julia = 0;
+	formula.c = 0;
+	for(i=6; i<argc; i++)
+	{
+		if(strcmp(argv[i], "--progressive")==0)
+			progressive = 1;
+		else if(strcmp(argv[i], "--validate")==0)
+			validate = 1;
+		else if(strcmp(argv[i], "--precision=auto")==0)
+			precision = PRECISION_AUTO;
+		else if(strcmp(argv[i], "--precision=float")==0)
+			precision = PRECISION_FLOAT;
+		else if(strcmp(argv[i], "--precision=double")==0)
+			precision = PRECISION_DOUBLE;
+		else if(strcmp(argv[i], "--precision=long")==0)
+			precision = PRECISION_LONG;
+		else if(strcmp(argv[i], "--histogram")==0)
+			histogram = 1;
+		else if(strcmp(argv[i], "--mmap")==0)
+			use_mmap = 1;
+		else if(strncmp(argv[i], "--aa=", 5)==0 && sscanf(argv[i]+5, "%d", &aa)==1 && aa>=1)
+			continue;
+		else if(parse_formula(argv[i], &formula))
+			continue;
+		else
+		{
+			print_instructions();
+			exit(1);
+		}
+	}
+
+	if(validate)
+	{
+		validate_precision(c_x_min, c_y_max, pixel_width, pixel_height, image_size,
+			select_precision(c_x_min, c_x_max, c_y_min, c_y_max, pixel_width, pixel_height));
+		return 0;
+	}
+
+	// The float and long double kernels only iterate z^2+c
+	select_formula(&formula);
+	if(formula.power!=2 || formula.julia)
+		precision = PRECISION_DOUBLE;
+
+	if(precision==PRECISION_AUTO)
+	{
+		precision = select_precision(c_x_min, c_x_max, c_y_min, c_y_max, pixel_width, pixel_height);
+		printf("Precision: %s\n", precision==PRECISION_FLOAT ? "float" :
+			precision==PRECISION_DOUBLE ? "double" : "long double");
+	}
+	parse_long_window(argv, lwin);
+
+	if(progressive)
+	{
+		img=fopen("mandelbrot_seq.ppm","w");
+		render_progressive(c_x_min, c_y_max, pixel_width, pixel_height, image_size, &formula, img);
+		fclose(img);
+		return 0;
+	}
+
+	if(histogram)
+	{
+		img=fopen("mandelbrot_seq.ppm","w");
+		render_histogram(c_x_min, c_y_max, pixel_width, pixel_height, image_size, &formula, img);
+		fclose(img);
+		return 0;
+	}
+
+	if(aa>1)
+	{
+		img=fopen("mandelbrot_seq.ppm","w");
+		render_antialiased(c_x_min, c_y_max, pixel_width, pixel_height, image_size, aa, &formula, img);
+		fclose(img);
+		return 0;
+	}
+
 	row = malloc(image_size*sizeof(int));
-	line = malloc(3*image_size*sizeof(unsigned char));
-	img=fopen("mandelbrot_seq.ppm","w");
-	fprintf(img, "P6\n%d %d 255\n", image_size, image_size);
+	if(use_mmap)
+		map = map_image("mandelbrot_seq.ppm", image_size, &hdr, &total);
+	else
+	{
+		buffer = malloc(3*image_size*sizeof(unsigned char));
+		img=fopen("mandelbrot_seq.ppm","w");
+		hdr = fprintf(img, "P6\n%d %d 255\n", image_size, image_size);
+	}
+
+	m = formula_symmetric(&formula) ? mirror_axis(c_y_min, c_y_max, pixel_height) : -1;
 
-	for(i=0; i<i_y_max; i++)
+	for(k=0; k<unique_rows(m, i_y_max); k++)
 	{
-    	for(j=0; j<i_x_max; j++)
-		{
-      		z=c_x_min+j*(pixel_width)+(c_y_max-i*(pixel_height))*I;
-			row[j]=mandelbrot(z);
-    	}
+		i = unique_row(k, m);
+
+		// With --mmap the colors go straight to the row in the file
+		if(use_mmap)
+			line = map+hdr+(size_t)3*image_size*i;
+		else
+			line = buffer;
+
+		compute_row(precision, i, i_x_max, c_x_min, c_y_max, pixel_width, pixel_height, lwin, &formula, row);
 
 		// Fixed color scheme
 		for(j=0; j<image_size; j++)
@@ -150,8 +1208,29 @@ int main(int argc, char** argv)
 			}
 
 		}
-		fwrite(line, 1, 3*image_size, img);
+
+		// Rows are not written in order when the mirrored ones are skipped
+		r = mirror_row(i, m, image_size);
+		if(use_mmap)
+		{
+			if(r>=0)
+				memcpy(map+hdr+(size_t)3*image_size*r, line, 3*image_size);
+		}
+		else
+		{
+			if(m>=0)
+				fseeko(img, hdr+(off_t)3*image_size*i, SEEK_SET);
+			fwrite(line, 1, 3*image_size, img);
+			if(r>=0)
+			{
+				fseeko(img, hdr+(off_t)3*image_size*r, SEEK_SET);
+				fwrite(line, 1, 3*image_size, img);
+			}
+		}
 	}
 
+	if(use_mmap)
+		unmap_image(map, total);
+
 	return 0;
 }
@@ -0,0 +1,1067 @@
+/** @file 	mandelbrot_server.c
+ *	@brief	Tile server that renders mandelbrot viewports on demand
+ *
+ *	Long-running POSIX threads implementation of a tile server which keeps
+ *  a warm pool of workers waiting on a priority queue of tile requests.
+ *  It reuses the same escape time kernel and fixed color scheme of the
+ *  batch programs, so there is no process spawn or MPI_Init latency per
+ *  request, and recently rendered tiles are served from an LRU cache.
+ *
+ *  The whole picture (-2.5 1.5 -2.0 2.0) is split into 2^zoom x 2^zoom
+ *  tiles of tile_size x tile_size pixels, tile (0, 0) being the top left.
+ *
+ *	Usage:
+ *    ./mandelbrot_server socket_path [threads] [tile_size] [cache_tiles] [aa] [options]
+ *		- socket_path: Path of the Unix socket the server listens on
+ *		- threads: Number of worker threads (default 4, at most MAX_THREADS)
+ *		- tile_size: Width and height of every tile in pixels (default 256,
+ *		  at most MAX_TILE_SIZE)
+ *		- cache_tiles: Number of tiles kept in the LRU cache (default 1024,
+ *		  at most MAX_CACHE_TILES)
+ *		- aa: When greater than 1, adaptive anti-aliasing: tiles are rendered
+ *		  at 1x in strips of AA_TILE_ROWS rows and only pixels whose
+ *		  neighbors are in a different iteration band are refined with
+ *		  aa x aa samples (default 1, at most MAX_AA)
+ *	Options (anywhere after socket_path):
+ *		- --power=d: Iterate z^d+c (Multibrot set) instead of z^2+c
+ *		- --julia=re,im: Render the Julia set of the constant re+im*i (with
+ *		  the power of --power) instead of the Mandelbrot set
+ *
+ *	Protocol (one command per line):
+ *		- TILE id zoom x y [ppm|raw] [priority]: Request a tile. The smaller
+ *		  the priority the sooner it is served (0, the default, should be
+ *		  used for visible tiles). Answered by "TILE id nbytes\n" followed by
+ *		  nbytes of a binary PPM or of raw RGB data
+ *		- CANCEL id: Drop the request id if it was not served yet
+ *		- CANCEL *: Drop every pending request of this connection (e.g. when
+ *		  the viewport changed). Dropped requests are answered by
+ *		  "CANCELLED id\n"
+ *		- QUIT: Close the connection
+ *	Malformed commands are answered by "ERROR message\n".
+ *
+ *  Usage example:
+ *      ./mandelbrot_server /tmp/mandelbrot.sock 8 256 4096 4
+ *
+ *	@author		Decio Lauro Soares (deciolauro@gmail.com)
+ *	@date		05 Jul 2017
+ *	@bug		No known bugs
+ *	@warning	Only Unix sockets are supported (no HTTP) and tiles are
+ *				served as PPM or raw RGB (no PNG)
+ * 	@copyright	GNU Public License v3
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <complex.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define MAX_ITER 300
+#define ESCAPE_RADIUS_SQUARED 4
+
+#define FULL_X_MIN -2.5
+#define FULL_Y_MAX 2.0
+#define FULL_SIDE 4.0
+// Tile coordinates below 2^MAX_ZOOM must fit in an int
+#define MAX_ZOOM 30
+#define LINE_SIZE 256
+#define AA_TILE_ROWS 32
+#define AA_BAND 8
+#define MAX_TILE_SIZE 4096
+#define MAX_THREADS 256
+#define MAX_CACHE_TILES (1<<20)
+#define MAX_AA 16
+
+
+/**
+ * @brief Client connection shared by its reader thread and pending jobs
+ */
+struct conn
+{
+	int fd;
+	int refs;
+	int closed;
+	pthread_mutex_t lock;
+};
+
+/**
+ * @brief One queued tile request
+ */
+struct job
+{
+	struct conn *c;
+	long id;
+	int zoom, x, y, raw, prio;
+	unsigned long seq;
+	// Set under the queue lock, polled unlocked by the rendering worker
+	_Atomic int cancelled;
+};
+
+/**
+ * @brief One rendered tile kept in the LRU cache
+ */
+struct tile
+{
+	int zoom, x, y;
+	unsigned char *rgb;
+	struct tile *prev, *next, *hnext;
+};
+
+static int tile_size, aa;
+
+// Priority queue (binary heap ordered by priority and arrival)
+static struct job **heap, **running;
+static int heap_len, heap_cap, nthreads;
+static unsigned long job_seq;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+
+// LRU cache (hash table plus doubly linked list, head is the most recent)
+static struct tile **table, *lru_head, *lru_tail;
+static int table_size, cache_len, cache_cap;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/**
+ * @brief Generate an escape time kernel for one fixed formula
+ *
+ * Every kernel iterates z from the given point adding the constant c,
+ * which is the point itself for the Multibrot sets and a fixed constant
+ * for the Julia sets. The step is pasted into the loop, so each power is
+ * compiled on its own with no branch on the formula while iterating.
+ *
+ * @param name name of the generated function
+ * @param step update of z (and temporaries) for one iteration
+ */
+#define FORMULA_KERNEL(name, step) \
+int name(complex z, complex c, int power) \
+{ \
+	int i; \
+	complex w; \
+ \
+	(void)power; \
+	(void)w; \
+	for(i=1; i<MAX_ITER; i++) \
+	{ \
+		step; \
+		if((creal(z)*creal(z))+(cimag(z)*cimag(z))>ESCAPE_RADIUS_SQUARED) \
+			break; \
+	} \
+ \
+	return i; \
+}
+
+FORMULA_KERNEL(formula_power2, z=z*z+c)
+FORMULA_KERNEL(formula_power3, z=z*z*z+c)
+FORMULA_KERNEL(formula_power4, w=z*z; z=w*w+c)
+FORMULA_KERNEL(formula_power5, w=z*z; z=w*w*z+c)
+FORMULA_KERNEL(formula_power6, w=z*z*z; z=w*w+c)
+
+
+/**
+ * @brief Escape time kernel of z^power+c for the powers without a
+ * specialized kernel
+ *
+ * @param z starting point of the orbit
+ * @param c constant added at every iteration
+ * @param power exponent of z
+ * @return i integer with the number of iterations until divergerce or MAX_ITER
+ */
+int formula_generic(complex z, complex c, int power)
+{
+	int i, k;
+	complex w;
+
+	for(i=1; i<MAX_ITER; i++)
+	{
+		w = z;
+		for(k=1; k<power; k++)
+			w *= z;
+		z = w+c;
+		if((creal(z)*creal(z))+(cimag(z)*cimag(z))>ESCAPE_RADIUS_SQUARED)
+			break;
+	}
+
+	return i;
+}
+
+
+/**
+ * @brief Formula selected on the command line
+ */
+struct formula
+{
+	int (*kernel)(complex z, complex c, int power);
+	int power;
+	int julia;
+	complex c;
+};
+
+static struct formula formula;
+
+
+/**
+ * @brief Parse the --power=d and --julia=re,im options
+ *
+ * @param arg command line argument
+ * @param f formula updated with the option
+ * @return 1 if arg was a formula option, 0 otherwise
+ */
+int parse_formula(const char *arg, struct formula *f)
+{
+	double re, im;
+
+	if(strncmp(arg, "--power=", 8)==0 && sscanf(arg+8, "%d", &f->power)==1 && f->power>=2)
+		return 1;
+	if(strncmp(arg, "--julia=", 8)==0 && sscanf(arg+8, "%lf,%lf", &re, &im)==2)
+	{
+		f->julia = 1;
+		f->c = re+im*I;
+		return 1;
+	}
+	return 0;
+}
+
+
+/**
+ * @brief Pick the kernel for the power of the formula
+ *
+ * @param f formula whose kernel is set
+ */
+void select_formula(struct formula *f)
+{
+	switch(f->power)
+	{
+		case 2: f->kernel = formula_power2; break;
+		case 3: f->kernel = formula_power3; break;
+		case 4: f->kernel = formula_power4; break;
+		case 5: f->kernel = formula_power5; break;
+		case 6: f->kernel = formula_power6; break;
+		default: f->kernel = formula_generic;
+	}
+}
+
+
+/**
+ * @brief Number of iterations of one point with the selected formula
+ *
+ * @param f formula selected by select_formula
+ * @param z point of the complex plane
+ * @return i integer with the number of iterations until divergerce or MAX_ITER
+ */
+int formula_point(const struct formula *f, complex z)
+{
+	return f->kernel(z, f->julia ? f->c : z, f->power);
+}
+
+
+/**
+ * @brief Function responsible for printing usage instructions
+ *
+ * This function is responsible for printing the usage instructions
+ *
+ */
+void print_instructions()
+{
+	printf("usage: ./mandelbrot_server socket_path [threads] [tile_size] [cache_tiles] [aa]\n");
+	printf("    [--power=d] [--julia=re,im]\n");
+	printf("example:\n");
+	printf("    ./mandelbrot_server /tmp/mandelbrot.sock 8 256 4096 4\n");
+	printf("protocol:\n");
+	printf("    TILE id zoom x y [ppm|raw] [priority]\n");
+	printf("    CANCEL id | CANCEL *\n");
+	printf("    QUIT\n");
+}
+
+
+/**
+ * @brief Apply the fixed color scheme to one pixel
+ *
+ * @param px pointer to the 3 bytes (RGB) of the pixel
+ * @param iter number of iterations computed for the pixel
+ */
+void set_color(unsigned char *px, int iter)
+{
+	if(iter==MAX_ITER)
+	{
+		px[0]=255;
+		px[1]=255;
+		px[2]=255;
+	}
+	else if(iter<=63)
+	{
+		px[0]=255;
+		px[1]=255-4*iter;
+		px[2]=255-4*iter;
+	}
+	else
+	{
+		px[0]=255;
+		px[1]=iter-63;
+		px[2]=0;
+	}
+}
+
+
+/**
+ * @brief Iteration band used to detect the pixels that need supersampling
+ *
+ * @param iter number of iterations computed for the pixel
+ * @return the band of the pixel (points of the set have their own band)
+ */
+int aa_band(int iter)
+{
+	return iter==MAX_ITER ? -1 : iter/AA_BAND;
+}
+
+
+/**
+ * @brief Render a block of pixels with adaptive supersampling
+ *
+ * The block and a one pixel halo around it are computed at 1x. Only the
+ * pixels with a 4-neighbor in a different iteration band are refined with
+ * aa x aa samples, whose colors are averaged, so the extra cost follows the
+ * length of the boundaries inside the block instead of its area.
+ *
+ * @param c_x_min x of the sample of column 0
+ * @param c_y_max y of the sample of row 0
+ * @param pixel_width width of one pixel
+ * @param pixel_height height of one pixel
+ * @param r0 first row of the block
+ * @param c0 first column of the block
+ * @param h number of rows of the block
+ * @param w number of columns of the block
+ * @param aa number of samples per side of a refined pixel
+ * @param iters scratch buffer of (h+2)*(w+2) integers
+ * @param rgb output buffer of 3*w*h bytes
+ * @return the number of refined pixels
+ */
+long render_aa_block(double c_x_min, double c_y_max, double pixel_width,
+	double pixel_height, int r0, int c0, int h, int w, int aa, int *iters,
+	unsigned char *rgb)
+{
+	int i, j, a, b, band, sum[3];
+	unsigned char px[3];
+	long refined;
+	complex z;
+
+	for(i=-1; i<=h; i++)
+		for(j=-1; j<=w; j++)
+		{
+			z=c_x_min+(c0+j)*(pixel_width)+(c_y_max-(r0+i)*(pixel_height))*I;
+			iters[(i+1)*(w+2)+j+1]=formula_point(&formula, z);
+		}
+
+	refined = 0;
+	for(i=0; i<h; i++)
+		for(j=0; j<w; j++)
+		{
+			band = aa_band(iters[(i+1)*(w+2)+j+1]);
+			if(band==aa_band(iters[i*(w+2)+j+1]) && band==aa_band(iters[(i+2)*(w+2)+j+1])
+				&& band==aa_band(iters[(i+1)*(w+2)+j]) && band==aa_band(iters[(i+1)*(w+2)+j+2]))
+			{
+				set_color(&rgb[3*((size_t)i*w+j)], iters[(i+1)*(w+2)+j+1]);
+				continue;
+			}
+
+			// Edge pixel: average aa x aa samples centered on the pixel
+			sum[0] = sum[1] = sum[2] = 0;
+			for(a=0; a<aa; a++)
+				for(b=0; b<aa; b++)
+				{
+					z=c_x_min+(c0+j+(b+0.5)/aa-0.5)*(pixel_width)
+						+(c_y_max-(r0+i+(a+0.5)/aa-0.5)*(pixel_height))*I;
+					set_color(px, formula_point(&formula, z));
+					sum[0] += px[0];
+					sum[1] += px[1];
+					sum[2] += px[2];
+				}
+			rgb[3*((size_t)i*w+j)] = sum[0]/(aa*aa);
+			rgb[3*((size_t)i*w+j)+1] = sum[1]/(aa*aa);
+			rgb[3*((size_t)i*w+j)+2] = sum[2]/(aa*aa);
+			refined++;
+		}
+
+	return refined;
+}
+
+
+/**
+ * @brief Write the whole buffer to a socket, retrying on short writes
+ *
+ * @param fd socket descriptor
+ * @param buf data to be written
+ * @param len number of bytes to be written
+ * @return 0 on success or -1 if the peer is gone
+ */
+int write_all(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+	ssize_t n;
+
+	while(len>0)
+	{
+		n = write(fd, p, len);
+		if(n<=0)
+			return -1;
+		p += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+
+/**
+ * @brief Send a reply to a connection, serializing concurrent writers
+ *
+ * @param c destination connection
+ * @param head text header of the reply
+ * @param data optional binary payload (may be NULL)
+ * @param len size of the binary payload
+ */
+void reply(struct conn *c, const char *head, const void *data, size_t len)
+{
+	pthread_mutex_lock(&c->lock);
+	if(!c->closed)
+	{
+		if(write_all(c->fd, head, strlen(head)) || (data && write_all(c->fd, data, len)))
+			c->closed = 1;
+	}
+	pthread_mutex_unlock(&c->lock);
+}
+
+
+/**
+ * @brief Drop one reference to a connection, freeing it on the last one
+ *
+ * @param c connection to be released
+ */
+void conn_release(struct conn *c)
+{
+	int refs;
+
+	pthread_mutex_lock(&c->lock);
+	refs = --c->refs;
+	pthread_mutex_unlock(&c->lock);
+
+	if(refs==0)
+	{
+		close(c->fd);
+		pthread_mutex_destroy(&c->lock);
+		free(c);
+	}
+}
+
+
+/**
+ * @brief Tell whether heap entry a must be served before entry b
+ */
+int job_before(struct job *a, struct job *b)
+{
+	if(a->prio!=b->prio)
+		return a->prio<b->prio;
+	return a->seq<b->seq;
+}
+
+
+/**
+ * @brief Insert a job in the priority queue and wake up one worker
+ *
+ * @param jb job to be queued
+ */
+void queue_push(struct job *jb)
+{
+	int i, p;
+	struct job *tmp;
+
+	pthread_mutex_lock(&queue_lock);
+	if(heap_len==heap_cap)
+	{
+		heap_cap = heap_cap ? 2*heap_cap : 64;
+		heap = realloc(heap, heap_cap*sizeof(*heap));
+		if(!heap)
+		{
+			fprintf(stderr, "Unable to allocate the request queue\n");
+			exit(1);
+		}
+	}
+	jb->seq = job_seq++;
+	i = heap_len++;
+	heap[i] = jb;
+	while(i>0 && job_before(heap[i], heap[p=(i-1)/2]))
+	{
+		tmp = heap[i];
+		heap[i] = heap[p];
+		heap[p] = tmp;
+		i = p;
+	}
+	pthread_cond_signal(&queue_cond);
+	pthread_mutex_unlock(&queue_lock);
+}
+
+
+/**
+ * @brief Remove the most urgent job from the queue, waiting for one
+ *
+ * The job is recorded as the one being served by worker slot, so that it
+ * can still be cancelled while it is rendered.
+ *
+ * @param slot index of the calling worker
+ * @return jb the job to be served
+ */
+struct job *queue_pop(int slot)
+{
+	int i, l, m;
+	struct job *jb, *tmp;
+
+	pthread_mutex_lock(&queue_lock);
+	while(heap_len==0)
+		pthread_cond_wait(&queue_cond, &queue_lock);
+
+	jb = heap[0];
+	heap[0] = heap[--heap_len];
+	i = 0;
+	for(;;)
+	{
+		l = 2*i+1;
+		m = i;
+		if(l<heap_len && job_before(heap[l], heap[m]))
+			m = l;
+		if(l+1<heap_len && job_before(heap[l+1], heap[m]))
+			m = l+1;
+		if(m==i)
+			break;
+		tmp = heap[i];
+		heap[i] = heap[m];
+		heap[m] = tmp;
+		i = m;
+	}
+	running[slot] = jb;
+	pthread_mutex_unlock(&queue_lock);
+
+	return jb;
+}
+
+
+/**
+ * @brief Mark the job of a worker slot as finished
+ *
+ * @param slot index of the calling worker
+ */
+void queue_done(int slot)
+{
+	pthread_mutex_lock(&queue_lock);
+	running[slot] = NULL;
+	pthread_mutex_unlock(&queue_lock);
+}
+
+
+/**
+ * @brief Flag queued and running jobs of a connection as cancelled
+ *
+ * Cancelled jobs stay in the queue and are discarded by the first worker
+ * that pops them, or abandoned between rows if already being rendered.
+ *
+ * @param c connection that owns the jobs
+ * @param id request id to be cancelled or -1 for every request of c
+ */
+void queue_cancel(struct conn *c, long id)
+{
+	int i;
+
+	pthread_mutex_lock(&queue_lock);
+	for(i=0; i<heap_len; i++)
+		if(heap[i]->c==c && (id==-1 || heap[i]->id==id))
+			heap[i]->cancelled = 1;
+	for(i=0; i<nthreads; i++)
+		if(running[i] && running[i]->c==c && (id==-1 || running[i]->id==id))
+			running[i]->cancelled = 1;
+	pthread_mutex_unlock(&queue_lock);
+}
+
+
+/**
+ * @brief Hash the tile coordinates into a cache bucket
+ */
+int tile_hash(int zoom, int x, int y)
+{
+	unsigned long h;
+
+	h = (unsigned long)zoom*2654435761UL;
+	h ^= (unsigned long)x*40503UL + ((unsigned long)y<<16);
+	return (int)(h%table_size);
+}
+
+
+/**
+ * @brief Unlink a tile from the LRU list
+ */
+void lru_unlink(struct tile *t)
+{
+	if(t->prev)
+		t->prev->next = t->next;
+	else
+		lru_head = t->next;
+	if(t->next)
+		t->next->prev = t->prev;
+	else
+		lru_tail = t->prev;
+}
+
+
+/**
+ * @brief Link a tile in the head (most recent position) of the LRU list
+ */
+void lru_push(struct tile *t)
+{
+	t->prev = NULL;
+	t->next = lru_head;
+	if(lru_head)
+		lru_head->prev = t;
+	lru_head = t;
+	if(!lru_tail)
+		lru_tail = t;
+}
+
+
+/**
+ * @brief Copy a cached tile into rgb, refreshing its LRU position
+ *
+ * @return 1 if the tile was in the cache, 0 otherwise
+ */
+int cache_get(int zoom, int x, int y, unsigned char *rgb)
+{
+	struct tile *t;
+
+	if(cache_cap<=0)
+		return 0;
+
+	pthread_mutex_lock(&cache_lock);
+	for(t=table[tile_hash(zoom, x, y)]; t; t=t->hnext)
+		if(t->zoom==zoom && t->x==x && t->y==y)
+			break;
+	if(t)
+	{
+		memcpy(rgb, t->rgb, 3*tile_size*tile_size);
+		lru_unlink(t);
+		lru_push(t);
+	}
+	pthread_mutex_unlock(&cache_lock);
+
+	return t!=NULL;
+}
+
+
+/**
+ * @brief Store a copy of a rendered tile, evicting the least recent one
+ */
+void cache_put(int zoom, int x, int y, const unsigned char *rgb)
+{
+	struct tile *t, **pp;
+	int h;
+
+	if(cache_cap<=0)
+		return;
+
+	pthread_mutex_lock(&cache_lock);
+	h = tile_hash(zoom, x, y);
+	for(t=table[h]; t; t=t->hnext)
+		if(t->zoom==zoom && t->x==x && t->y==y)
+			break;
+
+	if(!t)
+	{
+		if(cache_len==cache_cap)
+		{
+			// Recycle the least recently used tile
+			t = lru_tail;
+			lru_unlink(t);
+			for(pp=&table[tile_hash(t->zoom, t->x, t->y)]; *pp!=t; pp=&(*pp)->hnext);
+			*pp = t->hnext;
+		}
+		else
+		{
+			t = malloc(sizeof(*t));
+			if(t)
+				t->rgb = malloc(3*tile_size*tile_size);
+			if(!t || !t->rgb)
+			{
+				free(t);
+				pthread_mutex_unlock(&cache_lock);
+				return;
+			}
+			cache_len++;
+		}
+		t->zoom = zoom;
+		t->x = x;
+		t->y = y;
+		t->hnext = table[h];
+		table[h] = t;
+	}
+	else
+		lru_unlink(t);
+
+	memcpy(t->rgb, rgb, 3*tile_size*tile_size);
+	lru_push(t);
+	pthread_mutex_unlock(&cache_lock);
+}
+
+
+/**
+ * @brief Render one tile with the fixed color scheme
+ *
+ * Rendering is abandoned between rows (or between strips of AA_TILE_ROWS
+ * rows with anti-aliasing) as soon as the job is cancelled.
+ *
+ * @param jb tile request
+ * @param row scratch buffer of (AA_TILE_ROWS+2)*(tile_size+2) integers
+ * @param rgb output buffer of 3*tile_size*tile_size bytes
+ * @return 0 if the tile was rendered, -1 if it was cancelled
+ */
+int render_tile(struct job *jb, int *row, unsigned char *rgb)
+{
+	double side, c_x_min, c_y_max, pixel_width;
+	int i, j, h;
+	unsigned char *line;
+	complex z;
+
+	side = FULL_SIDE/(double)(1L<<jb->zoom);
+	c_x_min = FULL_X_MIN+jb->x*side;
+	c_y_max = FULL_Y_MAX-jb->y*side;
+	pixel_width = side/tile_size;
+
+	if(aa>1)
+	{
+		for(i=0; i<tile_size; i+=AA_TILE_ROWS)
+		{
+			if(jb->cancelled)
+				return -1;
+			h = tile_size-i<AA_TILE_ROWS ? tile_size-i : AA_TILE_ROWS;
+			render_aa_block(c_x_min, c_y_max, pixel_width, pixel_width,
+				i, 0, h, tile_size, aa, row, rgb+(size_t)3*tile_size*i);
+		}
+		return 0;
+	}
+
+	for(i=0; i<tile_size; i++)
+	{
+		if(jb->cancelled)
+			return -1;
+
+		for(j=0; j<tile_size; j++)
+		{
+			z=c_x_min+j*(pixel_width)+(c_y_max-i*(pixel_width))*I;
+			row[j]=formula_point(&formula, z);
+		}
+
+		line = rgb+3*tile_size*i;
+		for(j=0; j<tile_size; j++)
+		{
+			if(row[j]<=63)
+			{
+				line[3*j]=255;
+				line[3*j+1]=255-4*row[j];
+				line[3*j+2]=255-4*row[j];
+			}
+			else
+			{
+				line[3*j]=255;
+				line[3*j+1]=row[j]-63;
+				line[3*j+2]=0;
+			}
+			if(row[j]==MAX_ITER)
+			{
+				line[3*j]=255;
+				line[3*j+1]=255;
+				line[3*j+2]=255;
+			}
+		}
+	}
+
+	return 0;
+}
+
+
+/**
+ * @brief Worker thread: serve queued tiles forever
+ *
+ * The payload buffer keeps room for the PPM header right before the pixels,
+ * so both formats are sent with a single write.
+ */
+void *worker(void *arg)
+{
+	struct job *jb;
+	char head[LINE_SIZE], ppm[64];
+	unsigned char *payload, *rgb;
+	int *row, hdr, slot;
+
+	slot = (int)(long)arg;
+	row = malloc((size_t)(AA_TILE_ROWS+2)*(tile_size+2)*sizeof(int));
+	payload = malloc(sizeof(ppm)+3*tile_size*tile_size);
+	if(!row || !payload)
+	{
+		fprintf(stderr, "Unable to allocate the worker buffers\n");
+		exit(1);
+	}
+	rgb = payload+sizeof(ppm);
+
+	for(;;)
+	{
+		jb = queue_pop(slot);
+
+		if(!jb->cancelled && !cache_get(jb->zoom, jb->x, jb->y, rgb))
+		{
+			if(render_tile(jb, row, rgb)==0)
+				cache_put(jb->zoom, jb->x, jb->y, rgb);
+		}
+
+		if(jb->cancelled)
+		{
+			snprintf(head, sizeof(head), "CANCELLED %ld\n", jb->id);
+			reply(jb->c, head, NULL, 0);
+		}
+		else if(jb->raw)
+		{
+			snprintf(head, sizeof(head), "TILE %ld %d\n", jb->id, 3*tile_size*tile_size);
+			reply(jb->c, head, rgb, 3*tile_size*tile_size);
+		}
+		else
+		{
+			hdr = snprintf(ppm, sizeof(ppm), "P6\n%d %d 255\n", tile_size, tile_size);
+			memcpy(rgb-hdr, ppm, hdr);
+			snprintf(head, sizeof(head), "TILE %ld %d\n", jb->id, hdr+3*tile_size*tile_size);
+			reply(jb->c, head, rgb-hdr, hdr+3*tile_size*tile_size);
+		}
+
+		queue_done(slot);
+		conn_release(jb->c);
+		free(jb);
+	}
+
+	return NULL;
+}
+
+
+/**
+ * @brief Parse one command line of a client and act on it
+ *
+ * @param c client connection
+ * @param cmd NUL terminated command line (without the newline)
+ * @return 0 to keep reading, -1 to close the connection
+ */
+int handle_command(struct conn *c, char *cmd)
+{
+	struct job *jb;
+	char fmt[8], err[LINE_SIZE];
+	long id;
+	int zoom, x, y, prio, n;
+
+	if(strncmp(cmd, "TILE ", 5)==0)
+	{
+		strcpy(fmt, "ppm");
+		prio = 0;
+		n = sscanf(cmd+5, "%ld %d %d %d %7s %d", &id, &zoom, &x, &y, fmt, &prio);
+		if(n<4 || zoom<0 || zoom>MAX_ZOOM || x<0 || y<0 || x>=(1L<<zoom) || y>=(1L<<zoom)
+			|| (strcmp(fmt, "ppm") && strcmp(fmt, "raw")))
+		{
+			snprintf(err, sizeof(err), "ERROR bad request: %.200s\n", cmd);
+			reply(c, err, NULL, 0);
+			return 0;
+		}
+
+		jb = calloc(1, sizeof(*jb));
+		if(!jb)
+		{
+			reply(c, "ERROR out of memory\n", NULL, 0);
+			return 0;
+		}
+		jb->c = c;
+		jb->id = id;
+		jb->zoom = zoom;
+		jb->x = x;
+		jb->y = y;
+		jb->raw = strcmp(fmt, "raw")==0;
+		jb->prio = prio;
+
+		pthread_mutex_lock(&c->lock);
+		c->refs++;
+		pthread_mutex_unlock(&c->lock);
+		queue_push(jb);
+	}
+	else if(strcmp(cmd, "CANCEL *")==0)
+		queue_cancel(c, -1);
+	else if(sscanf(cmd, "CANCEL %ld", &id)==1)
+		queue_cancel(c, id);
+	else if(strcmp(cmd, "QUIT")==0)
+		return -1;
+	else if(cmd[0]!='\0')
+	{
+		snprintf(err, sizeof(err), "ERROR unknown command: %.200s\n", cmd);
+		reply(c, err, NULL, 0);
+	}
+
+	return 0;
+}
+
+
+/**
+ * @brief Connection thread: read commands until the client goes away
+ *
+ * When the client disconnects every job still queued for it is cancelled.
+ */
+void *client(void *arg)
+{
+	struct conn *c = arg;
+	char buf[LINE_SIZE], *nl, *start;
+	size_t len = 0;
+	ssize_t n;
+	int quit = 0;
+
+	while(!quit && (n = read(c->fd, buf+len, sizeof(buf)-1-len))>0)
+	{
+		len += n;
+		buf[len] = '\0';
+		start = buf;
+		while(!quit && (nl = strchr(start, '\n')))
+		{
+			*nl = '\0';
+			if(nl>start && nl[-1]=='\r')
+				nl[-1] = '\0';
+			quit = handle_command(c, start)!=0;
+			start = nl+1;
+		}
+		len -= start-buf;
+		memmove(buf, start, len);
+		// Discard lines that do not fit in the buffer
+		if(len==sizeof(buf)-1)
+			len = 0;
+	}
+
+	queue_cancel(c, -1);
+	pthread_mutex_lock(&c->lock);
+	c->closed = 1;
+	pthread_mutex_unlock(&c->lock);
+	shutdown(c->fd, SHUT_RDWR);
+	conn_release(c);
+
+	return NULL;
+}
+
+
+int main(int argc, char** argv)
+{
+	int i, n, sock, fd, *positional[4];
+	struct sockaddr_un addr;
+	struct conn *c;
+	pthread_t th;
+
+	if(argc < 2)
+	{
+		print_instructions();
+		exit(0);
+	}
+
+	nthreads = 4;
+	tile_size = 256;
+	cache_cap = 1024;
+	aa = 1;
+	formula.power = 2;
+	formula.julia = 0;
+	formula.c = 0;
+	positional[0] = &nthreads;
+	positional[1] = &tile_size;
+	positional[2] = &cache_cap;
+	positional[3] = &aa;
+	for(i=2, n=0; i<argc; i++)
+	{
+		if(parse_formula(argv[i], &formula))
+			continue;
+		else if(strncmp(argv[i], "--", 2)==0 || n>=4 || sscanf(argv[i], "%d", positional[n])!=1)
+		{
+			print_instructions();
+			exit(1);
+		}
+		n++;
+	}
+	select_formula(&formula);
+
+	if(nthreads<1 || nthreads>MAX_THREADS || tile_size<1 || tile_size>MAX_TILE_SIZE
+		|| cache_cap<0 || cache_cap>MAX_CACHE_TILES || aa<1 || aa>MAX_AA
+		|| strlen(argv[1])>=sizeof(addr.sun_path))
+	{
+		print_instructions();
+		exit(1);
+	}
+
+	table_size = cache_cap>0 ? 2*cache_cap+1 : 1;
+	table = calloc(table_size, sizeof(*table));
+	running = calloc(nthreads, sizeof(*running));
+	if(!table || !running)
+	{
+		fprintf(stderr, "Unable to allocate the tile cache\n");
+		exit(1);
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, argv[1]);
+	unlink(argv[1]);
+
+	sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(sock<0 || bind(sock, (struct sockaddr *)&addr, sizeof(addr)) || listen(sock, 64))
+	{
+		perror("Unable to listen on the socket");
+		exit(1);
+	}
+
+	// Warm worker pool
+	for(i=0; i<nthreads; i++)
+	{
+		if(pthread_create(&th, NULL, worker, (void *)(long)i))
+		{
+			fprintf(stderr, "Unable to create the worker threads\n");
+			exit(1);
+		}
+		pthread_detach(th);
+	}
+
+	printf("Serving %dx%d tiles on %s with %d threads\n", tile_size, tile_size, argv[1], nthreads);
+	fflush(stdout);
+
+	for(;;)
+	{
+		fd = accept(sock, NULL, NULL);
+		if(fd<0)
+			continue;
+
+		c = calloc(1, sizeof(*c));
+		if(!c)
+		{
+			close(fd);
+			continue;
+		}
+		c->fd = fd;
+		c->refs = 1;
+		pthread_mutex_init(&c->lock, NULL);
+
+		if(pthread_create(&th, NULL, client, c))
+		{
+			close(fd);
+			pthread_mutex_destroy(&c->lock);
+			free(c);
+			continue;
+		}
+		pthread_detach(th);
+	}
+
+	return 0;
+}
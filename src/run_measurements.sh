@@ -10,7 +10,7 @@ MESSAGE="Starting stats with: "
 
 SIZE=$INITIAL_SIZE
 
-NAMES=('mandelbrot_seq' 'mandelbrot_mpi' 'mandelbrot_mpi_op' 'mandelbrot_mpi_io' 'mandelbrot_mpi_io_pp' 'mandelbrot_mpi_ms')
+NAMES=('mandelbrot_seq' 'mandelbrot_mpi' 'mandelbrot_mpi_op' 'mandelbrot_mpi_io' 'mandelbrot_mpi_io_pp' 'mandelbrot_mpi_ms' 'mandelbrot_mpi_hms')
 #NAMES=('mandelbrot_seq' 'mandelbrot_mpi')
 
 make